@@ -0,0 +1,408 @@
+#include "io.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <spawn.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+
+namespace
+{
+
+const size_t g_kb = 1024;
+const size_t g_mb = g_kb * 1024;
+
+const size_t g_filesPerDirectory = 1000;
+const size_t g_maxMixedSize = 256 * g_mb;
+const double g_mixedSigma = 2;
+// Argument bytes of one sha3_batch call, well below ARG_MAX.
+const size_t g_maxArgumentBytes = g_mb;
+const size_t g_blockSize = g_mb;
+
+struct Corpus
+{
+  std::string name;
+  std::vector<std::string> files;
+  uint64_t bytes = 0;
+};
+
+struct Run
+{
+  double seconds = 0;
+  double user = 0; // CPU seconds of the tools and the benchmark feeding them.
+  double system = 0;
+  bool ok = true;
+};
+
+uint64_t splitmix64(uint64_t &state)
+{
+  uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+// Uniform in (0, 1). Standard distributions aren't reproducible across standard libraries.
+double uniform(uint64_t &state) { return ((splitmix64(state) >> 11) + 0.5) / 9007199254740992.0; }
+
+std::vector<size_t> fileSizes(const std::string &corpus, const IoOptions &options)
+{
+  uint64_t state = options.seed;
+  std::vector<size_t> sizes;
+  if (corpus == "huge")
+  {
+    sizes.assign(options.hugeFiles, options.hugeSize);
+  }
+  else if (corpus == "tiny")
+  {
+    for (size_t i = 0; i < options.tinyFiles; ++i)
+    {
+      sizes.push_back(1 + splitmix64(state) % std::max<size_t>(options.tinyMaxSize, 1));
+    }
+  }
+  else if (corpus == "mixed")
+  {
+    for (size_t i = 0; i < options.mixedFiles; ++i)
+    {
+      // Box-Muller transform.
+      double z = std::sqrt(-2 * std::log(uniform(state))) * std::cos(2 * M_PI * uniform(state));
+      double size = std::exp(std::log(double(options.mixedMedianSize)) + g_mixedSigma * z);
+      sizes.push_back(static_cast<size_t>(std::min(size, double(g_maxMixedSize))));
+    }
+  }
+  return sizes;
+}
+
+// Huge and tiny corpora are flat directories of g_filesPerDirectory files, mixed one is two levels deep.
+std::string filePath(const std::string &root, const std::string &corpus, size_t i)
+{
+  std::string path = root + '/' + std::to_string(i / g_filesPerDirectory);
+  if (corpus == "mixed")
+  {
+    path += '/' + std::to_string(i / 100 % 10);
+  }
+  return path + '/' + std::to_string(i);
+}
+
+bool writeFile(const std::string &path, size_t size, uint64_t seed, std::vector<uint64_t> &block)
+{
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+  {
+    return false;
+  }
+  uint64_t state = seed;
+  bool ok = true;
+  for (size_t written = 0; ok && written < size;)
+  {
+    size_t n = std::min(size - written, block.size() * sizeof(uint64_t));
+    for (size_t w = 0; w < (n + 7) / 8; ++w)
+    {
+      block[w] = splitmix64(state);
+    }
+    ok = write(fd, block.data(), n) == ssize_t(n);
+    written += n;
+  }
+  return close(fd) == 0 && ok;
+}
+
+// Reuses the corpus if it was generated with the same parameters, the stamp file is written last.
+bool prepareCorpus(const std::string &name, const IoOptions &options, Corpus &corpus)
+{
+  namespace fs = std::filesystem;
+  std::vector<size_t> sizes = fileSizes(name, options);
+  std::string root = options.directory + '/' + name;
+  std::string stamp = root + "/corpus.txt";
+  size_t sizeParameter = name == "huge" ? options.hugeSize : name == "tiny" ? options.tinyMaxSize
+                                                                          : options.mixedMedianSize;
+  std::string description = name + " files " + std::to_string(sizes.size()) + " size " +
+                            std::to_string(sizeParameter) + " seed " + std::to_string(options.seed);
+
+  corpus.name = name;
+  for (size_t i = 0; i < sizes.size(); ++i)
+  {
+    corpus.files.push_back(filePath(root, name, i));
+    corpus.bytes += sizes[i];
+  }
+
+  std::ifstream existing(stamp);
+  std::string line;
+  if (std::getline(existing, line) && line == description)
+  {
+    return true;
+  }
+
+  std::cerr << "Generating " << name << " corpus: " << sizes.size() << " files, " << corpus.bytes / g_mb << " MB"
+            << std::endl;
+  std::error_code ec;
+  fs::remove_all(root, ec);
+  std::vector<uint64_t> block(g_blockSize / sizeof(uint64_t));
+  for (size_t i = 0; i < sizes.size(); ++i)
+  {
+    fs::create_directories(fs::path(corpus.files[i]).parent_path(), ec);
+    uint64_t seed = options.seed ^ (i * 0xd1b54a32d192ed03ull);
+    if (!writeFile(corpus.files[i], sizes[i], seed, block))
+    {
+      std::cerr << "Can't write " << corpus.files[i] << ": " << std::strerror(errno) << std::endl;
+      return false;
+    }
+  }
+  sync();
+  std::ofstream(stamp) << description << std::endl;
+  return true;
+}
+
+// Root drops page, dentry and inode caches. Otherwise the corpus pages are evicted by fadvise,
+// the file data is read from disk but metadata stays cached.
+std::string dropCaches(const Corpus &corpus)
+{
+  sync();
+  std::ofstream drop("/proc/sys/vm/drop_caches");
+  if (drop << "3" << std::flush)
+  {
+    return "cold-drop";
+  }
+  for (auto &file : corpus.files)
+  {
+    int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0)
+    {
+      posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+      close(fd);
+    }
+  }
+  return "cold-fadvise";
+}
+
+double seconds(const timeval &t) { return t.tv_sec + t.tv_usec / 1e6; }
+
+// Starts the tool with stdout discarded and stdin from the descriptor, returns the process id or -1.
+pid_t spawn(const std::vector<std::string> &args, int input)
+{
+  std::vector<char *> argv;
+  for (auto &arg : args)
+  {
+    argv.push_back(const_cast<char *>(arg.c_str()));
+  }
+  argv.push_back(nullptr);
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+  if (input >= 0)
+  {
+    posix_spawn_file_actions_adddup2(&actions, input, STDIN_FILENO);
+  }
+  pid_t pid = -1;
+  if (posix_spawnp(&pid, argv[0], &actions, nullptr, argv.data(), environ) != 0)
+  {
+    pid = -1;
+  }
+  posix_spawn_file_actions_destroy(&actions);
+  return pid;
+}
+
+bool wait(pid_t pid, Run &run)
+{
+  int status = 0;
+  rusage usage{};
+  if (pid < 0 || wait4(pid, &status, 0, &usage) != pid)
+  {
+    return false;
+  }
+  run.user += seconds(usage.ru_utime);
+  run.system += seconds(usage.ru_stime);
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// The file is read by the benchmark and written into a pipe, as in "cat file | sha3".
+bool feedPipe(const std::string &file, const std::vector<std::string> &args, Run &run, std::vector<uint8_t> &buffer)
+{
+  int fds[2];
+  int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0 || pipe2(fds, O_CLOEXEC) != 0)
+  {
+    if (fd >= 0)
+    {
+      close(fd);
+    }
+    return false;
+  }
+  pid_t pid = spawn(args, fds[0]);
+  close(fds[0]);
+  bool ok = pid >= 0;
+  ssize_t n;
+  while (ok && (n = read(fd, buffer.data(), buffer.size())) > 0)
+  {
+    for (ssize_t done = 0; ok && done < n;)
+    {
+      ssize_t w = write(fds[1], buffer.data() + done, n - done);
+      ok = w > 0;
+      done += w;
+    }
+  }
+  close(fds[1]);
+  close(fd);
+  return wait(pid, run) && ok;
+}
+
+Run runPipeline(const std::string &pipeline, const Corpus &corpus, const IoOptions &options,
+                const std::string &sha3, const std::string &sha3Batch)
+{
+  Run run;
+  std::string digest = std::to_string(options.digestSize);
+  rusage selfStart{};
+  getrusage(RUSAGE_SELF, &selfStart);
+  auto start = std::chrono::steady_clock::now();
+
+  if (pipeline == "sha3")
+  {
+    for (auto &file : corpus.files)
+    {
+      run.ok = wait(spawn({sha3, "-d", digest, file}, -1), run) && run.ok;
+    }
+  }
+  else if (pipeline == "sha3-pipe")
+  {
+    std::vector<uint8_t> buffer(g_blockSize);
+    for (auto &file : corpus.files)
+    {
+      run.ok = feedPipe(file, {sha3, "-d", digest}, run, buffer) && run.ok;
+    }
+  }
+  else if (pipeline == "sha3_batch")
+  {
+    // Split into calls like xargs does.
+    for (size_t first = 0; first < corpus.files.size();)
+    {
+      std::vector<std::string> args = {sha3Batch, "-c", "-d", digest};
+      size_t bytes = 0;
+      for (; first < corpus.files.size() && bytes < g_maxArgumentBytes; ++first)
+      {
+        args.push_back(corpus.files[first]);
+        bytes += corpus.files[first].size() + 1 + sizeof(char *);
+      }
+      run.ok = wait(spawn(args, -1), run) && run.ok;
+    }
+  }
+
+  run.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  rusage selfEnd{};
+  getrusage(RUSAGE_SELF, &selfEnd);
+  run.user += seconds(selfEnd.ru_utime) - seconds(selfStart.ru_utime);
+  run.system += seconds(selfEnd.ru_stime) - seconds(selfStart.ru_stime);
+  return run;
+}
+
+bool known(const std::vector<std::string> &names, const std::vector<std::string> &allowed, const char *what)
+{
+  for (auto &name : names)
+  {
+    if (std::find(allowed.begin(), allowed.end(), name) == allowed.end())
+    {
+      std::cerr << "Unknown " << what << ' ' << name << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+std::string toolPath(const std::string &option, const char *built, const char *name)
+{
+  if (!option.empty())
+  {
+    return option;
+  }
+  return built[0] != '\0' ? built : name;
+}
+
+} // namespace
+
+int runIo(std::ostream &out, const IoOptions &options)
+{
+#ifdef SHA3_BENCHMARK_SHA3
+  const char *builtSha3 = SHA3_BENCHMARK_SHA3;
+#else
+  const char *builtSha3 = "";
+#endif
+#ifdef SHA3_BENCHMARK_SHA3_BATCH
+  const char *builtSha3Batch = SHA3_BENCHMARK_SHA3_BATCH;
+#else
+  const char *builtSha3Batch = "";
+#endif
+  if (!known(options.corpora, {"huge", "tiny", "mixed"}, "corpus") ||
+      !known(options.pipelines, {"sha3", "sha3-pipe", "sha3_batch"}, "pipeline") ||
+      !known(options.caches, {"cold", "warm"}, "cache mode"))
+  {
+    return EXIT_FAILURE;
+  }
+  // A tool failing while reading its stdin pipe is reported by its exit status.
+  signal(SIGPIPE, SIG_IGN);
+  const std::string sha3 = toolPath(options.sha3, builtSha3, "sha3");
+  const std::string sha3Batch = toolPath(options.sha3Batch, builtSha3Batch, "sha3_batch");
+
+  out << "Corpus,Pipeline,Cache,Files,MB,Runs,Median s,Files/s,MB/s,CPU %,User s,System s" << std::endl;
+  bool ok = true;
+  for (auto &name : options.corpora)
+  {
+    Corpus corpus;
+    if (!prepareCorpus(name, options, corpus))
+    {
+      return EXIT_FAILURE;
+    }
+    if (corpus.files.empty())
+    {
+      std::cerr << "Skipping empty corpus " << name << std::endl;
+      continue;
+    }
+    for (auto &pipeline : options.pipelines)
+    {
+      if (pipeline != "sha3_batch" && corpus.files.size() > options.maxProcessFiles)
+      {
+        std::cerr << "Skipping " << pipeline << " on " << name << ": " << corpus.files.size()
+                  << " files need a process each" << std::endl;
+        continue;
+      }
+      for (auto &cache : options.caches)
+      {
+        std::string cacheName = cache;
+        if (cache == "warm")
+        {
+          runPipeline(pipeline, corpus, options, sha3, sha3Batch);
+        }
+        std::vector<Run> runs;
+        for (size_t i = 0; i < options.runs; ++i)
+        {
+          if (cache == "cold")
+          {
+            cacheName = dropCaches(corpus);
+          }
+          runs.push_back(runPipeline(pipeline, corpus, options, sha3, sha3Batch));
+          ok = ok && runs.back().ok;
+        }
+        std::sort(runs.begin(), runs.end(), [](const Run &a, const Run &b) { return a.seconds < b.seconds; });
+        const Run &median = runs[runs.size() / 2];
+        double cpu = median.user + median.system;
+        out << name << ',' << pipeline << ',' << cacheName << ',' << corpus.files.size() << ','
+            << double(corpus.bytes) / g_mb << ',' << runs.size() << ',' << median.seconds << ','
+            << corpus.files.size() / median.seconds << ',' << corpus.bytes / median.seconds / g_mb << ','
+            << cpu / median.seconds * 100 << ',' << median.user << ',' << median.system << std::endl;
+      }
+    }
+  }
+  if (!ok)
+  {
+    std::cerr << "Some tool runs failed" << std::endl;
+  }
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
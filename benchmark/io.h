@@ -0,0 +1,31 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+struct IoOptions
+{
+  std::string directory = "sha3_io_corpus"; // Corpora are generated once and reused by later runs.
+  std::vector<std::string> corpora = {"huge", "tiny", "mixed"};
+  std::vector<std::string> pipelines = {"sha3", "sha3-pipe", "sha3_batch"};
+  std::vector<std::string> caches = {"cold", "warm"};
+  size_t runs = 3;
+  size_t digestSize = 256;
+  size_t hugeFiles = 4;
+  size_t hugeSize = size_t(1) << 30;
+  size_t tinyFiles = 1000000;
+  size_t tinyMaxSize = 4096;
+  size_t mixedFiles = 100000;
+  size_t mixedMedianSize = 16 * 1024; // Sizes are lognormal with sigma 2, at most 256 MB.
+  size_t maxProcessFiles = 1000; // Larger corpora skip the pipelines starting a process per file.
+  uint64_t seed = 1;
+  std::string sha3;      // Empty means the sha3 built with the benchmark.
+  std::string sha3Batch; // Empty means the sha3_batch built with the benchmark.
+};
+
+// Generates reproducible file corpora on disk and times the CLI tools hashing them end to end,
+// with the page cache dropped before every run and warm. CPU % is user and system time of the tools
+// over wall time, 100 per busy core. Returns process exit code.
+int runIo(std::ostream &out, const IoOptions &options);
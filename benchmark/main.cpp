@@ -11,6 +11,13 @@
 #include <algorithm>
 #include "sha3_cpu.h"
 #include "sha3_gpu.h"
+#include "suite.h"
+#include "scaling.h"
+#include "nonce.h"
+#include "io.h"
+#ifdef SHA3_BENCHMARK_OPENSSL
+#include "openssl_compare.h"
+#endif // SHA3_BENCHMARK_OPENSSL
 #include <CLI/CLI.hpp>
 
 namespace
@@ -18,6 +25,11 @@ namespace
 
 const std::string g_singleSubcommand = "single";
 const std::string g_batchSubcommand = "batch";
+const std::string g_suiteSubcommand = "suite";
+const std::string g_scalingSubcommand = "scaling";
+const std::string g_nonceSubcommand = "nonce";
+const std::string g_opensslSubcommand = "openssl";
+const std::string g_ioSubcommand = "io";
 
 const size_t g_kb = 1024;
 const size_t g_mb = g_kb * 1024;
@@ -171,10 +183,11 @@ void runBatchTest(std::ostream &out, const std::size_t digestSize, const std::ve
     }
     switch (t)
     {
+    // Batches smaller than the granularity stay as they are.
     case RunType::Cpu:
-      return batchSize / cpu.batchSize() * cpu.batchSize();
+      return batchSize < cpu.granularity() ? batchSize : batchSize / cpu.granularity() * cpu.granularity();
     case RunType::Gpu:
-      return batchSize / gpu.batchSize() * gpu.batchSize();
+      return batchSize < gpu.granularity() ? batchSize : batchSize / gpu.granularity() * gpu.granularity();
     default:
       assert(false);
       return size_t(0);
@@ -269,6 +282,93 @@ int main(int argc, const char *argv[])
   auto batch = app.add_subcommand(g_batchSubcommand, "benchmark of batch sha3");
   addCommonCli(batch, batchSizes, true);
 
+  SuiteOptions suiteOptions;
+  auto suite = app.add_subcommand(g_suiteSubcommand, "statistically repeated cpu kernel microbenchmarks");
+  suite->add_option("-b,--batch", suiteOptions.batchSize, "Messages per batch call", true);
+  suite->add_set("-d,--digest", suiteOptions.digestSize, {224, 256, 384, 512}, "Digest length", true);
+  suite->add_option("-r,--runs", suiteOptions.runs, "Measured runs per case", true)
+      ->check(CLI::Range(size_t(1), std::numeric_limits<size_t>::max()));
+  suite->add_option("--min-sample", suiteOptions.minSampleSeconds, "Minimal duration of one run in seconds", true);
+  suite->add_option("--min-size", suiteOptions.minSize, "Minimal message size of the sweep", true);
+  suite->add_option("--max-size", suiteOptions.maxSize, "Maximal message size of the sweep", true);
+  suite->add_option("--prefix-size", suiteOptions.prefixSize, "Shared prefix size of the prefix path", true);
+  suite->add_option("-p,--paths", suiteOptions.paths,
+                    "Benchmarked paths: permutation, absorb, single, batch, prefix, multistream", true);
+  suite->add_option("-j,--json", suiteOptions.jsonFile, "Write results to JSON file");
+  suite->add_option("--compare", suiteOptions.baselineFile, "Compare results with JSON baseline")
+      ->check(CLI::ExistingFile);
+  suite->add_option("-t,--threshold", suiteOptions.threshold, "Regression threshold in percents", true);
+  suite->add_flag("--perf", suiteOptions.perf, "Read hardware performance counters (linux only)");
+  suite->add_option("-o,--output-file", outFilename, "Output file (STDIN if not specified)");
+
+  ScalingOptions scalingOptions;
+  auto scaling = app.add_subcommand(g_scalingSubcommand, "cpu batch thread scaling with message size distributions");
+  scaling->add_set("-d,--digest", scalingOptions.digestSize, {224, 256, 384, 512}, "Digest length", true);
+  scaling->add_option("-m,--messages", scalingOptions.messages, "Messages per batch call", true)
+      ->check(CLI::Range(size_t(1), std::numeric_limits<size_t>::max()));
+  scaling->add_option("-r,--calls", scalingOptions.calls, "Measured calls per thread count", true)
+      ->check(CLI::Range(size_t(1), std::numeric_limits<size_t>::max()));
+  scaling->add_option("-t,--max-threads", scalingOptions.maxThreads, "Maximal thread count (all processors if 0)");
+  scaling->add_set("--distribution", scalingOptions.distribution, {"uniform", "lognormal", "zipf"},
+                   "Message size distribution", true);
+  scaling->add_option("--min-size", scalingOptions.minSize, "Minimal message size", true);
+  scaling->add_option("--max-size", scalingOptions.maxSize, "Maximal message size", true);
+  scaling->add_option("--median-size", scalingOptions.medianSize, "Median message size of lognormal", true);
+  scaling->add_option("--sigma", scalingOptions.sigma, "Sigma of lognormal", true);
+  scaling->add_option("--zipf-exponent", scalingOptions.zipfExponent, "Exponent of zipf", true);
+  scaling->add_option("--seed", scalingOptions.seed, "Seed of size generator", true);
+  scaling->add_flag("--perf", scalingOptions.perf, "Read hardware performance counters (linux only)");
+  scaling->add_option("-o,--output-file", outFilename, "Output file (STDIN if not specified)");
+
+  NonceOptions nonceOptions;
+  auto nonce = app.add_subcommand(g_nonceSubcommand, "nonce search engine against SHA3_cpu loop");
+  nonce->add_set("-d,--digest", nonceOptions.digestSize, {224, 256, 384, 512}, "Digest length", true);
+  nonce->add_option("-c,--challenge-size", nonceOptions.challengeSize, "Challenge size", true);
+  nonce->add_option("-a,--attempts", nonceOptions.attempts, "Attempts of the search engine", true)
+      ->check(CLI::Range(size_t(1), std::numeric_limits<size_t>::max()));
+  nonce->add_option("-n,--naive-attempts", nonceOptions.naiveAttempts, "Attempts of SHA3_cpu loop", true)
+      ->check(CLI::Range(size_t(1), std::numeric_limits<size_t>::max()));
+  nonce->add_option("-o,--output-file", outFilename, "Output file (STDIN if not specified)");
+
+  IoOptions ioOptions;
+  auto io = app.add_subcommand(g_ioSubcommand, "sha3 and sha3_batch hashing generated file corpora, cold and warm");
+  io->add_option("--dir", ioOptions.directory, "Directory of the corpora, generated on the first run", true);
+  io->add_option("-c,--corpora", ioOptions.corpora, "Corpora: huge, tiny, mixed", true);
+  io->add_option("-p,--pipelines", ioOptions.pipelines, "Pipelines: sha3, sha3-pipe, sha3_batch", true);
+  io->add_option("--cache", ioOptions.caches, "Page cache modes: cold, warm", true);
+  io->add_option("-r,--runs", ioOptions.runs, "Measured runs per case", true)
+      ->check(CLI::Range(size_t(1), std::numeric_limits<size_t>::max()));
+  io->add_set("-d,--digest", ioOptions.digestSize, {224, 256, 384, 512}, "Digest length", true);
+  io->add_option("--huge-files", ioOptions.hugeFiles, "Files of the huge corpus", true);
+  io->add_option("--huge-size", ioOptions.hugeSize, "File size of the huge corpus", true);
+  io->add_option("--tiny-files", ioOptions.tinyFiles, "Files of the tiny corpus", true);
+  io->add_option("--tiny-max-size", ioOptions.tinyMaxSize, "Maximal file size of the tiny corpus", true);
+  io->add_option("--mixed-files", ioOptions.mixedFiles, "Files of the mixed corpus", true);
+  io->add_option("--mixed-median-size", ioOptions.mixedMedianSize, "Median file size of the mixed corpus", true);
+  io->add_option("--max-process-files", ioOptions.maxProcessFiles,
+                 "Corpora with more files skip the pipelines starting a process per file", true);
+  io->add_option("--seed", ioOptions.seed, "Seed of the corpora", true);
+  io->add_option("--sha3", ioOptions.sha3, "sha3 executable (the one built with the benchmark if not given)");
+  io->add_option("--sha3-batch", ioOptions.sha3Batch,
+                 "sha3_batch executable (the one built with the benchmark if not given)");
+  io->add_option("-o,--output-file", outFilename, "Output file (STDIN if not specified)");
+
+#ifdef SHA3_BENCHMARK_OPENSSL
+  OpensslOptions opensslOptions;
+  auto openssl = app.add_subcommand(g_opensslSubcommand, "single, small-message and batch workloads against OpenSSL");
+  openssl->add_set("-d,--digest", opensslOptions.digestSize, {224, 256, 384, 512}, "Digest length", true);
+  openssl->add_option("-r,--runs", opensslOptions.runs, "Measured runs per case", true)
+      ->check(CLI::Range(size_t(1), std::numeric_limits<size_t>::max()));
+  openssl->add_option("--min-sample", opensslOptions.minSampleSeconds, "Minimal duration of one run in seconds",
+                      true);
+  openssl->add_option("--small-messages", opensslOptions.smallMessages, "Messages per small-message call", true)
+      ->check(CLI::Range(size_t(1), size_t(1) << 20));
+  openssl->add_option("--batch-messages", opensslOptions.batchMessages, "Messages per batch call", true)
+      ->check(CLI::Range(size_t(1), size_t(1) << 12));
+  openssl->add_option("-t,--threads", opensslOptions.threads, "Threads of batch workloads (all processors if 0)");
+  openssl->add_option("-o,--output-file", outFilename, "Output file (STDIN if not specified)");
+#endif // SHA3_BENCHMARK_OPENSSL
+
   app.require_subcommand(1);
 
   CLI11_PARSE(app, argc, argv);
@@ -276,6 +376,13 @@ int main(int argc, const char *argv[])
   assert(app.get_subcommands().size() == 1);
   std::string subcommand = app.get_subcommands().front()->get_name();
 
+  if ((subcommand == g_suiteSubcommand && suiteOptions.minSize > suiteOptions.maxSize) ||
+      (subcommand == g_scalingSubcommand && scalingOptions.minSize > scalingOptions.maxSize))
+  {
+    std::cerr << "--min-size can't be greater than --max-size" << std::endl;
+    return EXIT_FAILURE;
+  }
+
 
   std::ofstream of;
   if (!outFilename.empty())
@@ -302,6 +409,28 @@ int main(int argc, const char *argv[])
   {
     runSingleTest(out, digestSize, singleSizes, runTypes);
   }
+  else if (subcommand == g_suiteSubcommand)
+  {
+    return runSuite(out, suiteOptions);
+  }
+  else if (subcommand == g_scalingSubcommand)
+  {
+    return runScaling(out, scalingOptions);
+  }
+  else if (subcommand == g_nonceSubcommand)
+  {
+    return runNonce(out, nonceOptions);
+  }
+  else if (subcommand == g_ioSubcommand)
+  {
+    return runIo(out, ioOptions);
+  }
+#ifdef SHA3_BENCHMARK_OPENSSL
+  else if (subcommand == g_opensslSubcommand)
+  {
+    return runOpensslCompare(out, opensslOptions);
+  }
+#endif // SHA3_BENCHMARK_OPENSSL
   else
   {
     assert(false);
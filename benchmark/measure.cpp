@@ -0,0 +1,56 @@
+#include "measure.h"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <numeric>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+uint64_t readTsc()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+Statistics computeStatistics(std::vector<Sample> samples)
+{
+  Statistics result;
+  result.runs = samples.size();
+  if (samples.empty())
+  {
+    return result;
+  }
+
+  auto median = [](std::vector<double> values) {
+    assert(!values.empty());
+    std::sort(values.begin(), values.end());
+    size_t mid = values.size() / 2;
+    return values.size() % 2 == 0 ? (values[mid - 1] + values[mid]) / 2 : values[mid];
+  };
+
+  std::vector<double> seconds;
+  std::vector<double> ticks;
+  for (auto &sample : samples)
+  {
+    seconds.push_back(sample.seconds);
+    ticks.push_back(sample.ticks);
+  }
+
+  result.median = median(seconds);
+  result.medianTicks = median(ticks);
+  result.min = *std::min_element(seconds.begin(), seconds.end());
+  result.max = *std::max_element(seconds.begin(), seconds.end());
+  result.mean = std::accumulate(seconds.begin(), seconds.end(), 0.0) / seconds.size();
+
+  double sq = 0;
+  for (double s : seconds)
+  {
+    sq += (s - result.mean) * (s - result.mean);
+  }
+  result.stddev = seconds.size() > 1 ? std::sqrt(sq / (seconds.size() - 1)) : 0;
+  return result;
+}
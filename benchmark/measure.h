@@ -0,0 +1,68 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Time-stamp counter value or 0 if it is not available on the platform.
+uint64_t readTsc();
+
+// Single measurement of one operation.
+struct Sample
+{
+  double seconds = 0;
+  double ticks = 0; // Time-stamp counter ticks.
+};
+
+struct Statistics
+{
+  size_t runs = 0;
+  double median = 0; // All time values are in seconds.
+  double mean = 0;
+  double stddev = 0;
+  double min = 0;
+  double max = 0;
+  double medianTicks = 0;
+};
+
+Statistics computeStatistics(std::vector<Sample> samples);
+
+// Calls f repeatedly and returns runs samples of its duration.
+// Fast operations are repeated within one sample so that it lasts at least minSampleSeconds,
+// sample value is the time of one call.
+template<typename F>
+std::vector<Sample> measure(F &&f, size_t runs, double minSampleSeconds)
+{
+  using Clock = std::chrono::steady_clock;
+
+  // Warm-up and calibration.
+  size_t iterations = 0;
+  auto start = Clock::now();
+  double elapsed = 0;
+  do
+  {
+    f();
+    ++iterations;
+    elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+  } while (elapsed < minSampleSeconds);
+
+  std::vector<Sample> samples;
+  samples.reserve(runs);
+  for (size_t run = 0; run < runs; ++run)
+  {
+    auto p1 = Clock::now();
+    uint64_t t1 = readTsc();
+    for (size_t i = 0; i < iterations; ++i)
+    {
+      f();
+    }
+    uint64_t t2 = readTsc();
+    auto p2 = Clock::now();
+
+    Sample sample;
+    sample.seconds = std::chrono::duration<double>(p2 - p1).count() / iterations;
+    sample.ticks = double(t2 - t1) / iterations;
+    samples.push_back(sample);
+  }
+  return samples;
+}
@@ -0,0 +1,82 @@
+#include "nonce.h"
+#include "nonce_search.h"
+#include "sha3_cpu.h"
+#include <chrono>
+#include <cstdlib>
+#include <omp.h>
+#include <vector>
+
+namespace
+{
+
+struct Row
+{
+  const char *method;
+  unsigned threads;
+  size_t attempts;
+  double seconds;
+};
+
+template<typename F>
+double timed(F &&f)
+{
+  auto start = std::chrono::steady_clock::now();
+  f();
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+} // namespace
+
+int runNonce(std::ostream &out, const NonceOptions &options)
+{
+  std::vector<uint8_t> challenge(options.challengeSize);
+  for (size_t i = 0; i < challenge.size(); ++i)
+  {
+    challenge[i] = static_cast<uint8_t>(i * 131);
+  }
+  const unsigned zeroBits = static_cast<unsigned>(options.digestSize);
+
+  std::vector<Row> rows;
+  {
+    SHA3_cpu sha3(options.digestSize);
+    unsigned best = 0;
+    double seconds = timed([&]() {
+      for (uint64_t nonce = 0; nonce < options.naiveAttempts; ++nonce)
+      {
+        uint8_t bytes[8];
+        for (size_t i = 0; i < 8; ++i)
+        {
+          bytes[i] = static_cast<uint8_t>(nonce >> (i * 8));
+        }
+        sha3.init();
+        sha3.add(challenge.data(), challenge.size());
+        sha3.add(bytes, sizeof(bytes));
+        best = std::max(best, NonceSearch::leadingZeroBits(sha3.digest()));
+      }
+    });
+    rows.push_back({"SHA3_cpu loop", 1, options.naiveAttempts, seconds});
+  }
+
+  unsigned maxThreads = omp_get_num_procs();
+  for (unsigned threads : {1u, maxThreads})
+  {
+    NonceSearch search(options.digestSize, threads);
+    double seconds =
+        timed([&]() { search.search(challenge.data(), challenge.size(), zeroBits, 8, 0, options.attempts); });
+    rows.push_back({"NonceSearch", threads, static_cast<size_t>(search.attempts()), seconds});
+    if (maxThreads == 1)
+    {
+      break;
+    }
+  }
+
+  out << "Method,Threads,Attempts,Seconds,Hashes/s,Speedup" << std::endl;
+  const double base = rows.front().attempts / rows.front().seconds;
+  for (auto &row : rows)
+  {
+    double rate = row.seconds == 0 ? 0 : row.attempts / row.seconds;
+    out << row.method << ',' << row.threads << ',' << row.attempts << ',' << row.seconds << ',' << rate << ','
+        << rate / base << std::endl;
+  }
+  return EXIT_SUCCESS;
+}
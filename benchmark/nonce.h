@@ -0,0 +1,15 @@
+#pragma once
+#include <cstddef>
+#include <ostream>
+
+struct NonceOptions
+{
+  size_t digestSize = 256;
+  size_t challengeSize = 64;
+  size_t attempts = 1 << 22;      // Attempts of the search engine.
+  size_t naiveAttempts = 1 << 18; // Attempts of the SHA3_cpu loop.
+};
+
+// Hashes per second of a nonce search with SHA3_cpu per attempt and with NonceSearch on one and all threads.
+// The target is unreachable, so every attempt is made. Returns process exit code.
+int runNonce(std::ostream &out, const NonceOptions &options);
@@ -0,0 +1,186 @@
+#include "openssl_compare.h"
+#include "measure.h"
+#include "sha3_cpu.h"
+#include <iostream>
+#include <memory>
+#include <omp.h>
+#include <openssl/evp.h>
+#include <openssl/opensslv.h>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+const size_t g_kb = 1024;
+const size_t g_mb = g_kb * 1024;
+
+const std::vector<size_t> g_singleSizes = {16, 64, 256, g_kb, 16 * g_kb, 256 * g_kb, 4 * g_mb};
+const std::vector<size_t> g_smallSizes = {16, 64, 256, g_kb};
+const std::vector<size_t> g_batchSizes = {16 * g_kb, 256 * g_kb, g_mb};
+
+using Digests = std::vector<std::vector<uint8_t>>;
+
+// OpenSSL SHA3 with the algorithm fetched once: OpenSSL 3 would fetch it on every init otherwise.
+class OpensslSha3 {
+public:
+  OpensslSha3(size_t digestSize, unsigned threads)
+    : m_digestSize(digestSize / 8)
+  {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    m_md = EVP_MD_fetch(nullptr, ("SHA3-" + std::to_string(digestSize)).c_str(), nullptr);
+#else
+    m_md = digestSize == 224 ? EVP_sha3_224() : digestSize == 256 ? EVP_sha3_256()
+                                              : digestSize == 384 ? EVP_sha3_384() : EVP_sha3_512();
+#endif
+    for (unsigned i = 0; i < threads; ++i)
+    {
+      m_contexts.emplace_back(EVP_MD_CTX_new(), &EVP_MD_CTX_free);
+    }
+  }
+
+  ~OpensslSha3()
+  {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    EVP_MD_free(const_cast<EVP_MD *>(m_md));
+#endif
+  }
+
+  bool valid() const { return m_md != nullptr; }
+
+  void digest(const uint8_t *data, size_t size, uint8_t *out, size_t context = 0)
+  {
+    EVP_MD_CTX *ctx = m_contexts[context].get();
+    EVP_DigestInit_ex(ctx, m_md, nullptr);
+    EVP_DigestUpdate(ctx, data, size);
+    EVP_DigestFinal_ex(ctx, out, nullptr);
+  }
+
+  // Messages of size bytes one after another in data, hashed on all contexts.
+  void digests(const uint8_t *data, size_t size, size_t messages, uint8_t *out)
+  {
+#pragma omp parallel for num_threads(m_contexts.size()) schedule(dynamic, 16)
+    for (size_t i = 0; i < messages; ++i)
+    {
+      digest(data + i * size, size, out + i * m_digestSize, omp_get_thread_num());
+    }
+  }
+
+private:
+  size_t m_digestSize;
+  const EVP_MD *m_md = nullptr;
+  std::vector<std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)>> m_contexts;
+};
+
+struct Row
+{
+  const char *workload;
+  size_t size;
+  size_t messages;
+  Statistics openssl;
+  Statistics sha3;
+  bool match;
+
+  double bytes() const { return double(size) * messages; }
+  bool slower() const { return sha3.median > openssl.median; }
+};
+
+void writeRow(std::ostream &out, const Row &r)
+{
+  auto cyclesPerByte = [&](const Statistics &s) { return s.medianTicks / r.bytes(); };
+  auto messagesPerSecond = [&](const Statistics &s) { return s.median == 0 ? 0 : r.messages / s.median; };
+  out << r.workload << ',' << r.size << ',' << r.messages << ',' << cyclesPerByte(r.openssl) << ','
+      << cyclesPerByte(r.sha3) << ',' << messagesPerSecond(r.openssl) << ',' << messagesPerSecond(r.sha3) << ','
+      << (r.sha3.median == 0 ? 0 : r.openssl.median / r.sha3.median) << ','
+      << (!r.match ? "MISMATCH" : r.slower() ? "SLOWER" : "ok") << std::endl;
+}
+
+} // namespace
+
+int runOpensslCompare(std::ostream &out, const OpensslOptions &options)
+{
+  unsigned threads = options.threads != 0 ? options.threads : std::max(omp_get_num_procs(), 1);
+  const size_t digestBytes = options.digestSize / 8;
+  OpensslSha3 openssl(options.digestSize, threads);
+  if (!openssl.valid())
+  {
+    std::cerr << "OpenSSL has no SHA3-" << options.digestSize << std::endl;
+    return EXIT_FAILURE;
+  }
+  SHA3_cpu single(options.digestSize);
+  SHA3_cpu_batch batch(options.digestSize, threads);
+
+  size_t maxBytes = std::max(g_singleSizes.back(), std::max(g_smallSizes.back() * options.smallMessages,
+                                                            g_batchSizes.back() * options.batchMessages));
+  std::vector<uint8_t> data(maxBytes);
+  for (size_t i = 0; i < data.size(); ++i)
+  {
+    data[i] = static_cast<uint8_t>(i * 2654435761u >> 13);
+  }
+
+  out << "Workload,Size,Messages,OpenSSL cycles/byte,SHA3 cycles/byte,OpenSSL msgs/s,SHA3 msgs/s,"
+         "Speedup over OpenSSL,Status"
+      << std::endl;
+
+  std::vector<Row> rows;
+  for (size_t size : g_singleSizes)
+  {
+    std::vector<uint8_t> expected(digestBytes);
+    openssl.digest(data.data(), size, expected.data());
+    single.init();
+    single.add(data.data(), size);
+    Row row{"single", size, 1, {}, {}, single.digest() == expected};
+
+    row.openssl = computeStatistics(measure([&]() { openssl.digest(data.data(), size, expected.data()); },
+                                            options.runs, options.minSampleSeconds));
+    row.sha3 = computeStatistics(measure(
+        [&]() {
+          single.init();
+          single.add(data.data(), size);
+          single.digest();
+        },
+        options.runs, options.minSampleSeconds));
+    writeRow(out, row);
+    rows.push_back(row);
+  }
+
+  auto runBatch = [&](const char *workload, const std::vector<size_t> &sizes, size_t messages) {
+    for (size_t size : sizes)
+    {
+      std::vector<std::pair<const uint8_t *, size_t>> args;
+      for (size_t i = 0; i < messages; ++i)
+      {
+        args.emplace_back(data.data() + i * size, size);
+      }
+      std::vector<uint8_t> expected(digestBytes * messages);
+      openssl.digests(data.data(), size, messages, expected.data());
+      Digests digests = batch.calculate(args);
+      bool match = true;
+      for (size_t i = 0; i < messages; ++i)
+      {
+        match = match && std::equal(digests[i].begin(), digests[i].end(), expected.data() + i * digestBytes);
+      }
+      Row row{workload, size, messages, {}, {}, match};
+
+      row.openssl = computeStatistics(
+          measure([&]() { openssl.digests(data.data(), size, messages, expected.data()); }, options.runs,
+                  options.minSampleSeconds));
+      row.sha3 = computeStatistics(measure([&]() { batch.calculate(args); }, options.runs, options.minSampleSeconds));
+      writeRow(out, row);
+      rows.push_back(row);
+    }
+  };
+  runBatch("small", g_smallSizes, options.smallMessages);
+  runBatch("batch", g_batchSizes, options.batchMessages);
+
+  size_t mismatched = 0;
+  size_t slower = 0;
+  for (auto &row : rows)
+  {
+    mismatched += row.match ? 0 : 1;
+    slower += row.slower() ? 1 : 0;
+  }
+  std::cerr << slower << " of " << rows.size() << " size classes slower than OpenSSL, " << mismatched
+            << " with mismatched digests (" << threads << " threads)" << std::endl;
+  return mismatched == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
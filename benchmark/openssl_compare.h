@@ -0,0 +1,18 @@
+#pragma once
+#include <cstddef>
+#include <ostream>
+
+struct OpensslOptions
+{
+  size_t digestSize = 256;
+  size_t runs = 7;
+  double minSampleSeconds = 0.01;
+  size_t smallMessages = 4096; // Messages per call of the small-message workload.
+  size_t batchMessages = 64;   // Messages per call of the batch workload.
+  unsigned threads = 0;        // Threads of both batch sides, all processors if 0.
+};
+
+// Side-by-side cycles/byte and messages/s of OpenSSL EVP SHA3 and this library on the single, small-message
+// and batch workloads. Batch workloads run OpenSSL on the same number of OpenMP threads as SHA3_cpu_batch.
+// Rows where the library is slower are marked. Returns process exit code, nonzero if digests differ.
+int runOpensslCompare(std::ostream &out, const OpensslOptions &options);
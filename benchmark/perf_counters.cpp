@@ -0,0 +1,276 @@
+#include "perf_counters.h"
+#include <cerrno>
+#include <cstring>
+#ifdef __linux__
+#include <dirent.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif // __linux__
+
+namespace
+{
+
+#ifdef __linux__
+
+struct EventConfig
+{
+  uint32_t type;
+  uint64_t config;
+};
+
+EventConfig eventConfig(PerfEvent e)
+{
+  switch (e)
+  {
+  case PerfEvent::Cycles:
+    return {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES};
+  case PerfEvent::Instructions:
+    return {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS};
+  case PerfEvent::L1dMisses:
+    return {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                    (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)};
+  case PerfEvent::LlcMisses:
+    return {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES};
+  case PerfEvent::BranchMisses:
+    return {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES};
+  case PerfEvent::StalledCyclesFrontend:
+    return {PERF_TYPE_HARDWARE, PERF_COUNT_HW_STALLED_CYCLES_FRONTEND};
+  case PerfEvent::StalledCyclesBackend:
+    return {PERF_TYPE_HARDWARE, PERF_COUNT_HW_STALLED_CYCLES_BACKEND};
+  default:
+    return {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES};
+  }
+}
+
+int openCounter(PerfEvent e, pid_t tid)
+{
+  perf_event_attr attr;
+  std::memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = eventConfig(e).type;
+  attr.config = eventConfig(e).config;
+  attr.disabled = 1;
+  attr.inherit = 1;
+  // User space only: it is allowed with the default perf_event_paranoid in most containers.
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  return static_cast<int>(syscall(__NR_perf_event_open, &attr, tid, -1, -1, 0));
+}
+
+std::vector<pid_t> processThreads()
+{
+  std::vector<pid_t> result;
+  DIR *dir = opendir("/proc/self/task");
+  if (dir == nullptr)
+  {
+    result.push_back(0);
+    return result;
+  }
+  while (dirent *entry = readdir(dir))
+  {
+    if (entry->d_name[0] != '.')
+    {
+      result.push_back(static_cast<pid_t>(std::stol(entry->d_name)));
+    }
+  }
+  closedir(dir);
+  return result;
+}
+
+#endif // __linux__
+
+double ratio(double a, double b) { return b == 0 ? 0 : a / b; }
+
+} // namespace
+
+const char *toString(PerfEvent e)
+{
+  switch (e)
+  {
+  case PerfEvent::Cycles:
+    return "cycles";
+  case PerfEvent::Instructions:
+    return "instructions";
+  case PerfEvent::L1dMisses:
+    return "l1d_misses";
+  case PerfEvent::LlcMisses:
+    return "llc_misses";
+  case PerfEvent::BranchMisses:
+    return "branch_misses";
+  case PerfEvent::StalledCyclesFrontend:
+    return "stalled_cycles_frontend";
+  case PerfEvent::StalledCyclesBackend:
+    return "stalled_cycles_backend";
+  default:
+    return "";
+  }
+}
+
+PerfValues &PerfValues::operator/=(double v)
+{
+  for (auto &value : values)
+  {
+    value /= v;
+  }
+  return *this;
+}
+
+PerfCounters::PerfCounters()
+{
+#ifdef __linux__
+  auto threads = processThreads();
+  for (size_t e = 0; e < m_fds.size(); ++e)
+  {
+    for (pid_t tid : threads)
+    {
+      int fd = openCounter(PerfEvent(e), tid);
+      if (fd < 0)
+      {
+        if (m_error.empty())
+        {
+          m_error = std::string(toString(PerfEvent(e))) + ": " + std::strerror(errno);
+        }
+        // Partially opened event is useless: counts of some threads are missing.
+        for (int opened : m_fds[e])
+        {
+          close(opened);
+        }
+        m_fds[e].clear();
+        break;
+      }
+      m_fds[e].push_back(fd);
+    }
+  }
+  if (available())
+  {
+    m_error.clear();
+  }
+#else
+  m_error = "hardware counters are supported on linux only";
+#endif // __linux__
+}
+
+PerfCounters::~PerfCounters()
+{
+#ifdef __linux__
+  for (auto &fds : m_fds)
+  {
+    for (int fd : fds)
+    {
+      close(fd);
+    }
+  }
+#endif // __linux__
+}
+
+bool PerfCounters::available() const
+{
+  for (auto &fds : m_fds)
+  {
+    if (!fds.empty())
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+void PerfCounters::start()
+{
+#ifdef __linux__
+  for (auto &fds : m_fds)
+  {
+    for (int fd : fds)
+    {
+      ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+      ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+#endif // __linux__
+}
+
+PerfValues PerfCounters::stop()
+{
+  PerfValues result;
+#ifdef __linux__
+  for (size_t e = 0; e < m_fds.size(); ++e)
+  {
+    for (int fd : m_fds[e])
+    {
+      ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    }
+
+    bool valid = !m_fds[e].empty();
+    double sum = 0;
+    for (int fd : m_fds[e])
+    {
+      uint64_t data[3] = {}; // value, time enabled, time running
+      if (read(fd, data, sizeof(data)) != sizeof(data))
+      {
+        valid = false;
+        break;
+      }
+      // Scale the value if the counter was multiplexed.
+      sum += data[2] == 0 ? 0 : double(data[0]) * ratio(double(data[1]), double(data[2]));
+    }
+    result.valid[e] = valid;
+    result.values[e] = valid ? sum : 0;
+  }
+#endif // __linux__
+  return result;
+}
+
+void writePerfHeader(std::ostream &out)
+{
+  out << ",IPC,Core cycles/byte,L1d misses/KB,LLC misses/KB,Bytes/LLC miss,Branch misses/KB,Frontend stall %"
+         ",Backend stall %";
+}
+
+void writePerfRow(std::ostream &out, const PerfValues &v, double bytes)
+{
+  double kb = bytes / 1024;
+  auto write = [&out](bool valid, double value) {
+    out << ',';
+    if (valid)
+    {
+      out << value;
+    }
+    else
+    {
+      out << "n/a";
+    }
+  };
+  bool cycles = v.has(PerfEvent::Cycles);
+  write(cycles && v.has(PerfEvent::Instructions), ratio(v.get(PerfEvent::Instructions), v.get(PerfEvent::Cycles)));
+  write(cycles && bytes != 0, ratio(v.get(PerfEvent::Cycles), bytes));
+  write(v.has(PerfEvent::L1dMisses) && kb != 0, ratio(v.get(PerfEvent::L1dMisses), kb));
+  write(v.has(PerfEvent::LlcMisses) && kb != 0, ratio(v.get(PerfEvent::LlcMisses), kb));
+  write(v.has(PerfEvent::LlcMisses) && v.get(PerfEvent::LlcMisses) != 0, ratio(bytes, v.get(PerfEvent::LlcMisses)));
+  write(v.has(PerfEvent::BranchMisses) && kb != 0, ratio(v.get(PerfEvent::BranchMisses), kb));
+  write(cycles && v.has(PerfEvent::StalledCyclesFrontend),
+        ratio(v.get(PerfEvent::StalledCyclesFrontend), v.get(PerfEvent::Cycles)) * 100);
+  write(cycles && v.has(PerfEvent::StalledCyclesBackend),
+        ratio(v.get(PerfEvent::StalledCyclesBackend), v.get(PerfEvent::Cycles)) * 100);
+}
+
+void writePerfJson(std::ostream &out, const PerfValues &v, double bytes)
+{
+  for (size_t e = 0; e < v.values.size(); ++e)
+  {
+    if (v.valid[e])
+    {
+      out << ", \"" << toString(PerfEvent(e)) << "\": " << v.values[e];
+    }
+  }
+  if (v.has(PerfEvent::Cycles) && v.has(PerfEvent::Instructions))
+  {
+    out << ", \"ipc\": " << ratio(v.get(PerfEvent::Instructions), v.get(PerfEvent::Cycles));
+  }
+  if (v.has(PerfEvent::LlcMisses) && v.get(PerfEvent::LlcMisses) != 0)
+  {
+    out << ", \"bytes_per_llc_miss\": " << ratio(bytes, v.get(PerfEvent::LlcMisses));
+  }
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+enum class PerfEvent
+{
+  Cycles,
+  Instructions,
+  L1dMisses,
+  LlcMisses,
+  BranchMisses,
+  StalledCyclesFrontend,
+  StalledCyclesBackend,
+  Count
+};
+
+const char *toString(PerfEvent e);
+
+struct PerfValues
+{
+  std::array<bool, size_t(PerfEvent::Count)> valid = {};
+  std::array<double, size_t(PerfEvent::Count)> values = {};
+
+  bool has(PerfEvent e) const { return valid[size_t(e)]; }
+  double get(PerfEvent e) const { return values[size_t(e)]; }
+  PerfValues &operator/=(double v);
+};
+
+// Linux hardware counters of all threads existing in the process at construction time.
+// Construct it after worker threads are spawned (e.g. after a warm-up run).
+// Unavailable counters (no kernel support, container restrictions) are reported as invalid values.
+class PerfCounters {
+public:
+  PerfCounters();
+  ~PerfCounters();
+  PerfCounters(const PerfCounters &) = delete;
+  PerfCounters &operator=(const PerfCounters &) = delete;
+
+  // True if at least one counter is opened.
+  bool available() const;
+  // Reason of the failure if counters are unavailable.
+  const std::string &error() const { return m_error; }
+
+  void start();
+  PerfValues stop();
+
+private:
+  // File descriptors per event, one for each thread.
+  std::array<std::vector<int>, size_t(PerfEvent::Count)> m_fds;
+  std::string m_error;
+};
+
+// Derived metrics header and values, bytes are processed by the measured region.
+void writePerfHeader(std::ostream &out);
+void writePerfRow(std::ostream &out, const PerfValues &values, double bytes);
+void writePerfJson(std::ostream &out, const PerfValues &values, double bytes);
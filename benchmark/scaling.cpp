@@ -0,0 +1,190 @@
+#include "scaling.h"
+#include "perf_counters.h"
+#include "sha3_cpu.h"
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <numeric>
+#include <omp.h>
+#include <random>
+#include <vector>
+
+namespace
+{
+
+// Upper limit of distinct zipf ranks.
+const size_t g_maxZipfRanks = 1 << 20;
+
+std::vector<size_t> generateSizes(const ScalingOptions &options)
+{
+  std::mt19937_64 rng(options.seed);
+  std::vector<size_t> sizes(options.messages);
+  auto clamp = [&options](double v) {
+    return std::min(options.maxSize, std::max(options.minSize, static_cast<size_t>(v)));
+  };
+
+  if (options.distribution == "uniform")
+  {
+    std::uniform_int_distribution<size_t> dist(options.minSize, options.maxSize);
+    std::generate(sizes.begin(), sizes.end(), [&]() { return dist(rng); });
+  }
+  else if (options.distribution == "lognormal")
+  {
+    std::lognormal_distribution<double> dist(std::log(double(options.medianSize)), options.sigma);
+    std::generate(sizes.begin(), sizes.end(), [&]() { return clamp(dist(rng)); });
+  }
+  else if (options.distribution == "zipf")
+  {
+    // Rank k has probability proportional to 1 / k^s and size minSize * k: small messages dominate,
+    // rare ones reach maxSize.
+    size_t unit = std::max(options.minSize, size_t(1));
+    size_t ranks = std::max(size_t(1), std::min(g_maxZipfRanks, options.maxSize / unit));
+    std::vector<double> cdf(ranks);
+    double sum = 0;
+    for (size_t k = 0; k < ranks; ++k)
+    {
+      sum += 1 / std::pow(double(k + 1), options.zipfExponent);
+      cdf[k] = sum;
+    }
+    std::uniform_real_distribution<double> dist(0, sum);
+    std::generate(sizes.begin(), sizes.end(), [&]() {
+      size_t k = std::lower_bound(cdf.begin(), cdf.end(), dist(rng)) - cdf.begin();
+      return clamp(double(unit) * (k + 1));
+    });
+  }
+  else
+  {
+    sizes.clear();
+  }
+  return sizes;
+}
+
+double percentile(const std::vector<double> &sorted, double p)
+{
+  assert(!sorted.empty());
+  size_t rank = static_cast<size_t>(std::ceil(p / 100 * sorted.size()));
+  return sorted[std::min(sorted.size() - 1, rank == 0 ? 0 : rank - 1)];
+}
+
+} // namespace
+
+int runScaling(std::ostream &out, const ScalingOptions &options)
+{
+  std::vector<size_t> sizes = generateSizes(options);
+  if (sizes.empty())
+  {
+    std::cerr << "Unknown distribution " << options.distribution << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  size_t largest = *std::max_element(sizes.begin(), sizes.end());
+  double totalBytes = std::accumulate(sizes.begin(), sizes.end(), 0.0);
+
+  // Messages share one buffer, but start at different offsets.
+  std::vector<uint8_t> buffer(largest + options.messages);
+  std::generate(buffer.begin(), buffer.end(), rand);
+  std::vector<std::pair<const uint8_t *, size_t>> args;
+  for (size_t i = 0; i < sizes.size(); ++i)
+  {
+    args.push_back({buffer.data() + i % options.messages, sizes[i]});
+  }
+
+  std::vector<size_t> sorted = sizes;
+  std::sort(sorted.begin(), sorted.end());
+  out << "Distribution," << options.distribution << ",Seed," << options.seed << ",Messages," << sizes.size()
+      << ",Total bytes," << totalBytes << ",Median size," << sorted[sorted.size() / 2] << ",Max size," << largest
+      << std::endl;
+
+  unsigned maxThreads = options.maxThreads == 0 ? omp_get_num_procs() : options.maxThreads;
+
+  struct Row
+  {
+    unsigned threads;
+    std::vector<double> latencies; // Sorted, seconds.
+    std::vector<double> busy;      // Average busy time of every thread.
+    double occupancy = 0;          // Average share of used kernel lanes.
+    PerfValues perf;               // Counters of one call.
+  };
+  std::vector<Row> rows;
+
+  for (unsigned threads = 1; threads <= maxThreads; ++threads)
+  {
+    SHA3_cpu_batch sha3(options.digestSize, threads);
+    // Warm-up.
+    sha3.calculate(args);
+
+    Row row;
+    row.threads = threads;
+    row.busy.assign(threads, 0);
+    for (size_t call = 0; call < options.calls; ++call)
+    {
+      auto p1 = std::chrono::steady_clock::now();
+      sha3.calculate(args);
+      auto p2 = std::chrono::steady_clock::now();
+      row.latencies.push_back(std::chrono::duration<double>(p2 - p1).count());
+
+      auto busy = sha3.busyTimes();
+      for (size_t t = 0; t < threads && t < busy.size(); ++t)
+      {
+        row.busy[t] += busy[t] / options.calls;
+      }
+      row.occupancy += sha3.laneOccupancy() / options.calls;
+    }
+    std::sort(row.latencies.begin(), row.latencies.end());
+
+    if (options.perf)
+    {
+      PerfCounters counters;
+      if (!counters.available() && threads == 1)
+      {
+        std::cerr << "Hardware counters are unavailable (" << counters.error() << "), perf columns are n/a"
+                  << std::endl;
+      }
+      counters.start();
+      sha3.calculate(args);
+      row.perf = counters.stop();
+    }
+    rows.push_back(std::move(row));
+  }
+
+  out << "Threads,p50 ms,p90 ms,p99 ms,Max ms,MB/s,Speedup,Efficiency %,Busy %,Imbalance %,Lane occupancy %";
+  if (options.perf)
+  {
+    writePerfHeader(out);
+  }
+  out << std::endl;
+  const double base = percentile(rows.front().latencies, 50);
+  for (auto &row : rows)
+  {
+    double median = percentile(row.latencies, 50);
+    double speedup = base / median;
+    double busySum = std::accumulate(row.busy.begin(), row.busy.end(), 0.0);
+    double busyMax = *std::max_element(row.busy.begin(), row.busy.end());
+    double busyMean = busySum / row.threads;
+    out << row.threads << ',' << median * 1e3 << ',' << percentile(row.latencies, 90) * 1e3 << ','
+        << percentile(row.latencies, 99) * 1e3 << ',' << row.latencies.back() * 1e3 << ','
+        << totalBytes / median / (1024 * 1024) << ',' << speedup << ',' << speedup / row.threads * 100 << ','
+        << busySum / (median * row.threads) * 100 << ',' << (busyMax == 0 ? 0 : (busyMax - busyMean) / busyMax * 100)
+        << ',' << row.occupancy * 100;
+    if (options.perf)
+    {
+      writePerfRow(out, row.perf, totalBytes);
+    }
+    out << std::endl;
+  }
+
+  out << "Threads,Thread,Busy ms,Idle ms" << std::endl;
+  for (auto &row : rows)
+  {
+    double median = percentile(row.latencies, 50);
+    for (unsigned t = 0; t < row.threads; ++t)
+    {
+      out << row.threads << ',' << t << ',' << row.busy[t] * 1e3 << ','
+          << std::max(0.0, median - row.busy[t]) * 1e3 << std::endl;
+    }
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,25 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+struct ScalingOptions
+{
+  size_t digestSize = 512;
+  size_t messages = 1024; // Messages per calculate call.
+  size_t calls = 20;      // Measured calls per thread count.
+  unsigned maxThreads = 0; // Zero means all available processors.
+  std::string distribution = "lognormal"; // uniform, lognormal or zipf.
+  size_t minSize = 64;
+  size_t maxSize = 16 * 1024 * 1024;
+  size_t medianSize = 16 * 1024; // lognormal only.
+  double sigma = 1.5;            // lognormal only.
+  double zipfExponent = 1.1;     // zipf only.
+  uint64_t seed = 1;
+  bool perf = false; // Read hardware counters for every thread count.
+};
+
+// Batch hashing over thread counts 1..maxThreads with generated message size distribution.
+// Returns process exit code.
+int runScaling(std::ostream &out, const ScalingOptions &options);
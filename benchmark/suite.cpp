@@ -0,0 +1,484 @@
+#include "suite.h"
+#include "measure.h"
+#include "perf_counters.h"
+#include "keccak.h"
+#include "sha3_cpu.h"
+#include "sha3_multistream.h"
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <tuple>
+
+namespace
+{
+
+// Upper limit of bytes hashed by one batch call.
+const size_t g_batchBytesLimit = size_t(1) << 30;
+
+struct Result
+{
+  std::string path;
+  size_t size = 0;     // Size of one message.
+  size_t messages = 1; // Messages per operation.
+  Statistics stats;
+  PerfValues perf;
+
+  double bytes() const { return double(size) * messages; }
+  double cyclesPerByte() const { return bytes() == 0 ? 0 : stats.medianTicks / bytes(); }
+  double mbPerSecond() const { return stats.median == 0 ? 0 : bytes() / stats.median / (1024 * 1024); }
+  double messagesPerSecond() const { return stats.median == 0 ? 0 : messages / stats.median; }
+};
+
+struct Baseline
+{
+  size_t digestSize = 0;
+  size_t prefixSize = 0;
+  // Median ns by path, message size and messages per operation.
+  std::map<std::tuple<std::string, size_t, size_t>, double> medians;
+};
+
+std::vector<size_t> sweepSizes(size_t minSize, size_t maxSize)
+{
+  std::vector<size_t> sizes = {0};
+  for (size_t sz = 1; sz <= maxSize; sz *= 4)
+  {
+    sizes.push_back(sz);
+  }
+  if (sizes.back() != maxSize)
+  {
+    sizes.push_back(maxSize);
+  }
+  sizes.erase(std::remove_if(sizes.begin(), sizes.end(), [minSize](size_t sz) { return sz < minSize; }),
+              sizes.end());
+  return sizes;
+}
+
+void fillRandom(std::vector<uint8_t> &data)
+{
+  // xorshift is used instead of rand: the buffer can be as large as 1gb.
+  uint64_t x = 88172645463325252ull;
+  size_t i = 0;
+  for (; i + 8 <= data.size(); i += 8)
+  {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    std::copy(reinterpret_cast<const uint8_t *>(&x), reinterpret_cast<const uint8_t *>(&x) + 8, data.data() + i);
+  }
+  for (; i < data.size(); ++i)
+  {
+    data[i] = static_cast<uint8_t>(i);
+  }
+}
+
+template<typename F>
+Result runCase(const std::string &path, size_t size, size_t messages, const SuiteOptions &options, F &&f)
+{
+  Result result;
+  result.path = path;
+  result.size = size;
+  result.messages = messages;
+  result.stats = computeStatistics(measure(f, options.runs, options.minSampleSeconds));
+
+  if (options.perf)
+  {
+    // Separate pass: counters are opened after the warm-up created worker threads and don't disturb timings.
+    size_t iterations = result.stats.median == 0 ? 1 : size_t(options.minSampleSeconds / result.stats.median);
+    iterations = std::max(iterations, size_t(1));
+    PerfCounters counters;
+    counters.start();
+    for (size_t i = 0; i < iterations; ++i)
+    {
+      f();
+    }
+    result.perf = counters.stop();
+    result.perf /= double(iterations);
+  }
+  return result;
+}
+
+void writeRow(std::ostream &out, const Result &r, bool perf)
+{
+  double relStddev = r.stats.median == 0 ? 0 : r.stats.stddev / r.stats.median * 100;
+  out << r.path << ',' << r.size << ',' << r.messages << ',' << r.stats.median * 1e3 << ',' << relStddev << ','
+      << r.cyclesPerByte() << ',' << r.mbPerSecond() << ',' << r.messagesPerSecond();
+  if (perf)
+  {
+    writePerfRow(out, r.perf, r.bytes());
+  }
+  out << std::endl;
+}
+
+void writeJson(std::ostream &out, const SuiteOptions &options, const std::vector<Result> &results)
+{
+  out << std::setprecision(10);
+  out << "{\n";
+  out << "  \"digest\": " << options.digestSize << ",\n";
+  out << "  \"prefix\": " << options.prefixSize << ",\n";
+  out << "  \"runs\": " << options.runs << ",\n";
+  out << "  \"results\": [\n";
+  for (size_t i = 0; i < results.size(); ++i)
+  {
+    const Result &r = results[i];
+    out << "    {\"path\": \"" << r.path << "\", \"size\": " << r.size << ", \"messages\": " << r.messages
+        << ", \"median_ns\": " << r.stats.median * 1e9 << ", \"mean_ns\": " << r.stats.mean * 1e9
+        << ", \"stddev_ns\": " << r.stats.stddev * 1e9 << ", \"min_ns\": " << r.stats.min * 1e9
+        << ", \"cycles_per_byte\": " << r.cyclesPerByte() << ", \"mb_per_s\": " << r.mbPerSecond()
+        << ", \"msgs_per_s\": " << r.messagesPerSecond();
+    if (options.perf)
+    {
+      writePerfJson(out, r.perf, r.bytes());
+    }
+    out << "}" << (i + 1 == results.size() ? "\n" : ",\n");
+  }
+  out << "  ]\n";
+  out << "}\n";
+}
+
+// Parses flat JSON objects ({...} without nested objects) written by writeJson.
+std::vector<std::map<std::string, std::string>> parseFlatObjects(const std::string &text)
+{
+  std::vector<std::map<std::string, std::string>> objects;
+  size_t pos = 0;
+  while ((pos = text.find('{', pos)) != std::string::npos)
+  {
+    size_t end = text.find('}', pos);
+    size_t nested = text.find('{', pos + 1);
+    if (end == std::string::npos)
+    {
+      break;
+    }
+    if (nested != std::string::npos && nested < end)
+    {
+      pos = nested;
+      continue;
+    }
+
+    std::map<std::string, std::string> object;
+    std::istringstream is(text.substr(pos + 1, end - pos - 1));
+    std::string field;
+    while (std::getline(is, field, ','))
+    {
+      size_t colon = field.find(':');
+      if (colon == std::string::npos)
+      {
+        continue;
+      }
+      auto trim = [](std::string s) {
+        auto notSpace = [](unsigned char c) { return !std::isspace(c) && c != '"'; };
+        s.erase(s.begin(), std::find_if(s.begin(), s.end(), notSpace));
+        s.erase(std::find_if(s.rbegin(), s.rend(), notSpace).base(), s.end());
+        return s;
+      };
+      object[trim(field.substr(0, colon))] = trim(field.substr(colon + 1));
+    }
+    objects.push_back(std::move(object));
+    pos = end + 1;
+  }
+  return objects;
+}
+
+bool loadBaseline(const std::string &filename, Baseline &baseline)
+{
+  std::ifstream f(filename);
+  if (!f.is_open())
+  {
+    return false;
+  }
+  std::stringstream ss;
+  ss << f.rdbuf();
+  const std::string text = ss.str();
+
+  // Top-level numbers precede the results, so the first occurrence of the key is the right one.
+  auto topLevel = [&text](const std::string &name, size_t &value) {
+    const std::string key = "\"" + name + "\":";
+    size_t pos = text.find(key);
+    if (pos == std::string::npos)
+    {
+      return false;
+    }
+    value = std::strtoull(text.c_str() + pos + key.size(), nullptr, 10);
+    return true;
+  };
+  if (!topLevel("digest", baseline.digestSize) || !topLevel("prefix", baseline.prefixSize))
+  {
+    return false;
+  }
+
+  for (auto &object : parseFlatObjects(text))
+  {
+    auto path = object.find("path");
+    auto size = object.find("size");
+    auto messages = object.find("messages");
+    auto median = object.find("median_ns");
+    if (path == object.end() || size == object.end() || messages == object.end() || median == object.end())
+    {
+      continue;
+    }
+    baseline.medians[{path->second, std::stoull(size->second), std::stoull(messages->second)}] =
+        std::stod(median->second);
+  }
+  return true;
+}
+
+// Prints comparison table, returns number of regressions.
+size_t compare(std::ostream &out, const Baseline &baseline, const std::vector<Result> &results, double threshold)
+{
+  size_t regressions = 0;
+  size_t unmatched = 0;
+  out << "Path,Size,Baseline ns,Current ns,Change %,Status" << std::endl;
+  for (auto &r : results)
+  {
+    // Operation medians grow with the messages per operation, other batch sizes aren't comparable.
+    auto it = baseline.medians.find({r.path, r.size, r.messages});
+    if (it == baseline.medians.end() || it->second == 0)
+    {
+      ++unmatched;
+      continue;
+    }
+    double current = r.stats.median * 1e9;
+    double change = (current - it->second) / it->second * 100;
+    // Even the fastest run has to be slower than the baseline to report a regression.
+    bool regression = change > threshold && r.stats.min * 1e9 > it->second;
+    regressions += regression;
+    out << r.path << ',' << r.size << ',' << it->second << ',' << current << ',' << change << ','
+        << (regression ? "REGRESSION" : "ok") << std::endl;
+  }
+  if (unmatched != 0)
+  {
+    std::cerr << unmatched << " result(s) have no baseline entry of the same path, size and messages" << std::endl;
+  }
+  return regressions;
+}
+
+// Prints multistream throughput as a share of batch throughput for the same message size and count.
+void compareToBatch(std::ostream &out, const std::vector<Result> &results)
+{
+  std::map<std::pair<size_t, size_t>, double> batch;
+  for (auto &r : results)
+  {
+    if (r.path == "batch")
+    {
+      batch[{r.size, r.messages}] = r.mbPerSecond();
+    }
+  }
+
+  bool header = false;
+  for (auto &r : results)
+  {
+    auto it = batch.find({r.size, r.messages});
+    if (r.path != "multistream" || it == batch.end() || it->second == 0)
+    {
+      continue;
+    }
+    if (!header)
+    {
+      out << "Size,Messages,Multistream MB/s,Batch MB/s,Of batch %" << std::endl;
+      header = true;
+    }
+    out << r.size << ',' << r.messages << ',' << r.mbPerSecond() << ',' << it->second << ','
+        << r.mbPerSecond() / it->second * 100 << std::endl;
+  }
+}
+
+} // namespace
+
+int runSuite(std::ostream &out, const SuiteOptions &options)
+{
+  Baseline baseline;
+  if (!options.baselineFile.empty() && !loadBaseline(options.baselineFile, baseline))
+  {
+    std::cerr << "Unable to read baseline " << options.baselineFile << std::endl;
+    return EXIT_FAILURE;
+  }
+  // Timings of different digest sizes differ by the rate, they can't be compared.
+  if (!options.baselineFile.empty() && baseline.digestSize != options.digestSize)
+  {
+    std::cerr << "Baseline " << options.baselineFile << " was measured with digest " << baseline.digestSize
+              << ", not " << options.digestSize << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (!options.baselineFile.empty() && baseline.prefixSize != options.prefixSize)
+  {
+    std::cerr << "Baseline " << options.baselineFile << " was measured with prefix size " << baseline.prefixSize
+              << ", not " << options.prefixSize << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  auto hasPath = [&options](const std::string &path) {
+    return std::find(options.paths.begin(), options.paths.end(), path) != options.paths.end();
+  };
+
+  const size_t rate = keccak::rate(options.digestSize);
+  const std::vector<size_t> sizes = sweepSizes(options.minSize, options.maxSize);
+
+  size_t bufferSize = options.maxSize;
+  if (hasPath("batch") || hasPath("prefix"))
+  {
+    bufferSize = std::max(bufferSize, std::min(g_batchBytesLimit, options.maxSize * options.batchSize));
+  }
+  bufferSize = std::max(bufferSize, options.prefixSize);
+  std::vector<uint8_t> data(bufferSize + rate);
+  fillRandom(data);
+
+  if (options.perf)
+  {
+    PerfCounters probe;
+    if (!probe.available())
+    {
+      std::cerr << "Hardware counters are unavailable (" << probe.error() << "), perf columns are n/a" << std::endl;
+    }
+  }
+
+  std::vector<Result> results;
+  out << "Path,Size,Messages,Median ms,Stddev %,Cycles/byte,MB/s,Msgs/s";
+  if (options.perf)
+  {
+    writePerfHeader(out);
+  }
+  out << std::endl;
+  auto report = [&](Result r) {
+    writeRow(out, r, options.perf);
+    results.push_back(std::move(r));
+  };
+
+  if (hasPath("permutation"))
+  {
+    uint64_t A[keccak::stateWords] = {};
+    report(runCase("permutation", rate, 1, options, [&A]() { keccak::updateState(A); }));
+  }
+
+  if (hasPath("absorb"))
+  {
+    uint64_t A[keccak::stateWords] = {};
+    size_t previous = 0;
+    for (size_t size : sizes)
+    {
+      // Absorb works with whole blocks only.
+      size_t blocks = size / rate;
+      if (blocks == 0 || blocks * rate == previous)
+      {
+        continue;
+      }
+      previous = blocks * rate;
+      report(runCase("absorb", blocks * rate, 1, options, [&]() {
+        for (size_t i = 0; i < blocks; ++i)
+        {
+          keccak::processSingleBlock(A, data.data() + i * rate, rate);
+        }
+      }));
+    }
+  }
+
+  if (hasPath("single"))
+  {
+    SHA3_cpu sha3(options.digestSize);
+    for (size_t size : sizes)
+    {
+      report(runCase("single", size, 1, options, [&]() {
+        sha3.init();
+        sha3.add(data.data(), size);
+        sha3.digest();
+      }));
+    }
+  }
+
+  if (hasPath("batch"))
+  {
+    SHA3_cpu_batch sha3(options.digestSize);
+    for (size_t size : sizes)
+    {
+      size_t messages = std::min(options.batchSize, g_batchBytesLimit / std::max(size, size_t(1)));
+      messages = std::max(messages, size_t(1));
+
+      // Spread messages over the buffer to avoid hashing the same memory.
+      std::vector<std::pair<const uint8_t *, size_t>> args;
+      size_t span = bufferSize - size + 1;
+      for (size_t i = 0; i < messages; ++i)
+      {
+        args.push_back({data.data() + (i * size) % span, size});
+      }
+      report(runCase("batch", size, messages, options, [&]() { sha3.calculate(args); }));
+    }
+  }
+
+  if (hasPath("prefix"))
+  {
+    SHA3_cpu_batch sha3(options.digestSize);
+    for (size_t size : sizes)
+    {
+      size_t messages = std::min(options.batchSize, g_batchBytesLimit / std::max(size, size_t(1)));
+      messages = std::max(messages, size_t(1));
+
+      std::vector<std::pair<const uint8_t *, size_t>> args;
+      size_t span = bufferSize - size + 1;
+      for (size_t i = 0; i < messages; ++i)
+      {
+        args.push_back({data.data() + (i * size) % span, size});
+      }
+      report(runCase("prefix", options.prefixSize + size, messages, options,
+                     [&]() { sha3.calculate(data.data(), options.prefixSize, args); }));
+    }
+  }
+
+  if (hasPath("multistream"))
+  {
+    // Streams get interleaved chunks, as concurrent uploads do.
+    const size_t chunk = 1024;
+    SHA3_cpu_multistream sha3(options.digestSize);
+    for (size_t size : sizes)
+    {
+      size_t streams = std::min(options.batchSize, g_batchBytesLimit / std::max(size, size_t(1)));
+      streams = std::max(streams, size_t(1));
+      size_t span = bufferSize - size + 1;
+      std::vector<SHA3_cpu_multistream::StreamId> ids(streams);
+      report(runCase("multistream", size, streams, options, [&]() {
+        for (auto &id : ids)
+        {
+          id = sha3.open();
+        }
+        for (size_t offset = 0; offset < size; offset += chunk)
+        {
+          size_t n = std::min(chunk, size - offset);
+          for (size_t i = 0; i < streams; ++i)
+          {
+            sha3.add(ids[i], data.data() + (i * size) % span + offset, n);
+          }
+        }
+        for (auto id : ids)
+        {
+          sha3.finish(id);
+        }
+      }));
+    }
+  }
+
+  compareToBatch(out, results);
+
+  if (!options.jsonFile.empty())
+  {
+    std::ofstream f(options.jsonFile);
+    if (!f.is_open())
+    {
+      std::cerr << "Unable to open file " << options.jsonFile << std::endl;
+      return EXIT_FAILURE;
+    }
+    writeJson(f, options, results);
+  }
+
+  if (!options.baselineFile.empty())
+  {
+    size_t regressions = compare(out, baseline, results, options.threshold);
+    if (regressions != 0)
+    {
+      std::cerr << regressions << " regression(s) found against " << options.baselineFile << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,24 @@
+#pragma once
+#include <cstddef>
+#include <ostream>
+#include <string>
+#include <vector>
+
+struct SuiteOptions
+{
+  size_t digestSize = 512;
+  size_t runs = 11;
+  double minSampleSeconds = 0.01;
+  size_t minSize = 0;
+  size_t maxSize = 1024 * 1024 * 1024;
+  size_t batchSize = 64;
+  size_t prefixSize = 4096; // Shared prefix of the prefix path, its rows report prefix + suffix size.
+  std::vector<std::string> paths = {"permutation", "absorb", "single", "batch", "prefix", "multistream"};
+  std::string jsonFile;     // Write results as JSON if not empty.
+  std::string baselineFile; // Compare results against JSON baseline if not empty.
+  double threshold = 5;     // Regression threshold in percents.
+  bool perf = false;        // Read hardware counters around every case.
+};
+
+// Run kernel microbenchmarks. Returns process exit code, which is nonzero if a regression is found.
+int runSuite(std::ostream &out, const SuiteOptions &options);
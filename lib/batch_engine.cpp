@@ -0,0 +1,113 @@
+#include "batch_engine.h"
+#include "tuning.h"
+
+namespace keccak
+{
+
+size_t BatchMessage::size() const
+{
+  size_t result = head.size + trailer.size + (fragments == nullptr ? data.size : 0);
+  for (size_t i = 0; fragments != nullptr && i < fragmentCount; ++i)
+  {
+    result += fragments[i].iov_len;
+  }
+  return result;
+}
+
+BatchEngine::BatchEngine(unsigned threads, size_t width)
+{
+  auto &profile = tuning::hostProfile();
+  threads = threads == 0 ? profile.threads : threads;
+  if (threads == 0)
+  {
+    threads = omp_get_num_procs();
+    threads = threads == 0 ? 2 : threads;
+  }
+  width = width == 0 ? profile.width : width;
+  m_width = width == 0 ? kernelWidth() : std::min(width, lanes);
+  m_states.resize(threads);
+  for (auto &val : m_states)
+  {
+    val.lanes.reset(new uint64_t[stateWords * lanes]);
+    val.blockBuffer.reset(new uint8_t[stateBytes * lanes]);
+  }
+}
+
+std::vector<double> BatchEngine::busyTimes() const
+{
+  std::vector<double> result;
+  result.reserve(m_states.size());
+  for (auto &state : m_states)
+  {
+    result.push_back(state.busy);
+  }
+  return result;
+}
+
+double BatchEngine::laneOccupancy() const
+{
+  uint64_t total = 0;
+  uint64_t used = 0;
+  for (auto &state : m_states)
+  {
+    total += state.lanePermutations;
+    used += state.activePermutations;
+  }
+  // Work done on the scalar kernel alone keeps no lanes idle.
+  return total == 0 ? 1.0 : double(used) / total;
+}
+
+const uint8_t *BatchEngine::nextBlock(Lane &v, uint8_t *buffer)
+{
+  skipEmpty(v);
+  if (v.current.size >= v.rate)
+  {
+    const uint8_t *block = v.current.data;
+    v.current.data += v.rate;
+    v.current.size -= v.rate;
+    return block;
+  }
+
+  size_t used = 0;
+  while (used < v.rate && v.current.size != 0)
+  {
+    size_t n = std::min(v.current.size, v.rate - used);
+    std::copy(v.current.data, v.current.data + n, buffer + used);
+    v.current.data += n;
+    v.current.size -= n;
+    used += n;
+    skipEmpty(v);
+  }
+
+  // A message ending on a block boundary gets a block of padding only.
+  if (used != v.rate)
+  {
+    addPadding(buffer + used, buffer + v.rate, v.domain);
+    v.last = true;
+  }
+  return buffer;
+}
+
+void BatchEngine::skipEmpty(Lane &v)
+{
+  const BatchMessage &m = v.message;
+  while (v.current.size == 0 && v.part + 1 < v.parts)
+  {
+    ++v.part;
+    if (v.part + 1 == v.parts)
+    {
+      v.current = m.trailer;
+    }
+    else if (m.fragments == nullptr)
+    {
+      v.current = m.data;
+    }
+    else
+    {
+      const iovec &fragment = m.fragments[v.part - 1];
+      v.current = {static_cast<const uint8_t *>(fragment.iov_base), fragment.iov_len};
+    }
+  }
+}
+
+} // namespace keccak
@@ -0,0 +1,214 @@
+#pragma once
+#include "keccak.h"
+#include "telemetry.h"
+#include "trace.h"
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <omp.h>
+#include <sys/uio.h>
+#include <vector>
+
+namespace keccak
+{
+
+struct Segment
+{
+  const uint8_t *data = nullptr;
+  size_t size = 0;
+};
+
+// One message of a batch and the sponge it's absorbed into.
+// Message bytes are head, data and trailer one after another, e.g. a shared prefix tail, a record
+// and an encoded length. Data given as fragments replaces the data segment.
+struct BatchMessage
+{
+  const uint64_t *initial = nullptr; // State before the message, zero state if null.
+  size_t rate = 0;
+  uint8_t domain = 0x06; // Domain separation bits of the padding.
+  Segment head;
+  Segment data;
+  const iovec *fragments = nullptr;
+  size_t fragmentCount = 0;
+  Segment trailer;
+
+  size_t size() const;
+};
+
+// Worker threads hashing batches of messages on the multi-lane kernel, shared by batch classes.
+// Workers take messages one at a time and refill a lane as soon as its message is done,
+// so lanes don't idle behind long messages. A message left alone in a worker finishes on the scalar kernel.
+// Width 2 to scalarLanes runs the interleaved scalar kernel, for hosts where SIMD doesn't pay off.
+class BatchEngine {
+public:
+  // Zero threads means one thread per available processor, zero width means the kernel width of the cpu.
+  // Zero values are taken from the host tuning profile if there is one.
+  explicit BatchEngine(unsigned threads = 0, size_t width = 0);
+
+  // Absorbs count messages, message(i) describes message i. Calls onDigest(i, state) from worker threads
+  // with the state after the last permutation.
+  template<typename M, typename F>
+  void run(size_t count, M &&message, F &&onDigest);
+
+  size_t threads() const { return m_states.size(); }
+  // Messages a worker hashes at once, width 1 runs the scalar kernel only.
+  size_t width() const { return m_width; }
+
+  // Time in seconds each worker thread spent hashing during the last run.
+  std::vector<double> busyTimes() const;
+
+  // Share of kernel lanes that carried a message during the last run, in [0, 1].
+  double laneOccupancy() const;
+
+private:
+  struct Lane
+  {
+    size_t index;
+    size_t rate;
+    uint8_t domain;
+    BatchMessage message;
+    size_t parts;    // Head, data segment or fragments, trailer.
+    size_t part;     // Part being absorbed.
+    Segment current; // Bytes left in the part.
+    bool last;       // The padded block was returned.
+    bool active;
+  };
+
+  struct State
+  {
+    uint64_t A[stateWords];                 // A message left alone finishes on the scalar kernel.
+    std::unique_ptr<uint64_t[]> lanes;      // Interleaved states of the multi-lane kernel.
+    std::unique_ptr<uint8_t[]> blockBuffer; // Blocks crossing segments and padded blocks of every lane.
+    double busy = 0;
+    uint64_t lanePermutations = 0;   // Lanes permuted, used or not.
+    uint64_t activePermutations = 0; // Lanes permuted with a message.
+  };
+
+  // Returns the next block of the lane: in place if it doesn't cross parts, otherwise gathered in buffer.
+  static const uint8_t *nextBlock(Lane &v, uint8_t *buffer);
+  // Moves to the next part with bytes left, if any.
+  static void skipEmpty(Lane &v);
+
+private:
+  std::vector<State> m_states;
+  size_t m_width;
+};
+
+template<typename M, typename F>
+void BatchEngine::run(size_t count, M &&message, F &&onDigest)
+{
+#ifdef SHA3_TELEMETRY
+  double calculateStart = omp_get_wtime();
+#endif // SHA3_TELEMETRY
+  for (auto &state : m_states)
+  {
+    state.busy = 0;
+    state.lanePermutations = 0;
+    state.activePermutations = 0;
+  }
+
+  std::atomic<size_t> next{0};
+#pragma omp parallel num_threads(m_states.size())
+  {
+    trace::Span span("hash", "messages");
+    double start = omp_get_wtime();
+    auto &state = m_states[omp_get_thread_num()];
+    size_t messages = 0;
+    uint64_t bytes = 0;
+    uint64_t blocks = 0;
+    Lane lane[lanes] = {};
+    size_t active = 0;
+
+    auto refill = [&](size_t l) {
+      size_t i = next.fetch_add(1, std::memory_order_relaxed);
+      lane[l].active = i < count;
+      if (!lane[l].active)
+      {
+        return;
+      }
+      BatchMessage m = message(i);
+      lane[l] = {i, m.rate, m.domain, m, (m.fragments == nullptr ? 1 : m.fragmentCount) + 2, 0, m.head, false, true};
+      size_t size = m.size();
+      ++messages;
+      bytes += size;
+      blocks += size / m.rate + 1;
+      for (size_t w = 0; w < stateWords; ++w)
+      {
+        state.lanes[w * lanes + l] = m.initial == nullptr ? 0 : m.initial[w];
+      }
+      ++active;
+    };
+
+    for (size_t l = 0; l < m_width; ++l)
+    {
+      refill(l);
+    }
+
+    while (active != 0)
+    {
+      if (active == 1)
+      {
+        // A permutation of one lane is cheaper on the scalar kernel.
+        size_t l = std::find_if(lane, lane + lanes, [](const Lane &v) { return v.active; }) - lane;
+        Lane &v = lane[l];
+        uint8_t *buffer = state.blockBuffer.get() + l * stateBytes;
+        scatterLane(state.lanes.get(), l, state.A);
+        do
+        {
+          processSingleBlock(state.A, nextBlock(v, buffer), v.rate);
+        } while (!v.last);
+        onDigest(v.index, static_cast<const uint64_t *>(state.A));
+        --active;
+        refill(l);
+        continue;
+      }
+
+      // Every active lane absorbs its next block.
+      bool done[lanes] = {};
+      for (size_t l = 0; l < lanes; ++l)
+      {
+        Lane &v = lane[l];
+        if (v.active)
+        {
+          absorbLane(state.lanes.get(), l, nextBlock(v, state.blockBuffer.get() + l * stateBytes), v.rate);
+          done[l] = v.last;
+        }
+      }
+
+      if (m_width == lanes)
+      {
+        updateStates(state.lanes.get());
+      }
+      else
+      {
+        updateStatesScalar(state.lanes.get(), m_width);
+      }
+      state.lanePermutations += m_width;
+      state.activePermutations += active;
+
+      for (size_t l = 0; l < lanes; ++l)
+      {
+        if (done[l])
+        {
+          uint64_t A[stateWords];
+          scatterLane(state.lanes.get(), l, A);
+          onDigest(lane[l].index, static_cast<const uint64_t *>(A));
+          --active;
+          refill(l);
+        }
+      }
+    }
+    state.busy = omp_get_wtime() - start;
+    span.setArg(messages);
+    SHA3_TELEMETRY_ADD(BytesAbsorbed, bytes);
+    SHA3_TELEMETRY_ADD(Permutations, blocks);
+  }
+#ifdef SHA3_TELEMETRY
+  auto busy = busyTimes();
+  SHA3_TELEMETRY_BATCH(count, busy.data(), busy.size(), omp_get_wtime() - calculateStart);
+#endif // SHA3_TELEMETRY
+}
+
+} // namespace keccak
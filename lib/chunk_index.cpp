@@ -0,0 +1,203 @@
+#include "chunk_index.h"
+#include "util.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <numeric>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace chunk_index;
+
+ChunkIndexWriter::ChunkIndexWriter(size_t digestSize)
+  : m_digestSize(digestSize)
+{}
+
+uint32_t ChunkIndexWriter::addFile(const std::string &name)
+{
+  m_files.push_back(name);
+  return static_cast<uint32_t>(m_files.size() - 1);
+}
+
+void ChunkIndexWriter::add(const uint8_t *digest, const Location &location)
+{
+  size_t offset = m_entries.size();
+  m_entries.resize(offset + entrySize());
+  uint8_t *entry = m_entries.data() + offset;
+  std::copy(digest, digest + m_digestSize, entry);
+  putLittleEndian(entry + m_digestSize, location.file, 4);
+  putLittleEndian(entry + m_digestSize + 4, location.size, 4);
+  putLittleEndian(entry + m_digestSize + 8, location.offset, 8);
+  ++m_stats.chunks;
+  m_stats.bytes += location.size;
+}
+
+bool ChunkIndexWriter::write(const std::string &path)
+{
+  const size_t count = m_entries.size() / entrySize();
+  auto entry = [this](size_t i) { return m_entries.data() + i * entrySize(); };
+
+  // Stable sort keeps the first occurrence of a chunk in front of duplicates.
+  std::vector<size_t> order(count);
+  std::iota(order.begin(), order.end(), size_t(0));
+  std::stable_sort(order.begin(), order.end(), [&](size_t l, size_t r) {
+    return std::memcmp(entry(l), entry(r), m_digestSize) < 0;
+  });
+
+  std::vector<size_t> unique;
+  for (size_t i : order)
+  {
+    if (unique.empty() || std::memcmp(entry(unique.back()), entry(i), m_digestSize) != 0)
+    {
+      unique.push_back(i);
+      m_stats.uniqueBytes += getLittleEndian(entry(i) + m_digestSize + 4, 4);
+    }
+  }
+  m_stats.uniqueChunks = unique.size();
+
+  std::unique_ptr<FILE, decltype(&fclose)> f(fopen(path.c_str(), "wb"), &fclose);
+  if (!f)
+  {
+    return false;
+  }
+
+  uint8_t header[headerSize];
+  std::copy(std::begin(magic), std::end(magic), header);
+  putLittleEndian(header + 8, version, 4);
+  putLittleEndian(header + 12, static_cast<uint32_t>(m_digestSize), 4);
+  putLittleEndian(header + 16, unique.size(), 8);
+  putLittleEndian(header + 24, m_files.size(), 8);
+  bool ok = fwrite(header, sizeof(header), 1, f.get()) == 1;
+  for (size_t i : unique)
+  {
+    ok = ok && fwrite(entry(i), entrySize(), 1, f.get()) == 1;
+  }
+
+  uint8_t value[8];
+  uint64_t nameOffset = 0;
+  for (size_t i = 0; i <= m_files.size(); ++i)
+  {
+    putLittleEndian(value, nameOffset, 8);
+    ok = ok && fwrite(value, sizeof(value), 1, f.get()) == 1;
+    nameOffset += i < m_files.size() ? m_files[i].size() : 0;
+  }
+  for (auto &name : m_files)
+  {
+    ok = ok && fwrite(name.data(), 1, name.size(), f.get()) == name.size();
+  }
+  return fclose(f.release()) == 0 && ok;
+}
+
+ChunkIndex::~ChunkIndex() { close(); }
+
+bool ChunkIndex::open(const std::string &path)
+{
+  close();
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+  {
+    return false;
+  }
+  struct stat st;
+  bool mapped = fstat(fd, &st) == 0 && size_t(st.st_size) >= headerSize;
+  if (mapped)
+  {
+    void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    mapped = data != MAP_FAILED;
+    if (mapped)
+    {
+      m_data = static_cast<const uint8_t *>(data);
+      m_size = st.st_size;
+    }
+  }
+  ::close(fd);
+  if (!mapped)
+  {
+    return false;
+  }
+
+  if (!std::equal(std::begin(magic), std::end(magic), m_data) || getLittleEndian(m_data + 8, 4) != version)
+  {
+    close();
+    return false;
+  }
+  m_digestSize = getLittleEndian(m_data + 12, 4);
+  m_entries = read64(16);
+  m_files = read64(24);
+  size_t stride = m_digestSize + 16;
+  if (m_digestSize == 0 || m_entries > m_size / stride || m_files > m_size / 8)
+  {
+    close();
+    return false;
+  }
+  m_namesOffset = headerSize + m_entries * stride;
+  size_t namesBlob = m_namesOffset + (m_files + 1) * 8;
+  if (namesBlob > m_size || read64(m_namesOffset + m_files * 8) > m_size - namesBlob)
+  {
+    close();
+    return false;
+  }
+  return true;
+}
+
+std::optional<Location> ChunkIndex::find(const uint8_t *digest) const
+{
+  size_t stride = m_digestSize + 16;
+  const uint8_t *entries = m_data + headerSize;
+  size_t lo = 0;
+  size_t hi = m_entries;
+  while (lo < hi)
+  {
+    size_t mid = lo + (hi - lo) / 2;
+    const uint8_t *entry = entries + mid * stride;
+    int cmp = std::memcmp(entry, digest, m_digestSize);
+    if (cmp == 0)
+    {
+      return Location{static_cast<uint32_t>(getLittleEndian(entry + m_digestSize, 4)),
+                      getLittleEndian(entry + m_digestSize + 8, 8),
+                      static_cast<uint32_t>(getLittleEndian(entry + m_digestSize + 4, 4))};
+    }
+    if (cmp < 0)
+    {
+      lo = mid + 1;
+    }
+    else
+    {
+      hi = mid;
+    }
+  }
+  return {};
+}
+
+std::string_view ChunkIndex::fileName(uint32_t file) const
+{
+  if (file >= m_files)
+  {
+    return {};
+  }
+  size_t blob = m_namesOffset + (m_files + 1) * 8;
+  uint64_t begin = read64(m_namesOffset + file * 8);
+  uint64_t end = read64(m_namesOffset + (file + 1) * 8);
+  if (begin > end || blob + end > m_size)
+  {
+    return {};
+  }
+  return std::string_view(reinterpret_cast<const char *>(m_data + blob + begin), end - begin);
+}
+
+void ChunkIndex::close()
+{
+  if (m_data != nullptr)
+  {
+    munmap(const_cast<uint8_t *>(m_data), m_size);
+  }
+  m_data = nullptr;
+  m_size = 0;
+  m_entries = 0;
+  m_files = 0;
+}
+
+uint64_t ChunkIndex::read64(size_t offset) const { return getLittleEndian(m_data + offset, 8); }
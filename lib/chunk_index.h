@@ -0,0 +1,92 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Chunk index file: digest -> (file, offset, size) of the first occurrence of the chunk.
+// Little-endian layout, usable directly from a memory mapping:
+//   header: magic "SHA3CIDX", uint32 version, uint32 digest size, uint64 entries, uint64 files
+//   entries sorted by digest: digest, uint32 file, uint32 size, uint64 offset
+//   name offsets: uint64[files + 1] relative to the names blob, then the names blob.
+namespace chunk_index
+{
+
+constexpr char magic[8] = {'S', 'H', 'A', '3', 'C', 'I', 'D', 'X'};
+constexpr uint32_t version = 1;
+constexpr size_t headerSize = 32;
+
+struct Location
+{
+  uint32_t file;
+  uint64_t offset;
+  uint32_t size;
+};
+
+} // namespace chunk_index
+
+class ChunkIndexWriter {
+public:
+  struct Stats
+  {
+    uint64_t chunks = 0;
+    uint64_t bytes = 0;
+    uint64_t uniqueChunks = 0;
+    uint64_t uniqueBytes = 0;
+
+    double dedupRatio() const { return uniqueBytes == 0 ? 1.0 : double(bytes) / uniqueBytes; }
+  };
+
+  explicit ChunkIndexWriter(size_t digestSize);
+
+  uint32_t addFile(const std::string &name);
+  void add(const uint8_t *digest, const chunk_index::Location &location);
+
+  // Sorts and deduplicates chunks and writes the index. Returns false on IO error.
+  bool write(const std::string &path);
+
+  // Valid after write.
+  const Stats &stats() const { return m_stats; }
+
+private:
+  size_t entrySize() const { return m_digestSize + 16; }
+
+private:
+  size_t m_digestSize;
+  std::vector<uint8_t> m_entries; // Serialized entries in order of addition.
+  std::vector<std::string> m_files;
+  Stats m_stats;
+};
+
+// Read-only memory mapped index.
+class ChunkIndex {
+public:
+  ChunkIndex() = default;
+  ChunkIndex(const ChunkIndex &) = delete;
+  ChunkIndex &operator=(const ChunkIndex &) = delete;
+  ~ChunkIndex();
+
+  // Returns false if the file can't be mapped or isn't a chunk index.
+  bool open(const std::string &path);
+
+  size_t digestSize() const { return m_digestSize; }
+  size_t size() const { return m_entries; }
+  size_t files() const { return m_files; }
+
+  std::optional<chunk_index::Location> find(const uint8_t *digest) const;
+  std::string_view fileName(uint32_t file) const;
+
+private:
+  void close();
+  uint64_t read64(size_t offset) const;
+
+private:
+  const uint8_t *m_data = nullptr;
+  size_t m_size = 0;
+  size_t m_digestSize = 0;
+  size_t m_entries = 0;
+  size_t m_files = 0;
+  size_t m_namesOffset = 0; // Offset of the name offsets array.
+};
@@ -0,0 +1,156 @@
+#include "chunker.h"
+#include <array>
+#include <cassert>
+
+namespace
+{
+
+// Random values for every byte, splitmix64 sequence.
+constexpr std::array<uint64_t, 256> makeGear()
+{
+  std::array<uint64_t, 256> result = {};
+  uint64_t x = 0;
+  for (auto &value : result)
+  {
+    x += 0x9e3779b97f4a7c15ull;
+    uint64_t z = x;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    value = z ^ (z >> 31);
+  }
+  return result;
+}
+
+constexpr std::array<uint64_t, 256> g_gear = makeGear();
+
+// Highest bits of the hash depend on the last 64 bytes, the mask uses them.
+uint64_t highMask(size_t bits) { return bits == 0 ? 0 : ~uint64_t(0) << (64 - bits); }
+
+size_t log2(size_t value)
+{
+  size_t result = 0;
+  while ((size_t(2) << result) <= value)
+  {
+    ++result;
+  }
+  return result;
+}
+
+} // namespace
+
+FastCdc::FastCdc(const ChunkerParams &params)
+  : m_params(params)
+{
+  assert(params.minSize <= params.avgSize && params.avgSize <= params.maxSize && params.avgSize >= 64);
+  // Normalization level 2.
+  size_t bits = log2(params.avgSize);
+  m_maskS = highMask(bits + 2);
+  m_maskL = highMask(bits - 2);
+}
+
+size_t FastCdc::cut(const uint8_t *data, size_t size) const
+{
+  if (size <= m_params.minSize)
+  {
+    return size;
+  }
+  size = std::min(size, m_params.maxSize);
+  size_t normal = std::min(size, m_params.avgSize);
+
+  uint64_t hash = 0;
+  size_t i = m_params.minSize;
+  for (; i < normal; ++i)
+  {
+    hash = (hash << 1) + g_gear[data[i]];
+    if ((hash & m_maskS) == 0)
+    {
+      return i + 1;
+    }
+  }
+  for (; i < size; ++i)
+  {
+    hash = (hash << 1) + g_gear[data[i]];
+    if ((hash & m_maskL) == 0)
+    {
+      return i + 1;
+    }
+  }
+  return size;
+}
+
+ChunkPipeline::ChunkPipeline(const ChunkerParams &params, size_t digestBits, OnChunk onChunk, unsigned threads,
+                             size_t batchChunks)
+  : m_chunker(params)
+  , m_onChunk(std::move(onChunk))
+  , m_batchChunks(std::max(batchChunks, size_t(1)))
+  , m_sha(digestBits, threads)
+{}
+
+ChunkPipeline::~ChunkPipeline()
+{
+  if (m_hashing.valid())
+  {
+    m_hashing.wait();
+  }
+}
+
+void ChunkPipeline::add(uint32_t file, const uint8_t *data, size_t size, std::shared_ptr<const void> keepAlive)
+{
+  for (uint64_t offset = 0; offset < size;)
+  {
+    size_t n = m_chunker.cut(data + offset, size - offset);
+    m_pending.chunks.push_back({file, offset, data + offset, static_cast<uint32_t>(n)});
+    offset += n;
+    if (m_pending.chunks.size() == m_batchChunks)
+    {
+      // Chunks of the file in the submitted batch keep it alive, the rest of them keep it in the next one.
+      m_pending.keepAlive.push_back(keepAlive);
+      submit();
+    }
+  }
+  if (keepAlive)
+  {
+    m_pending.keepAlive.push_back(std::move(keepAlive));
+  }
+}
+
+void ChunkPipeline::finish()
+{
+  if (!m_pending.chunks.empty())
+  {
+    submit();
+  }
+  if (m_hashing.valid())
+  {
+    m_hashing.get();
+  }
+  m_pending.keepAlive.clear();
+}
+
+void ChunkPipeline::submit()
+{
+  if (m_hashing.valid())
+  {
+    // Rethrows exceptions of onChunk.
+    m_hashing.get();
+  }
+  auto batch = std::make_shared<Batch>(std::move(m_pending));
+  m_pending = Batch();
+  m_hashing = std::async(std::launch::async, [this, batch]() { hash(*batch); });
+}
+
+void ChunkPipeline::hash(const Batch &batch)
+{
+  std::vector<std::pair<const uint8_t *, size_t>> args;
+  args.reserve(batch.chunks.size());
+  for (auto &chunk : batch.chunks)
+  {
+    args.push_back({chunk.data, chunk.size});
+  }
+  auto digests = m_sha.calculate(args);
+  for (size_t i = 0; i < digests.size(); ++i)
+  {
+    auto &chunk = batch.chunks[i];
+    m_onChunk({chunk.file, chunk.offset, chunk.size, digests[i].data()});
+  }
+}
@@ -0,0 +1,84 @@
+#pragma once
+#include "sha3_cpu.h"
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <vector>
+
+// FastCDC content-defined chunking: a gear rolling hash cuts where its masked bits are zero.
+// Before the average size a stricter mask is used and after it a looser one, so sizes concentrate
+// around the average ("normalized chunking").
+struct ChunkerParams
+{
+  size_t minSize = 2 * 1024;
+  size_t avgSize = 8 * 1024;
+  size_t maxSize = 64 * 1024;
+};
+
+class FastCdc {
+public:
+  explicit FastCdc(const ChunkerParams &params);
+
+  // Size of the first chunk of data, data is the rest of a stream.
+  size_t cut(const uint8_t *data, size_t size) const;
+
+  const ChunkerParams &params() const { return m_params; }
+
+private:
+  ChunkerParams m_params;
+  uint64_t m_maskS; // Used before the average size.
+  uint64_t m_maskL; // Used after the average size.
+};
+
+struct ChunkRecord
+{
+  uint32_t file;
+  uint64_t offset;
+  uint32_t size;
+  const uint8_t *digest;
+};
+
+// Chunks files and hashes the chunks with SHA3_cpu_batch. A batch of chunks is hashed on a separate thread
+// while the chunker scans the next one. onChunk is called for every chunk in order, from the hashing thread.
+class ChunkPipeline {
+public:
+  using OnChunk = std::function<void(const ChunkRecord &)>;
+
+  ChunkPipeline(const ChunkerParams &params, size_t digestBits, OnChunk onChunk, unsigned threads = 0,
+                size_t batchChunks = 4096);
+  ~ChunkPipeline();
+
+  // Chunks size bytes of file. Data must be valid until its chunks are reported, keepAlive is released then.
+  void add(uint32_t file, const uint8_t *data, size_t size, std::shared_ptr<const void> keepAlive = {});
+
+  // Hashes remaining chunks and waits for all of them.
+  void finish();
+
+private:
+  struct Pending
+  {
+    uint32_t file;
+    uint64_t offset;
+    const uint8_t *data;
+    uint32_t size;
+  };
+
+  struct Batch
+  {
+    std::vector<Pending> chunks;
+    std::vector<std::shared_ptr<const void>> keepAlive;
+  };
+
+  void submit();
+  void hash(const Batch &batch);
+
+private:
+  FastCdc m_chunker;
+  OnChunk m_onChunk;
+  size_t m_batchChunks;
+  SHA3_cpu_batch m_sha;
+  Batch m_pending;
+  std::future<void> m_hashing;
+};
@@ -0,0 +1,215 @@
+#include "duplicates.h"
+#include "util.h"
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+
+const size_t g_minBatch = 256;
+
+} // namespace
+
+DuplicateFinder::DuplicateFinder(size_t digestBits, size_t batchSize, unsigned threads)
+  : m_sha(digestBits, threads)
+  , m_batchSize(batchSize)
+{
+  if (m_batchSize == 0)
+  {
+    m_batchSize = (g_minBatch + m_sha.batchSize() - 1) / m_sha.batchSize() * m_sha.batchSize();
+  }
+}
+
+std::vector<DuplicateGroup> DuplicateFinder::find(const std::vector<std::string> &files)
+{
+  m_stats = Stats();
+  m_stats.files = files.size();
+  m_unreadable.clear();
+
+  std::vector<Candidate> all;
+  all.reserve(files.size());
+  for (size_t i = 0; i < files.size(); ++i)
+  {
+    struct stat st;
+    if (stat(files[i].c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+    {
+      ++m_stats.unreadable;
+      m_unreadable.push_back(files[i]);
+      continue;
+    }
+    all.push_back({i, uint64_t(st.st_size), {}, true});
+    m_stats.totalBytes += st.st_size;
+  }
+
+  // Stage 1: sizes, digests are still empty.
+  std::vector<Candidate *> candidates;
+  for (auto &candidate : all)
+  {
+    candidates.push_back(&candidate);
+  }
+  std::vector<std::vector<Candidate *>> groups = regroup(candidates);
+  candidates = flatten(groups);
+  m_stats.sizeCandidates = candidates.size();
+
+  // Stage 2: samples, final digests of files up to two samples.
+  sampleDigests(candidates, files);
+  groups = regroup(candidates);
+
+  // Stage 3: whole content of large files still colliding.
+  std::vector<Candidate *> large;
+  for (auto *candidate : flatten(groups))
+  {
+    if (candidate->size > 2 * sampleSize)
+    {
+      large.push_back(candidate);
+    }
+  }
+  if (!large.empty())
+  {
+    fullDigests(large, files);
+    groups = regroup(flatten(groups));
+  }
+
+  std::vector<DuplicateGroup> result;
+  for (auto &group : groups)
+  {
+    DuplicateGroup duplicate{group.front()->size, group.front()->digest, {}};
+    for (auto *candidate : group)
+    {
+      duplicate.files.push_back(files[candidate->file]);
+    }
+    result.push_back(std::move(duplicate));
+  }
+  return result;
+}
+
+std::vector<std::vector<DuplicateFinder::Candidate *>>
+    DuplicateFinder::regroup(const std::vector<Candidate *> &candidates)
+{
+  std::vector<Candidate *> sorted;
+  std::copy_if(candidates.begin(), candidates.end(), std::back_inserter(sorted),
+               [](const Candidate *c) { return c->readable; });
+  std::stable_sort(sorted.begin(), sorted.end(), [](const Candidate *l, const Candidate *r) {
+    if (l->size != r->size)
+    {
+      return l->size > r->size;
+    }
+    if (l->digest != r->digest)
+    {
+      return l->digest < r->digest;
+    }
+    return l->file < r->file;
+  });
+
+  std::vector<std::vector<Candidate *>> result;
+  for (size_t begin = 0; begin < sorted.size();)
+  {
+    size_t end = begin + 1;
+    while (end < sorted.size() && sorted[end]->size == sorted[begin]->size &&
+           sorted[end]->digest == sorted[begin]->digest)
+    {
+      ++end;
+    }
+    if (end - begin > 1)
+    {
+      result.emplace_back(sorted.begin() + begin, sorted.begin() + end);
+    }
+    begin = end;
+  }
+  return result;
+}
+
+std::vector<DuplicateFinder::Candidate *>
+    DuplicateFinder::flatten(const std::vector<std::vector<Candidate *>> &groups)
+{
+  std::vector<Candidate *> result;
+  for (auto &group : groups)
+  {
+    result.insert(result.end(), group.begin(), group.end());
+  }
+  return result;
+}
+
+void DuplicateFinder::sampleDigests(const std::vector<Candidate *> &candidates, const std::vector<std::string> &files)
+{
+  for (size_t first = 0; first < candidates.size(); first += m_batchSize)
+  {
+    size_t count = std::min(m_batchSize, candidates.size() - first);
+    std::vector<std::string> samples(count);
+    std::vector<Candidate *> read;
+    for (size_t i = 0; i < count; ++i)
+    {
+      Candidate &candidate = *candidates[first + i];
+      // Head and tail don't overlap, so files up to two samples are read once and whole.
+      size_t head = static_cast<size_t>(std::min<uint64_t>(candidate.size, sampleSize));
+      size_t tail = static_cast<size_t>(std::min<uint64_t>(candidate.size - head, sampleSize));
+      std::string &sample = samples[read.size()];
+      sample.resize(head + tail);
+      uint8_t *data = reinterpret_cast<uint8_t *>(sample.data());
+
+      int fd = open(files[candidate.file].c_str(), O_RDONLY | O_CLOEXEC);
+      bool ok = fd >= 0 && readAt(fd, data, head, 0) && readAt(fd, data + head, tail, candidate.size - tail);
+      if (fd >= 0)
+      {
+        close(fd);
+      }
+      if (!ok)
+      {
+        markUnreadable(candidate, files[candidate.file]);
+        continue;
+      }
+      m_stats.bytesRead += head + tail;
+      read.push_back(&candidate);
+    }
+    samples.resize(read.size());
+
+    auto digests = m_sha.calculate(prepareArgs(samples));
+    for (size_t i = 0; i < read.size(); ++i)
+    {
+      read[i]->digest = std::move(digests[i]);
+    }
+  }
+}
+
+void DuplicateFinder::fullDigests(const std::vector<Candidate *> &candidates, const std::vector<std::string> &files)
+{
+  for (size_t first = 0; first < candidates.size(); first += m_batchSize)
+  {
+    size_t count = std::min(m_batchSize, candidates.size() - first);
+    std::vector<std::shared_ptr<const void>> mappings;
+    std::vector<std::pair<const uint8_t *, size_t>> datas;
+    std::vector<Candidate *> mapped;
+    for (size_t i = 0; i < count; ++i)
+    {
+      Candidate &candidate = *candidates[first + i];
+      size_t size = 0;
+      auto mapping = mapFile(files[candidate.file], size);
+      // A file changed since it was sampled is left out.
+      if (!mapping || size != candidate.size)
+      {
+        markUnreadable(candidate, files[candidate.file]);
+        continue;
+      }
+      datas.emplace_back(static_cast<const uint8_t *>(mapping.get()), size);
+      mappings.push_back(std::move(mapping));
+      mapped.push_back(&candidate);
+    }
+
+    auto digests = m_sha.calculate(datas);
+    for (size_t i = 0; i < mapped.size(); ++i)
+    {
+      mapped[i]->digest = std::move(digests[i]);
+      m_stats.bytesRead += mapped[i]->size;
+      ++m_stats.fullyHashed;
+    }
+  }
+}
+
+void DuplicateFinder::markUnreadable(Candidate &candidate, const std::string &name)
+{
+  candidate.readable = false;
+  ++m_stats.unreadable;
+  m_unreadable.push_back(name);
+}
@@ -0,0 +1,67 @@
+#pragma once
+#include "sha3_cpu.h"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct DuplicateGroup
+{
+  uint64_t size;
+  std::vector<uint8_t> digest; // SHA3 of the whole content.
+  std::vector<std::string> files;
+};
+
+// Finds files with equal content reading as little as possible, in stages:
+//   1. files are grouped by size, unique sizes are dropped;
+//   2. the first and last sampleSize bytes of the rest are hashed, which is the whole content of small files;
+//   3. only files whose samples still collide are hashed in full.
+// Every stage hashes batches of files on the batch engine.
+class DuplicateFinder {
+public:
+  static constexpr size_t sampleSize = 64 * 1024;
+
+  struct Stats
+  {
+    uint64_t files = 0;
+    uint64_t unreadable = 0;
+    uint64_t sizeCandidates = 0; // Files sharing a size with another file.
+    uint64_t fullyHashed = 0;    // Files larger than two samples hashed in full.
+    uint64_t totalBytes = 0;
+    uint64_t bytesRead = 0;
+  };
+
+  // Zero batch size means the engine batch size, rounded up to at least 256 files.
+  explicit DuplicateFinder(size_t digestBits = 256, size_t batchSize = 0, unsigned threads = 0);
+
+  // Groups of two or more files, the largest files first. Files keep their order within a group.
+  std::vector<DuplicateGroup> find(const std::vector<std::string> &files);
+
+  // Valid after find.
+  const Stats &stats() const { return m_stats; }
+  const std::vector<std::string> &unreadable() const { return m_unreadable; }
+
+private:
+  struct Candidate
+  {
+    size_t file;
+    uint64_t size;
+    std::vector<uint8_t> digest;
+    bool readable;
+  };
+
+  // Candidates with equal size and digest, groups of one are dropped.
+  static std::vector<std::vector<Candidate *>> regroup(const std::vector<Candidate *> &candidates);
+  static std::vector<Candidate *> flatten(const std::vector<std::vector<Candidate *>> &groups);
+
+  // Replace digests of candidates, a file that can't be read is marked unreadable.
+  void sampleDigests(const std::vector<Candidate *> &candidates, const std::vector<std::string> &files);
+  void fullDigests(const std::vector<Candidate *> &candidates, const std::vector<std::string> &files);
+  void markUnreadable(Candidate &candidate, const std::string &name);
+
+private:
+  SHA3_cpu_batch m_sha;
+  size_t m_batchSize;
+  Stats m_stats;
+  std::vector<std::string> m_unreadable;
+};
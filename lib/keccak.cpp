@@ -0,0 +1,336 @@
+#include "keccak.h"
+#include "common.h"
+#include <algorithm>
+#include <cassert>
+#include <iterator>
+
+#ifdef __GNUC__
+#define SHA3_PRAGMA(x) _Pragma(#x)
+#define SHA3_UNROLL(n) SHA3_PRAGMA(GCC unroll n)
+#else
+#define SHA3_UNROLL(n)
+#endif
+
+namespace
+{
+using keccak::detail::g_iota_aux;
+using keccak::detail::g_ppi_aux;
+using keccak::detail::idx;
+
+// Multi-lane permutation over lane-interleaved states: word w of lane l is A[w * L + l].
+// Inner loops over lanes are independent, so compiler maps them onto SIMD registers.
+template<size_t L>
+#ifdef __GNUC__
+__attribute__((always_inline))
+#endif
+inline void permuteLanes(uint64_t *A)
+{
+  for (int round = 0; round < 24; ++round)
+  {
+    // Thetta phase
+    uint64_t C[25 * L];
+    for (size_t x = 0; x < 5; x++)
+    {
+      for (size_t l = 0; l < L; ++l)
+      {
+        C[x * L + l] = A[idx(x, 0) * L + l] ^ A[idx(x, 1) * L + l] ^ A[idx(x, 2) * L + l] ^
+                       A[idx(x, 3) * L + l] ^ A[idx(x, 4) * L + l];
+      }
+    }
+
+    for (size_t x = 0; x < 5; ++x)
+    {
+      for (size_t l = 0; l < L; ++l)
+      {
+        uint64_t D = C[idx(x + 5 - 1) * L + l] ^ rotateLeft(C[idx(x + 1) * L + l], 1);
+        for (int y = 0; y < 5; ++y)
+        {
+          A[idx(x, y) * L + l] ^= D;
+        }
+      }
+    }
+
+    // P and Pi phases
+    for (size_t l = 0; l < L; ++l)
+    {
+      C[l] = A[l];
+    }
+#ifdef __GNUC__
+#pragma GCC unroll 24
+#endif
+    for (size_t i = 0; i < 24; ++i)
+    {
+      for (size_t l = 0; l < L; ++l)
+      {
+        C[(i + 1) * L + l] = rotateLeft(A[g_ppi_aux[i].first * L + l], g_ppi_aux[i].second);
+      }
+    }
+
+    // Ksi phase
+    for (size_t x = 0; x < 5; ++x)
+    {
+      for (size_t y = 0; y < 5; ++y)
+      {
+        for (size_t l = 0; l < L; ++l)
+        {
+          A[idx(x, y) * L + l] = C[idx(x, y) * L + l] ^ (~C[idx(x + 1, y) * L + l] & C[idx(x + 2, y) * L + l]);
+        }
+      }
+    }
+
+    // Iota phase
+    for (size_t l = 0; l < L; ++l)
+    {
+      A[l] ^= g_iota_aux[round];
+    }
+  }
+}
+
+// Permutation of N states on general purpose registers: word w of state n is A[w * stride + n].
+// Rounds of the states are interleaved, so the independent dependency chains keep the execution ports busy
+// without SIMD. Loops are unrolled completely, otherwise the compiler keeps the states in memory and vectorizes.
+template<size_t N>
+#ifdef __GNUC__
+__attribute__((always_inline))
+#endif
+inline void permuteScalar(uint64_t *A, size_t stride)
+{
+  uint64_t S[N][25];
+  SHA3_UNROLL(25)
+  for (size_t w = 0; w < 25; ++w)
+  {
+    SHA3_UNROLL(3)
+    for (size_t n = 0; n < N; ++n)
+    {
+      S[n][w] = A[w * stride + n];
+    }
+  }
+
+  SHA3_UNROLL(1)
+  for (int round = 0; round < 24; ++round)
+  {
+    // Thetta phase
+    uint64_t C[N][5];
+    SHA3_UNROLL(5)
+    for (size_t x = 0; x < 5; ++x)
+    {
+      SHA3_UNROLL(3)
+      for (size_t n = 0; n < N; ++n)
+      {
+        C[n][x] = S[n][idx(x, 0)] ^ S[n][idx(x, 1)] ^ S[n][idx(x, 2)] ^ S[n][idx(x, 3)] ^ S[n][idx(x, 4)];
+      }
+    }
+
+    SHA3_UNROLL(5)
+    for (size_t x = 0; x < 5; ++x)
+    {
+      SHA3_UNROLL(3)
+      for (size_t n = 0; n < N; ++n)
+      {
+        uint64_t D = C[n][idx(x + 5 - 1)] ^ rotateLeft(C[n][idx(x + 1)], 1);
+        SHA3_UNROLL(5)
+        for (size_t y = 0; y < 5; ++y)
+        {
+          S[n][idx(x, y)] ^= D;
+        }
+      }
+    }
+
+    // P and Pi phases
+    uint64_t B[N][25];
+    SHA3_UNROLL(3)
+    for (size_t n = 0; n < N; ++n)
+    {
+      B[n][0] = S[n][0];
+    }
+    SHA3_UNROLL(24)
+    for (size_t i = 0; i < 24; ++i)
+    {
+      SHA3_UNROLL(3)
+      for (size_t n = 0; n < N; ++n)
+      {
+        B[n][i + 1] = rotateLeft(S[n][g_ppi_aux[i].first], g_ppi_aux[i].second);
+      }
+    }
+
+    // Ksi phase
+    SHA3_UNROLL(5)
+    for (size_t x = 0; x < 5; ++x)
+    {
+      SHA3_UNROLL(5)
+      for (size_t y = 0; y < 5; ++y)
+      {
+        SHA3_UNROLL(3)
+        for (size_t n = 0; n < N; ++n)
+        {
+          S[n][idx(x, y)] = B[n][idx(x, y)] ^ (~B[n][idx(x + 1, y)] & B[n][idx(x + 2, y)]);
+        }
+      }
+    }
+
+    // Iota phase
+    SHA3_UNROLL(3)
+    for (size_t n = 0; n < N; ++n)
+    {
+      S[n][0] ^= g_iota_aux[round];
+    }
+  }
+
+  SHA3_UNROLL(25)
+  for (size_t w = 0; w < 25; ++w)
+  {
+    SHA3_UNROLL(3)
+    for (size_t n = 0; n < N; ++n)
+    {
+      A[w * stride + n] = S[n][w];
+    }
+  }
+}
+
+void updateStatesGeneric(uint64_t *A) { permuteLanes<keccak::lanes>(A); }
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SHA3_AVX2_DISPATCH
+__attribute__((target("avx2"))) void updateStatesAvx2(uint64_t *A) { permuteLanes<keccak::lanes>(A); }
+#endif
+
+using UpdateStatesFn = void (*)(uint64_t *);
+
+UpdateStatesFn selectUpdateStates()
+{
+#ifdef SHA3_AVX2_DISPATCH
+  if (__builtin_cpu_supports("avx2"))
+  {
+    return updateStatesAvx2;
+  }
+#endif
+  return updateStatesGeneric;
+}
+
+const UpdateStatesFn g_updateStates = selectUpdateStates();
+
+// Separate functions, so every state count gets its own register allocation.
+void updateStatesScalar1(uint64_t *A) { permuteScalar<1>(A, keccak::lanes); }
+void updateStatesScalar2(uint64_t *A) { permuteScalar<2>(A, keccak::lanes); }
+void updateStatesScalar3(uint64_t *A) { permuteScalar<3>(A, keccak::lanes); }
+
+const UpdateStatesFn g_updateStatesScalar[keccak::scalarLanes] = {updateStatesScalar1, updateStatesScalar2,
+                                                                  updateStatesScalar3};
+
+bool hasAvx2()
+{
+#ifdef SHA3_AVX2_DISPATCH
+  return __builtin_cpu_supports("avx2");
+#else
+  return false;
+#endif
+}
+
+} // namespace
+
+namespace keccak
+{
+
+void updateStates(uint64_t *A) { g_updateStates(A); }
+
+void updateStatesScalar(uint64_t *A, size_t count)
+{
+  assert(count >= 1 && count <= scalarLanes);
+  g_updateStatesScalar[count - 1](A);
+}
+
+// Two states fit the general purpose registers best, a third one spills more than it overlaps.
+size_t kernelWidth() { return hasAvx2() ? lanes : 2; }
+
+void gatherLane(uint64_t *lanesA, size_t lane, const uint64_t A[25])
+{
+  for (size_t w = 0; w < stateWords; ++w)
+  {
+    lanesA[w * lanes + lane] = A[w];
+  }
+}
+
+void scatterLane(const uint64_t *lanesA, size_t lane, uint64_t A[25])
+{
+  for (size_t w = 0; w < stateWords; ++w)
+  {
+    A[w] = lanesA[w * lanes + lane];
+  }
+}
+
+void absorbLane(uint64_t *lanesA, size_t lane, const uint8_t *data, size_t size)
+{
+  assert(size % 8 == 0);
+  for (size_t w = 0, ew = size / 8; w < ew; ++w)
+  {
+    uint64_t word;
+    std::copy(data + w * 8, data + w * 8 + 8, reinterpret_cast<uint8_t *>(&word));
+    lanesA[w * lanes + lane] ^= toLittleEndian(word);
+  }
+}
+
+void updateState(uint64_t A[25]) { permuteScalar<1>(A, 1); }
+
+void processSingleBlock(uint64_t A[25], const uint8_t *data, size_t size)
+{
+  assert(size % 8 == 0);
+  for (unsigned int i = 0, ei = size / 8; i < ei; ++i)
+  {
+    A[i] ^= toLittleEndian(reinterpret_cast<const uint64_t *>(data)[i]);
+  }
+
+  updateState(A);
+}
+
+void addPadding(uint8_t *begin, uint8_t *end, uint8_t domain)
+{
+
+  if (std::next(begin) == end)
+  {
+    *begin = domain | 0x80;
+    return;
+  }
+
+  *begin++ = domain;
+  *--end = 0x80;
+  std::fill(begin, end, 0);
+}
+
+
+void copyLittleEndian64(const uint64_t A[25], uint8_t *data, size_t size)
+{
+  if (isLittleEndian())
+  {
+    // Help the compiler to recognize a simple memcpy.
+    const uint8_t *A8 = reinterpret_cast<const uint8_t *>(A);
+    std::copy(A8, A8 + size, data);
+    return;
+  }
+
+  uint64_t *data64 = reinterpret_cast<uint64_t *>(data);
+  for (; size >= 8; size -= 8, ++A, ++data64)
+  {
+    *data64 = toLittleEndian(*A);
+  }
+  const uint8_t *A8 = reinterpret_cast<const uint8_t *>(A);
+  uint8_t *data8 = reinterpret_cast<uint8_t *>(data64);
+  std::copy(A8, A8 + size, data8);
+}
+
+void squeeze(uint64_t A[25], size_t rate, uint8_t *data, size_t size)
+{
+  while (true)
+  {
+    size_t n = std::min(size, rate);
+    copyLittleEndian64(A, data, n);
+    data += n;
+    size -= n;
+    if (size == 0)
+    {
+      return;
+    }
+    updateState(A);
+  }
+}
+
+} // namespace keccak
@@ -0,0 +1,125 @@
+#pragma once
+#include "common.h"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+// Keccak-f[1600] building blocks shared by cpu hashing classes and benchmarks.
+namespace keccak
+{
+
+// Size of the state in 64-bit words.
+constexpr size_t stateWords = 25;
+
+// Size of the state in bytes.
+constexpr size_t stateBytes = stateWords * sizeof(uint64_t);
+
+// Rate (block size) in bytes for the digest size in bits.
+constexpr size_t rate(size_t digestBits) { return stateBytes - 2 * (digestBits / 8); }
+
+namespace detail
+{
+constexpr size_t idx(size_t x) { return x % 5; }
+
+constexpr size_t idx(size_t x, size_t y) { return idx(x) + 5 * idx(y); }
+
+// Array of indicies and rotation for P and Pi phases.
+constexpr std::array<std::pair<uint8_t, uint8_t>, 24> g_ppi_aux = {
+    {{6, 44},  {12, 43}, {18, 21}, {24, 14}, {3, 28}, {9, 20},  {10, 3},  {16, 45},
+     {22, 61}, {1, 1},   {7, 6},   {13, 25}, {19, 8}, {20, 18}, {4, 27},  {5, 36},
+     {11, 10}, {17, 15}, {23, 56}, {2, 62},  {8, 55}, {14, 39}, {15, 41}, {21, 2}}};
+
+// Values, required for the last iota phase.
+constexpr std::array<uint64_t, 24> g_iota_aux = {
+    0x0000000000000001L, 0x0000000000008082L, 0x800000000000808aL, 0x8000000080008000L, 0x000000000000808bL,
+    0x0000000080000001L, 0x8000000080008081L, 0x8000000000008009L, 0x000000000000008aL, 0x0000000000000088L,
+    0x0000000080008009L, 0x000000008000000aL, 0x000000008000808bL, 0x800000000000008bL, 0x8000000000008089L,
+    0x8000000000008003L, 0x8000000000008002L, 0x8000000000000080L, 0x000000000000800aL, 0x800000008000000aL,
+    0x8000000080008081L, 0x8000000000008080L, 0x0000000080000001L, 0x8000000080008008L};
+} // namespace detail
+
+// Keccak-f[1600] permutation, 24 rounds. Usable in constant expressions, see sha3_constexpr.h.
+constexpr void permute(uint64_t *A)
+{
+  using detail::idx;
+  for (int round = 0; round < 24; ++round)
+  {
+    // Thetta phase
+    uint64_t C[25] = {};
+    for (size_t x = 0; x < 5; x++)
+    {
+      C[x] = A[idx(x, 0)] ^ A[idx(x, 1)] ^ A[idx(x, 2)] ^ A[idx(x, 3)] ^ A[idx(x, 4)];
+    }
+
+    for (size_t x = 0; x < 5; ++x)
+    {
+      uint64_t D = C[idx(x + 5 - 1)] ^ rotateLeft(C[idx(x + 1)], 1);
+      for (int y = 0; y < 5; ++y)
+      {
+        A[idx(x, y)] ^= D;
+      }
+    }
+
+    // P and Pi phases
+    // First element remains the same.
+    C[0] = A[0];
+    for (size_t i = 0; i < 24; ++i)
+    {
+      C[i + 1] = rotateLeft(A[detail::g_ppi_aux[i].first], detail::g_ppi_aux[i].second);
+    }
+
+    // Ksi phase
+    for (size_t x = 0; x < 5; ++x)
+    {
+      for (size_t y = 0; y < 5; ++y)
+      {
+        A[idx(x, y)] = C[idx(x, y)] ^ (~C[idx(x + 1, y)] & C[idx(x + 2, y)]);
+      }
+    }
+
+    // Iota phase
+    A[0] ^= detail::g_iota_aux[round];
+  }
+}
+
+// Keccak-f[1600] permutation, 24 rounds.
+void updateState(uint64_t A[25]);
+
+// Absorb a single block of size bytes (multiple of 8) and permute the state.
+void processSingleBlock(uint64_t A[25], const uint8_t *data, size_t size);
+
+// Write padding with domain separation bits into [begin, end): 0x06 for SHA3, 0x1f for SHAKE, 0x04 for cSHAKE.
+void addPadding(uint8_t *begin, uint8_t *end, uint8_t domain = 0x06);
+
+// Copy size bytes of the state into data.
+void copyLittleEndian64(const uint64_t A[25], uint8_t *data, size_t size);
+
+// Copy size bytes of output into data, permuting the state after every rate bytes.
+void squeeze(uint64_t A[25], size_t rate, uint8_t *data, size_t size);
+
+// Number of states permuted together by updateStates.
+constexpr size_t lanes = 4;
+
+// Keccak-f[1600] of lanes states stored interleaved: word w of lane l is A[w * lanes + l].
+// Uses AVX2 if the cpu supports it.
+void updateStates(uint64_t *A);
+
+// Number of states updateStatesScalar interleaves at most.
+constexpr size_t scalarLanes = 3;
+
+// Keccak-f[1600] of the first count (1 to scalarLanes) of the interleaved states on general purpose registers:
+// the rounds of the states are interleaved to fill the execution ports. Faster than updateStates without AVX2.
+void updateStatesScalar(uint64_t *A, size_t count);
+
+// Lanes the kernel of this cpu hashes at once by default: lanes with AVX2, two on the scalar kernel otherwise.
+size_t kernelWidth();
+
+// Move single state into or out of the interleaved layout.
+void gatherLane(uint64_t *lanesA, size_t lane, const uint64_t A[25]);
+void scatterLane(const uint64_t *lanesA, size_t lane, uint64_t A[25]);
+
+// Xor a block of size bytes (multiple of 8) into one lane, without permutation.
+void absorbLane(uint64_t *lanesA, size_t lane, const uint8_t *data, size_t size);
+
+} // namespace keccak
@@ -0,0 +1,158 @@
+#include "kmac.h"
+#include "keccak.h"
+#include "telemetry.h"
+#include <cassert>
+
+using namespace keccak;
+
+namespace
+{
+
+// Big-endian bytes of value, at least one.
+std::vector<uint8_t> encodeValue(uint64_t value)
+{
+  std::vector<uint8_t> result;
+  do
+  {
+    result.insert(result.begin(), static_cast<uint8_t>(value));
+    value >>= 8;
+  } while (value != 0);
+  return result;
+}
+
+void leftEncode(std::vector<uint8_t> &out, uint64_t value)
+{
+  auto bytes = encodeValue(value);
+  out.push_back(static_cast<uint8_t>(bytes.size()));
+  out.insert(out.end(), bytes.begin(), bytes.end());
+}
+
+std::vector<uint8_t> rightEncode(uint64_t value)
+{
+  auto result = encodeValue(value);
+  result.push_back(static_cast<uint8_t>(result.size()));
+  return result;
+}
+
+void encodeString(std::vector<uint8_t> &out, const uint8_t *data, size_t size)
+{
+  leftEncode(out, uint64_t(size) * 8);
+  out.insert(out.end(), data, data + size);
+}
+
+void encodeString(std::vector<uint8_t> &out, std::string_view s)
+{
+  encodeString(out, reinterpret_cast<const uint8_t *>(s.data()), s.size());
+}
+
+} // namespace
+
+KeyedState::KeyedState(size_t security, std::string_view name, std::string_view customization)
+  : m_rate(keccak::rate(security))
+{
+  assert((security == 128 || security == 256) && "Unsupported security strength");
+  if (name.empty() && customization.empty())
+  {
+    m_domain = 0x1f;
+    return;
+  }
+
+  m_domain = 0x04;
+  std::vector<uint8_t> header;
+  encodeString(header, name);
+  encodeString(header, customization);
+  absorbPadded(header);
+}
+
+KeyedState KeyedState::cshake(size_t security, std::string_view name, std::string_view customization)
+{
+  return KeyedState(security, name, customization);
+}
+
+KeyedState KeyedState::kmac(size_t security, const uint8_t *key, size_t keySize, std::string_view customization)
+{
+  KeyedState result(security, "KMAC", customization);
+  std::vector<uint8_t> encodedKey;
+  encodeString(encodedKey, key, keySize);
+  result.absorbPadded(encodedKey);
+  result.m_kmac = true;
+  return result;
+}
+
+void KeyedState::absorbPadded(const std::vector<uint8_t> &data)
+{
+  std::vector<uint8_t> padded;
+  leftEncode(padded, m_rate);
+  padded.insert(padded.end(), data.begin(), data.end());
+  padded.resize((padded.size() + m_rate - 1) / m_rate * m_rate);
+  for (size_t offset = 0; offset < padded.size(); offset += m_rate)
+  {
+    processSingleBlock(m_A, padded.data() + offset, m_rate);
+  }
+}
+
+KMAC_cpu::KMAC_cpu(const KeyedState &state, size_t outSize)
+  : m_sponge(state.state(), state.rate(), state.domain(), outSize)
+{
+  if (state.isKmac())
+  {
+    m_trailer = rightEncode(uint64_t(outSize) * 8);
+  }
+}
+
+void KMAC_cpu::init()
+{
+  m_sponge.init();
+  m_finished = false;
+}
+
+void KMAC_cpu::add(const uint8_t *data, size_t sz)
+{
+  assert(!m_finished && "Init should be called");
+  m_sponge.add(data, sz);
+}
+
+std::vector<uint8_t> KMAC_cpu::digest()
+{
+  if (!m_finished)
+  {
+    m_sponge.add(m_trailer.data(), m_trailer.size());
+    m_finished = true;
+  }
+  return m_sponge.digest();
+}
+
+KMAC_cpu_batch::KMAC_cpu_batch(const KeyedState &state, size_t outSize, unsigned threads)
+  : m_state(state)
+  , m_outSize(outSize)
+  , m_engine(threads)
+{
+  if (state.isKmac())
+  {
+    m_trailer = rightEncode(uint64_t(outSize) * 8);
+  }
+}
+
+std::vector<KMAC_cpu_batch::Digest>
+    KMAC_cpu_batch::calculate(const std::vector<std::pair<const uint8_t *, size_t>> &datas)
+{
+  SHA3_TELEMETRY_KERNEL(CpuBatch);
+  std::vector<Digest> result(datas.size(), Digest(m_outSize));
+  m_engine.run(
+      datas.size(),
+      [&](size_t i) {
+        BatchMessage m;
+        m.initial = m_state.state();
+        m.rate = m_state.rate();
+        m.domain = m_state.domain();
+        m.data = {datas[i].first, datas[i].second};
+        m.trailer = {m_trailer.data(), m_trailer.size()};
+        return m;
+      },
+      [&](size_t i, const uint64_t *A) {
+        uint64_t state[stateWords];
+        std::copy(A, A + stateWords, state);
+        squeeze(state, m_state.rate(), result[i].data(), m_outSize);
+      });
+  return result;
+}
@@ -0,0 +1,71 @@
+#pragma once
+#include "batch_engine.h"
+#include "sha3_cpu.h"
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+// cSHAKE and KMAC (NIST SP 800-185).
+// The function name, customization and key are absorbed once into a KeyedState,
+// every message starts from a copy of it.
+class KeyedState {
+public:
+  // cSHAKE128/256 with function name and customization. Without both it's plain SHAKE128/256.
+  static KeyedState cshake(size_t security, std::string_view name, std::string_view customization);
+
+  // KMAC128/256 under key.
+  static KeyedState kmac(size_t security, const uint8_t *key, size_t keySize, std::string_view customization = {});
+
+  const uint64_t *state() const { return m_A; }
+  size_t rate() const { return m_rate; }
+  uint8_t domain() const { return m_domain; }
+  bool isKmac() const { return m_kmac; }
+
+private:
+  KeyedState(size_t security, std::string_view name, std::string_view customization);
+
+  // Absorbs bytepad(data, rate).
+  void absorbPadded(const std::vector<uint8_t> &data);
+
+private:
+  uint64_t m_A[25] = {};
+  size_t m_rate = 0;
+  uint8_t m_domain = 0;
+  bool m_kmac = false;
+};
+
+// Incremental cSHAKE or KMAC with outSize bytes of output.
+class KMAC_cpu {
+public:
+  KMAC_cpu(const KeyedState &state, size_t outSize);
+  void init();
+  void add(const uint8_t *data, size_t sz);
+
+  std::vector<uint8_t> digest();
+
+private:
+  SHA3_cpu m_sponge;
+  std::vector<uint8_t> m_trailer; // right_encode of the output length for KMAC.
+  bool m_finished = false;
+};
+
+// cSHAKE or KMAC of many messages under one keyed state, which is broadcast to all threads and lanes.
+class KMAC_cpu_batch {
+public:
+  using Digest = std::vector<uint8_t>;
+
+  // Zero threads means one thread per available processor.
+  KMAC_cpu_batch(const KeyedState &state, size_t outSize, unsigned threads = 0);
+
+  std::vector<Digest> calculate(const std::vector<std::pair<const uint8_t *, size_t>> &datas);
+
+  // Time in seconds each worker thread spent hashing during the last calculate call.
+  std::vector<double> busyTimes() const { return m_engine.busyTimes(); }
+
+private:
+  KeyedState m_state;
+  size_t m_outSize;
+  std::vector<uint8_t> m_trailer;
+  keccak::BatchEngine m_engine;
+};
@@ -0,0 +1,196 @@
+#include "nonce_search.h"
+#include "keccak.h"
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <omp.h>
+
+using namespace keccak;
+
+namespace
+{
+
+// Nonces taken by a worker at once.
+const uint64_t g_chunk = 1024;
+
+// True if the digest of the state, word w of which is A[w * stride], starts with zeroBits zero bits.
+bool hasZeroBits(const uint64_t *A, size_t stride, unsigned zeroBits)
+{
+  for (size_t w = 0; zeroBits != 0; ++w)
+  {
+    // The first byte of the digest is the lowest byte of the word.
+    uint64_t word = __builtin_bswap64(A[w * stride]);
+    if (zeroBits < 64)
+    {
+      return (word >> (64 - zeroBits)) == 0;
+    }
+    if (word != 0)
+    {
+      return false;
+    }
+    zeroBits -= 64;
+  }
+  return true;
+}
+
+uint64_t loadWord(const uint8_t *data)
+{
+  uint64_t result = 0;
+  for (size_t i = 0; i < 8; ++i)
+  {
+    result |= uint64_t(data[i]) << (i * 8);
+  }
+  return result;
+}
+
+} // namespace
+
+NonceSearch::NonceSearch(size_t block, unsigned threads)
+  : m_digestSize(block / 8)
+  , m_threads(threads)
+{
+  assert(m_digestSize * 8 == block);
+  if (m_threads == 0)
+  {
+    m_threads = omp_get_num_procs();
+    m_threads = m_threads == 0 ? 2 : m_threads;
+  }
+}
+
+std::optional<uint64_t> NonceSearch::search(const uint8_t *challenge, size_t size, unsigned zeroBits,
+                                            size_t nonceSize, uint64_t first, uint64_t count)
+{
+  assert(nonceSize >= 1 && nonceSize <= 8 && zeroBits <= m_digestSize * 8);
+  m_attempts = 0;
+  const uint64_t maxNonce = nonceSize == 8 ? ~uint64_t(0) : (uint64_t(1) << (nonceSize * 8)) - 1;
+  if (first > maxNonce || count == 0)
+  {
+    return {};
+  }
+  count = std::min(count - 1, maxNonce - first) + 1;
+
+  const size_t rate = 200 - 2 * m_digestSize;
+  uint64_t prefix[stateWords] = {};
+  const size_t full = size - size % rate;
+  for (size_t offset = 0; offset < full; offset += rate)
+  {
+    processSingleBlock(prefix, challenge + offset, rate);
+  }
+
+  // The rest of the message: challenge tail, zero nonce and padding, one block if they fit.
+  const size_t tail = size - full;
+  const size_t used = tail + nonceSize;
+  const size_t endSize = (used / rate + 1) * rate;
+  std::vector<uint8_t> end(endSize);
+  std::copy(challenge + full, challenge + size, end.begin());
+  addPadding(end.data() + used, end.data() + endSize, 0x06);
+  const bool single = endSize == rate;
+
+  // Single block: the lane state is base with nonce bytes xored in.
+  uint64_t base[stateWords];
+  std::copy(std::begin(prefix), std::end(prefix), base);
+  for (size_t w = 0; single && w < rate / 8; ++w)
+  {
+    base[w] ^= loadWord(end.data() + w * 8);
+  }
+  const size_t nonceWord = tail / 8;
+  const unsigned nonceShift = tail % 8 * 8;
+
+  std::atomic<uint64_t> next{0};
+  std::atomic<uint64_t> best{~uint64_t(0)}; // Offset of the smallest found nonce.
+  std::atomic<uint64_t> attempts{0};
+#pragma omp parallel num_threads(m_threads)
+  {
+    uint64_t lanesA[stateWords * lanes];
+    std::vector<uint8_t> blocks(single ? 0 : endSize * lanes);
+    uint64_t localAttempts = 0;
+
+    while (true)
+    {
+      uint64_t start = next.fetch_add(g_chunk, std::memory_order_relaxed);
+      if (start >= count || start >= best.load(std::memory_order_relaxed))
+      {
+        break;
+      }
+      uint64_t stop = start + std::min(g_chunk, count - start);
+
+      for (uint64_t offset = start; offset < stop && offset < best.load(std::memory_order_relaxed); offset += lanes)
+      {
+        size_t n = static_cast<size_t>(std::min<uint64_t>(lanes, stop - offset));
+        for (size_t l = 0; l < lanes; ++l)
+        {
+          // Spare lanes repeat the last nonce.
+          uint64_t nonce = first + offset + std::min(l, n - 1);
+          if (single)
+          {
+            for (size_t w = 0; w < stateWords; ++w)
+            {
+              lanesA[w * lanes + l] = base[w];
+            }
+            lanesA[nonceWord * lanes + l] ^= nonce << nonceShift;
+            if (nonceShift != 0)
+            {
+              lanesA[(nonceWord + 1) * lanes + l] ^= nonce >> (64 - nonceShift);
+            }
+            continue;
+          }
+
+          uint8_t *block = blocks.data() + l * endSize;
+          std::copy(end.begin(), end.end(), block);
+          for (size_t i = 0; i < nonceSize; ++i)
+          {
+            block[tail + i] = static_cast<uint8_t>(nonce >> (i * 8));
+          }
+          gatherLane(lanesA, l, prefix);
+          absorbLane(lanesA, l, block, rate);
+        }
+        updateStates(lanesA);
+        if (!single)
+        {
+          for (size_t l = 0; l < lanes; ++l)
+          {
+            absorbLane(lanesA, l, blocks.data() + l * endSize + rate, rate);
+          }
+          updateStates(lanesA);
+        }
+        localAttempts += n;
+
+        for (size_t l = 0; l < n; ++l)
+        {
+          if (hasZeroBits(lanesA + l, lanes, zeroBits))
+          {
+            uint64_t found = offset + l;
+            uint64_t current = best.load(std::memory_order_relaxed);
+            while (found < current && !best.compare_exchange_weak(current, found, std::memory_order_relaxed))
+            {
+            }
+            break;
+          }
+        }
+      }
+    }
+    attempts.fetch_add(localAttempts, std::memory_order_relaxed);
+  }
+
+  m_attempts = attempts.load();
+  uint64_t offset = best.load();
+  if (offset == ~uint64_t(0))
+  {
+    return {};
+  }
+  return first + offset;
+}
+
+unsigned NonceSearch::leadingZeroBits(const std::vector<uint8_t> &digest)
+{
+  unsigned result = 0;
+  for (uint8_t byte : digest)
+  {
+    if (byte != 0)
+    {
+      return result + __builtin_clz(byte) - 24;
+    }
+    result += 8;
+  }
+  return result;
+}
@@ -0,0 +1,31 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <vector>
+
+// Proof-of-work search: a nonce whose SHA3 digest of challenge || nonce starts with zeroBits zero bits.
+// Nonce is nonceSize little-endian bytes. Full blocks of the challenge are absorbed once, every attempt
+// sets only the nonce words of a lane state and the digest condition is tested on the state.
+class NonceSearch {
+public:
+  // Zero threads means one thread per available processor.
+  NonceSearch(size_t block, unsigned threads = 0);
+
+  // Returns the smallest matching nonce in [first, first + count), if any.
+  // Workers stop as soon as no smaller nonce can be found.
+  std::optional<uint64_t> search(const uint8_t *challenge, size_t size, unsigned zeroBits, size_t nonceSize = 8,
+                                 uint64_t first = 0, uint64_t count = std::numeric_limits<uint64_t>::max());
+
+  // Digests calculated during the last search.
+  uint64_t attempts() const { return m_attempts; }
+
+  // Number of leading zero bits of a digest, bits of a byte are counted from the most significant one.
+  static unsigned leadingZeroBits(const std::vector<uint8_t> &digest);
+
+private:
+  size_t m_digestSize;
+  unsigned m_threads;
+  uint64_t m_attempts = 0;
+};
@@ -0,0 +1,92 @@
+#pragma once
+#include "keccak.h"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+// Compile-time SHA3 and SHAKE, e.g. for tags of protocol strings in constexpr tables:
+//   constexpr auto tag = sha3::digest<256>("hello");
+//   switch (key) { case sha3::key<256>("get"): ... }
+// Results are the same as of SHA3_cpu, both use keccak::permute.
+namespace sha3
+{
+
+template<size_t N>
+using Bytes = std::array<uint8_t, N>;
+
+namespace detail
+{
+
+// Absorbs data with the domain separation byte and squeezes Out bytes.
+template<size_t Out>
+constexpr Bytes<Out> sponge(std::string_view data, size_t rate, uint8_t domain)
+{
+  uint64_t A[keccak::stateWords] = {};
+  size_t offset = 0;
+  auto xorByte = [&A](size_t pos, uint8_t b) { A[pos / 8] ^= uint64_t(b) << (pos % 8 * 8); };
+
+  for (char c : data)
+  {
+    xorByte(offset++, static_cast<uint8_t>(c));
+    if (offset == rate)
+    {
+      keccak::permute(A);
+      offset = 0;
+    }
+  }
+  xorByte(offset, domain);
+  xorByte(rate - 1, 0x80);
+  keccak::permute(A);
+
+  Bytes<Out> result = {};
+  for (size_t i = 0, pos = 0; i < Out; ++i, ++pos)
+  {
+    if (pos == rate)
+    {
+      keccak::permute(A);
+      pos = 0;
+    }
+    result[i] = static_cast<uint8_t>(A[pos / 8] >> (pos % 8 * 8));
+  }
+  return result;
+}
+
+} // namespace detail
+
+// SHA3-224/256/384/512 of data.
+template<size_t DigestBits>
+constexpr Bytes<DigestBits / 8> digest(std::string_view data)
+{
+  static_assert(DigestBits == 224 || DigestBits == 256 || DigestBits == 384 || DigestBits == 512,
+                "Unsupported digest size");
+  return detail::sponge<DigestBits / 8>(data, keccak::rate(DigestBits), 0x06);
+}
+
+// SHAKE128 and SHAKE256 of data, Out bytes long.
+template<size_t Out>
+constexpr Bytes<Out> shake128(std::string_view data)
+{
+  return detail::sponge<Out>(data, keccak::rate(128), 0x1f);
+}
+
+template<size_t Out>
+constexpr Bytes<Out> shake256(std::string_view data)
+{
+  return detail::sponge<Out>(data, keccak::rate(256), 0x1f);
+}
+
+// First 8 bytes of the digest as a little-endian number, for switch cases and hash table keys.
+template<size_t DigestBits>
+constexpr uint64_t key(std::string_view data)
+{
+  auto d = digest<DigestBits>(data);
+  uint64_t result = 0;
+  for (size_t i = 0; i < 8; ++i)
+  {
+    result |= uint64_t(d[i]) << (i * 8);
+  }
+  return result;
+}
+
+} // namespace sha3
@@ -1,117 +1,23 @@
 #include "sha3_cpu.h"
-#include "common.h"
-#include <array>
+#include "keccak.h"
+#include "telemetry.h"
+#include "tuning.h"
+#include "util.h"
+#include <algorithm>
+#include <atomic>
+#include <cassert>
 #include <cstdlib>
-#include <omp.h>
+#include <mutex>
 
-namespace
-{
-constexpr size_t idx(size_t x) { return x % 5; }
-
-constexpr size_t idx(size_t x, size_t y) { return idx(x) + 5 * idx(y); }
-
-// Array of indicies and rotation for P and Pi phases.
-constexpr std::array<std::pair<uint8_t, uint8_t>, 24> g_ppi_aux = {
-    {{6, 44},  {12, 43}, {18, 21}, {24, 14}, {3, 28}, {9, 20},  {10, 3},  {16, 45},
-     {22, 61}, {1, 1},   {7, 6},   {13, 25}, {19, 8}, {20, 18}, {4, 27},  {5, 36},
-     {11, 10}, {17, 15}, {23, 56}, {2, 62},  {8, 55}, {14, 39}, {15, 41}, {21, 2}}};
-
-// Values, required for the last iota phase.
-constexpr std::array<uint64_t, 24> g_iota_aux = {
-    0x0000000000000001L, 0x0000000000008082L, 0x800000000000808aL, 0x8000000080008000L, 0x000000000000808bL,
-    0x0000000080000001L, 0x8000000080008081L, 0x8000000000008009L, 0x000000000000008aL, 0x0000000000000088L,
-    0x0000000080008009L, 0x000000008000000aL, 0x000000008000808bL, 0x800000000000008bL, 0x8000000000008089L,
-    0x8000000000008003L, 0x8000000000008002L, 0x8000000000000080L, 0x000000000000800aL, 0x800000008000000aL,
-    0x8000000080008081L, 0x8000000000008080L, 0x0000000080000001L, 0x8000000080008008L};
-
-
-void updateState(uint64_t A[25])
-{
-  for (int round = 0; round < 24; ++round)
-  {
-    // Thetta phase
-    uint64_t C[25];
-    for (size_t x = 0; x < 5; x++)
-    {
-      C[x] = A[idx(x, 0)] ^ A[idx(x, 1)] ^ A[idx(x, 2)] ^ A[idx(x, 3)] ^ A[idx(x, 4)];
-    }
-
-    for (size_t x = 0; x < 5; ++x)
-    {
-      uint64_t D = C[idx(x + 5 - 1)] ^ rotateLeft(C[idx(x + 1)], 1);
-      for (int y = 0; y < 5; ++y)
-      {
-        A[idx(x, y)] ^= D;
-      }
-    }
-
-    // P and Pi phases
-    // First element remains the same.
-    C[0] = A[0];
-    for (size_t i = 0; i < 24; ++i)
-    {
-      C[i + 1] = rotateLeft(A[g_ppi_aux[i].first], g_ppi_aux[i].second);
-    }
-
-    // Ksi phase
-    for (size_t x = 0; x < 5; ++x)
-    {
-      for (size_t y = 0; y < 5; ++y)
-      {
-        A[idx(x, y)] = C[idx(x, y)] ^ (~C[idx(x + 1, y)] & C[idx(x + 2, y)]);
-      }
-    }
-
-    // Iota phase
-    A[0] ^= g_iota_aux[round];
-  }
-}
-
-void processSingleBlock(uint64_t A[25], const uint8_t *data, size_t size)
-{
-  assert(size % 8 == 0);
-  for (unsigned int i = 0, ei = size / 8; i < ei; ++i)
-  {
-    A[i] ^= toLittleEndian(reinterpret_cast<const uint64_t *>(data)[i]);
-  }
-
-  updateState(A);
-}
+using namespace keccak;
 
-void addPadding(uint8_t *begin, uint8_t *end)
+namespace
 {
 
-  if (std::next(begin) == end)
-  {
-    *begin = 0x86;
-    return;
-  }
-
-  *begin++ = 0x06;
-  *--end = 0x80;
-  std::fill(begin, end, 0);
-}
-
-
-void copyLittleEndian64(const uint64_t A[25], uint8_t *data, size_t size)
-{
-  if (isLittleEndian())
-  {
-    // Help the compiler to recognize a simple memcpy.
-    const uint8_t *A8 = reinterpret_cast<const uint8_t *>(A);
-    std::copy(A8, A8 + size, data);
-    return;
-  }
+// Messages of one engine run in ordered sink mode, bounds the reorder buffer.
+const size_t g_reorderWindow = 65536;
 
-  uint64_t *data64 = reinterpret_cast<uint64_t *>(data);
-  for (; size >= 8; size -= 8, ++A, ++data64)
-  {
-    *data64 = toLittleEndian(*A);
-  }
-  const uint8_t *A8 = reinterpret_cast<const uint8_t *>(A);
-  uint8_t *data8 = reinterpret_cast<uint8_t *>(data64);
-  std::copy(A8, A8 + size, data8);
-}
+const size_t g_stateHeader = 9;
 
 } // namespace
 
@@ -124,9 +30,20 @@ SHA3_cpu::SHA3_cpu(size_t block)
   init();
 }
 
+SHA3_cpu::SHA3_cpu(const uint64_t initial[25], size_t rate, uint8_t domain, size_t outSize)
+  : m_digestSize(outSize)
+  , m_domain(domain)
+  , m_bufferSize(rate)
+  , m_blockBuffer(static_cast<uint8_t *>(aligned_alloc(sizeof(uint64_t), m_bufferSize)))
+{
+  assert(rate % 8 == 0 && rate < stateBytes);
+  std::copy(initial, initial + stateWords, m_initial.begin());
+  init();
+}
+
 void SHA3_cpu::init()
 {
-  std::fill(std::begin(m_A), std::end(m_A), uint64_t(0));
+  std::copy(m_initial.begin(), m_initial.end(), std::begin(m_A));
   m_bufferOffset = 0;
 
   m_finished = false;
@@ -135,6 +52,7 @@ void SHA3_cpu::init()
 void SHA3_cpu::add(const uint8_t *data, size_t sz)
 {
   assert(!m_finished && "Init should be called");
+  SHA3_TELEMETRY_ADD(BytesAbsorbed, sz);
   while (sz != 0)
   {
     if (sz < m_bufferSize - m_bufferOffset)
@@ -161,9 +79,17 @@ void SHA3_cpu::add(const uint8_t *data, size_t sz)
   }
 }
 
+void SHA3_cpu::add(const iovec *fragments, size_t count)
+{
+  for (size_t i = 0; i < count; ++i)
+  {
+    add(static_cast<const uint8_t *>(fragments[i].iov_base), fragments[i].iov_len);
+  }
+}
+
 void SHA3_cpu::finish()
 {
-  addPadding(m_blockBuffer.get() + m_bufferOffset, m_blockBuffer.get() + m_bufferSize);
+  addPadding(m_blockBuffer.get() + m_bufferOffset, m_blockBuffer.get() + m_bufferSize, m_domain);
   processBlock(m_blockBuffer.get());
   m_bufferOffset = 0;
 }
@@ -174,62 +100,226 @@ std::vector<uint8_t> SHA3_cpu::digest()
   {
     finish();
     m_finished = true;
+    SHA3_TELEMETRY_KERNEL(Cpu);
   }
   std::vector<uint8_t> result(m_digestSize);
-  copyLittleEndian64(m_A, result.data(), result.size());
+  if (m_digestSize <= m_bufferSize)
+  {
+    copyLittleEndian64(m_A, result.data(), result.size());
+    return result;
+  }
+  // Keep the state for repeated calls.
+  uint64_t A[25];
+  std::copy(std::begin(m_A), std::end(m_A), A);
+  squeeze(A, m_bufferSize, result.data(), result.size());
   return result;
 }
 
-void SHA3_cpu::processBlock(const uint8_t *buf) { processSingleBlock(m_A, buf, m_bufferSize); }
+std::vector<uint8_t> SHA3_cpu::saveState() const
+{
+  assert(!m_finished && "State is saved before digest");
+  std::vector<uint8_t> result(g_stateHeader + stateBytes + 4 + m_bufferOffset);
+  uint8_t *out = result.data();
+  putLittleEndian(out, m_bufferSize, 4);
+  putLittleEndian(out + 4, m_digestSize, 4);
+  out[8] = m_domain;
+  out += g_stateHeader;
+  for (size_t w = 0; w < stateWords; ++w, out += 8)
+  {
+    putLittleEndian(out, m_A[w], 8);
+  }
+  putLittleEndian(out, m_bufferOffset, 4);
+  std::copy(m_blockBuffer.get(), m_blockBuffer.get() + m_bufferOffset, out + 4);
+  return result;
+}
 
-SHA3_cpu_batch::SHA3_cpu_batch(size_t block)
-  : m_digestSize(block / 8)
+bool SHA3_cpu::restoreState(const uint8_t *data, size_t size)
 {
-  assert(m_digestSize * 8 == block);
-  unsigned threads = omp_get_num_procs();
-  threads = threads == 0 ? 2 : threads;
-  m_states.resize(threads);
-  for (auto &val : m_states)
+  const size_t fixed = g_stateHeader + stateBytes + 4;
+  if (size < fixed || getLittleEndian(data, 4) != m_bufferSize || getLittleEndian(data + 4, 4) != m_digestSize ||
+      data[8] != m_domain)
+  {
+    return false;
+  }
+  size_t buffered = getLittleEndian(data + fixed - 4, 4);
+  if (buffered >= m_bufferSize || size != fixed + buffered)
   {
-    val.blockBuffer.reset(new uint8_t[200 - 2 * m_digestSize]);
+    return false;
   }
+  for (size_t w = 0; w < stateWords; ++w)
+  {
+    m_A[w] = getLittleEndian(data + g_stateHeader + w * 8, 8);
+  }
+  std::copy(data + fixed, data + size, m_blockBuffer.get());
+  m_bufferOffset = buffered;
+  m_finished = false;
+  return true;
+}
+
+void SHA3_cpu::processBlock(const uint8_t *buf)
+{
+  processSingleBlock(m_A, buf, m_bufferSize);
+  SHA3_TELEMETRY_ADD(Permutations, 1);
+}
+
+SHA3_cpu_batch::SHA3_cpu_batch(size_t block, unsigned threads)
+  : m_digestSize(block / 8)
+  , m_engine(threads)
+{
+  assert(m_digestSize * 8 == block);
+  size_t workers = m_engine.threads();
+  m_batchSize = std::max((tuning::hostProfile().batch + workers - 1) / workers, size_t(1)) * workers;
 }
 
 std::vector<SHA3_cpu_batch::Digest>
     SHA3_cpu_batch::calculate(const std::vector<std::pair<const uint8_t *, size_t>> &datas)
 {
   auto result = prepareResult(datas.size());
-#pragma omp parallel num_threads(m_states.size())
+  process(datas, [&](size_t i, const uint64_t *A) { copyLittleEndian64(A, result[i].data(), m_digestSize); });
+  return result;
+}
+
+std::vector<SHA3_cpu_batch::Digest>
+    SHA3_cpu_batch::calculate(const uint8_t *prefix, size_t prefixSize,
+                              const std::vector<std::pair<const uint8_t *, size_t>> &suffixes)
+{
+  SHA3_TELEMETRY_KERNEL(CpuBatch);
+  size_t blockSize = 200 - 2 * m_digestSize;
+  uint64_t A[stateWords] = {};
+  size_t full = prefixSize - prefixSize % blockSize;
+  for (size_t offset = 0; offset < full; offset += blockSize)
+  {
+    processSingleBlock(A, prefix + offset, blockSize);
+  }
+  SHA3_TELEMETRY_ADD(BytesAbsorbed, full);
+  SHA3_TELEMETRY_ADD(Permutations, full / blockSize);
+
+  auto result = prepareResult(suffixes.size());
+  m_engine.run(
+      suffixes.size(),
+      [&](size_t i) {
+        BatchMessage m;
+        m.initial = A;
+        m.rate = blockSize;
+        m.head = {prefix + full, prefixSize - full};
+        m.data = {suffixes[i].first, suffixes[i].second};
+        return m;
+      },
+      [&](size_t i, const uint64_t *state) { copyLittleEndian64(state, result[i].data(), m_digestSize); });
+  return result;
+}
+
+std::vector<SHA3_cpu_batch::Digest>
+    SHA3_cpu_batch::calculate(const std::vector<std::pair<const iovec *, size_t>> &messages)
+{
+  SHA3_TELEMETRY_KERNEL(CpuBatch);
+  auto result = prepareResult(messages.size());
+  m_engine.run(
+      messages.size(),
+      [&](size_t i) {
+        BatchMessage m;
+        m.rate = 200 - 2 * m_digestSize;
+        m.fragments = messages[i].first;
+        m.fragmentCount = messages[i].second;
+        return m;
+      },
+      [&](size_t i, const uint64_t *A) { copyLittleEndian64(A, result[i].data(), m_digestSize); });
+  return result;
+}
+
+void SHA3_cpu_batch::calculate(const std::vector<std::pair<const uint8_t *, size_t>> &datas, const Sink &sink,
+                               bool ordered)
+{
+  if (!ordered)
   {
-    int tid = omp_get_thread_num();
-    auto &state = m_states[tid];
-    size_t blockSize = 200 - 2 * m_digestSize;
-    int nthreads = omp_get_num_threads();
-    for (size_t i = tid; i < datas.size(); i += nthreads)
+    process(datas, [&](size_t i, const uint64_t *A) {
+      uint8_t digest[stateBytes];
+      copyLittleEndian64(A, digest, m_digestSize);
+      sink(i, digest, m_digestSize);
+    });
+    return;
+  }
+
+  SHA3_TELEMETRY_KERNEL(CpuBatch);
+  const size_t window = std::min(g_reorderWindow, datas.size());
+  std::vector<uint8_t> buffer(window * m_digestSize);
+  std::unique_ptr<std::atomic<bool>[]> ready(new std::atomic<bool>[window]);
+  std::mutex delivery;
+  for (size_t first = 0; first < datas.size(); first += window)
+  {
+    const size_t count = std::min(window, datas.size() - first);
+    for (size_t i = 0; i < count; ++i)
     {
-      std::fill(std::begin(state.A), std::end(state.A), uint64_t(0));
-      size_t sizeLeft = datas[i].second;
-      const uint8_t *data = datas[i].first;
-
-      while (true)
-      {
-        if (sizeLeft < blockSize)
-        {
-          std::copy(data, data + sizeLeft, state.blockBuffer.get());
-          addPadding(state.blockBuffer.get() + sizeLeft, state.blockBuffer.get() + blockSize);
-          processSingleBlock(state.A, state.blockBuffer.get(), blockSize);
-          copyLittleEndian64(state.A, result[i].data(), m_digestSize);
-          break;
-        }
-        processSingleBlock(state.A, data, blockSize);
-        data += blockSize;
-        sizeLeft -= blockSize;
-      }
+      ready[i].store(false, std::memory_order_relaxed);
     }
+    size_t next = 0; // First digest not delivered yet, guarded by delivery.
+
+    m_engine.run(
+        count,
+        [&](size_t i) {
+          BatchMessage m;
+          m.rate = 200 - 2 * m_digestSize;
+          m.data = {datas[first + i].first, datas[first + i].second};
+          return m;
+        },
+        [&](size_t i, const uint64_t *A) {
+          copyLittleEndian64(A, buffer.data() + i * m_digestSize, m_digestSize);
+          ready[i].store(true, std::memory_order_release);
+          // Whoever holds the lock delivers every consecutive ready digest. The check after unlocking
+          // catches a digest whose worker found the lock taken just before it was released.
+          while (delivery.try_lock())
+          {
+            size_t n = next;
+            for (; n < count && ready[n].load(std::memory_order_acquire); ++n)
+            {
+              sink(first + n, buffer.data() + n * m_digestSize, m_digestSize);
+            }
+            next = n;
+            delivery.unlock();
+            if (n == count || !ready[n].load(std::memory_order_acquire))
+            {
+              break;
+            }
+          }
+        });
+  }
+}
+
+std::vector<uint64_t> SHA3_cpu_batch::verify(const std::vector<std::pair<const uint8_t *, size_t>> &datas,
+                                             const uint8_t *expected)
+{
+  // Bytes instead of bits: words of the mask can't be shared between threads without atomics.
+  std::vector<uint8_t> passed(datas.size());
+  process(datas, [&](size_t i, const uint64_t *A) {
+    uint8_t digest[keccak::stateBytes];
+    copyLittleEndian64(A, digest, m_digestSize);
+    passed[i] = std::equal(digest, digest + m_digestSize, expected + i * m_digestSize);
+  });
+
+  std::vector<uint64_t> result((datas.size() + 63) / 64);
+  for (size_t i = 0; i < passed.size(); ++i)
+  {
+    result[i / 64] |= uint64_t(passed[i]) << (i % 64);
   }
   return result;
 }
 
+template<typename F>
+void SHA3_cpu_batch::process(const std::vector<std::pair<const uint8_t *, size_t>> &datas, F &&onDigest)
+{
+  SHA3_TELEMETRY_KERNEL(CpuBatch);
+  size_t blockSize = 200 - 2 * m_digestSize;
+  m_engine.run(
+      datas.size(),
+      [&](size_t i) {
+        BatchMessage m;
+        m.rate = blockSize;
+        m.data = {datas[i].first, datas[i].second};
+        return m;
+      },
+      onDigest);
+}
+
 std::vector<SHA3_cpu_batch::Digest> SHA3_cpu_batch::prepareResult(size_t size)
 {
   std::vector<Digest> result;
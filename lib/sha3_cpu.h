@@ -1,17 +1,32 @@
 #pragma once
+#include "batch_engine.h"
+#include <array>
 #include <cstddef>
 #include <cstdint>
+#include <functional>
 #include <vector>
 #include <memory>
+#include <sys/uio.h>
 
 class SHA3_cpu {
 public:
   SHA3_cpu(size_t block);
+  // Sponge starting from initial state (e.g. keyed), with rate bytes, domain separation bits of the padding
+  // and outSize bytes of output. Outputs longer than the rate are squeezed.
+  SHA3_cpu(const uint64_t initial[25], size_t rate, uint8_t domain, size_t outSize);
   void init();
   void add(const uint8_t *data, size_t sz);
+  // Absorbs fragments one after another without joining them, only blocks crossing fragments are staged.
+  void add(const iovec *fragments, size_t count);
 
   std::vector<uint8_t> digest();
 
+  // Absorb state between add calls, e.g. to resume hashing of a growing file in another process.
+  // Little-endian: uint32 rate, uint32 output size, uint8 domain, state words, uint32 buffered size, buffered bytes.
+  std::vector<uint8_t> saveState() const;
+  // Restores a saved state of a hasher with the same parameters. Returns false otherwise or if data is malformed.
+  bool restoreState(const uint8_t *data, size_t size);
+
 private:
   // Argument buf should be at least m_buffer_size.
   void processBlock(const uint8_t *buf);
@@ -20,7 +35,9 @@ private:
 
 private:
   uint64_t m_A[25]; // State array.
+  std::array<uint64_t, 25> m_initial = {};
   size_t m_digestSize = 0;
+  uint8_t m_domain = 0x06;
 
   size_t m_bufferSize = 0;
   std::unique_ptr<uint8_t[]> m_blockBuffer;
@@ -33,20 +50,48 @@ class SHA3_cpu_batch {
 public:
   using Digest = std::vector<uint8_t>;
 
-  SHA3_cpu_batch(size_t block);
+  // Zero threads means one thread per available processor.
+  SHA3_cpu_batch(size_t block, unsigned threads = 0);
 
   std::vector<Digest> calculate(const std::vector<std::pair<const uint8_t *, size_t>> &datas);
-  size_t batchSize() const { return m_states.size(); }
+  // Digests of prefix followed by every suffix. Full blocks of the prefix are absorbed once,
+  // only the prefix tail and suffixes are hashed per message.
+  std::vector<Digest> calculate(const uint8_t *prefix, size_t prefixSize,
+                                const std::vector<std::pair<const uint8_t *, size_t>> &suffixes);
+  // Digests of messages given as fragment lists, fragments are absorbed in place.
+  std::vector<Digest> calculate(const std::vector<std::pair<const iovec *, size_t>> &messages);
+
+  // Receives the index of a message and its digest, which is valid during the call only.
+  using Sink = std::function<void(size_t index, const uint8_t *digest, size_t size)>;
+  // Passes every digest to sink from worker threads as soon as its message is done, nothing is stored.
+  // Unordered calls may run concurrently. Ordered calls come one at a time in index order: digests done
+  // ahead of their turn wait in a reorder buffer, which holds at most a window of messages.
+  void calculate(const std::vector<std::pair<const uint8_t *, size_t>> &datas, const Sink &sink, bool ordered);
+  // Preferred batch size: the host profile batch rounded up to whole rounds of workers, otherwise worker count.
+  size_t batchSize() const { return m_batchSize; }
+  // Messages filling every lane of every worker once, batches are best made of whole multiples of it.
+  size_t granularity() const { return m_engine.threads() * m_engine.width(); }
+
+  // Compares digests of datas with expected ones without materializing them.
+  // Expected digests are stored one after another. Bit i % 64 of word i / 64 is set if message i matches.
+  std::vector<uint64_t> verify(const std::vector<std::pair<const uint8_t *, size_t>> &datas, const uint8_t *expected);
+
+  // Time in seconds each worker thread spent hashing during the last calculate call.
+  std::vector<double> busyTimes() const { return m_engine.busyTimes(); }
+
+  // Share of multi-lane kernel lanes that carried a message during the last calculate call, in [0, 1].
+  // Workers refill a lane as soon as its message is done, so only the last messages leave lanes idle.
+  double laneOccupancy() const { return m_engine.laneOccupancy(); }
 
 private:
   std::vector<Digest> prepareResult(size_t size);
 
+  // Hashes datas in parallel, calls onDigest(index, state) from worker threads.
+  template<typename F>
+  void process(const std::vector<std::pair<const uint8_t *, size_t>> &datas, F &&onDigest);
+
 private:
   size_t m_digestSize = 0;
-  struct State
-  {
-    uint64_t A[25];
-    std::unique_ptr<uint8_t[]> blockBuffer;
-  };
-  std::vector<State> m_states;
+  keccak::BatchEngine m_engine;
+  size_t m_batchSize;
 };
@@ -1,8 +1,11 @@
 #include "sha3_gpu.h"
 #include "helper_cuda.h"
 #include "common.h"
+#include "telemetry.h"
 #include <cstdlib>
+#include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <limits>
 
 namespace
@@ -155,6 +158,7 @@ void SHA3_gpu::init()
 void SHA3_gpu::add(const uint8_t *data, size_t sz)
 {
   assert(!m_finished && "Init should be called");
+  SHA3_TELEMETRY_ADD(BytesAbsorbed, sz);
   size_t blockSz = m_nBuffers * m_singleBufSz;
   while (sz != 0)
   {
@@ -195,6 +199,8 @@ void SHA3_gpu::processBlock(size_t bufSize)
   auto ptr64 = reinterpret_cast<const uint64_t *>(m_d_blockBuffers);
   assert(m_singleBufSz % 8 == 0);
   processBlockDevice<<<1, 32>>>(ptr64, m_singleBufSz / 8, ptr64 + bufSize / 8, m_d_A);
+  SHA3_TELEMETRY_KERNEL(Gpu);
+  SHA3_TELEMETRY_ADD(Permutations, bufSize / m_singleBufSz);
 }
 
 //
@@ -300,6 +306,9 @@ std::vector<SHA3_gpu_batch::Digest>
     size_t globalOffset = 0;
   };
 
+#ifdef SHA3_TELEMETRY
+  auto calculateStart = std::chrono::steady_clock::now();
+#endif // SHA3_TELEMETRY
   std::vector<SHA3_gpu_batch::Digest> result = prepareResult(datas.size());
 
   size_t loopSize = std::min<size_t>(m_nBlocks, datas.size());
@@ -363,6 +372,29 @@ std::vector<SHA3_gpu_batch::Digest>
       }
     }
   }
+#ifdef SHA3_TELEMETRY
+  for (auto &data : datas)
+  {
+    SHA3_TELEMETRY_ADD(BytesAbsorbed, data.second);
+    SHA3_TELEMETRY_ADD(Permutations, data.second / m_singleBlockSize + 1);
+  }
+  std::chrono::duration<double> calculateTime = std::chrono::steady_clock::now() - calculateStart;
+  SHA3_TELEMETRY_BATCH(datas.size(), nullptr, 0, calculateTime.count());
+#endif // SHA3_TELEMETRY
+  return result;
+}
+
+std::vector<uint64_t> SHA3_gpu_batch::verify(const std::vector<std::pair<const uint8_t *, size_t>> &datas,
+                                             const uint8_t *expected)
+{
+  // Digests are copied from the device anyway, so compare them on the host.
+  auto digests = calculate(datas);
+  std::vector<uint64_t> result((datas.size() + 63) / 64);
+  for (size_t i = 0; i < digests.size(); ++i)
+  {
+    bool passed = std::equal(digests[i].begin(), digests[i].end(), expected + i * m_digestSize);
+    result[i / 64] |= uint64_t(passed) << (i % 64);
+  }
   return result;
 }
 
@@ -389,6 +421,7 @@ void SHA3_gpu_batch::launchKernel()
 
   checkCudaErrors(cudaMemcpy(m_d_states, m_states.get(), m_nBlocks * sizeof(State), cudaMemcpyHostToDevice));
   processBatchBlockDevice<<<m_nBlocks, 32>>>(m_d_states, m_singleBlockSize / 8);
+  SHA3_TELEMETRY_KERNEL(GpuBatch);
 #ifndef NDEBUG
   checkCudaErrors(cudaDeviceSynchronize());
 #endif
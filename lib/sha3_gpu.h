@@ -40,6 +40,10 @@ public:
   // Note, it's better for array to be sorted by descending size.
   std::vector<Digest> calculate(const std::vector<std::pair<const uint8_t *, size_t>> &datas);
   size_t batchSize() const { return m_nBlocks; }
+  size_t granularity() const { return m_nBlocks; }
+
+  // Same as SHA3_cpu_batch::verify.
+  std::vector<uint64_t> verify(const std::vector<std::pair<const uint8_t *, size_t>> &datas, const uint8_t *expected);
 
   struct State;
 
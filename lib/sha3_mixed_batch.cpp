@@ -0,0 +1,92 @@
+#include "sha3_mixed_batch.h"
+#include "keccak.h"
+#include "telemetry.h"
+#include <algorithm>
+#include <cassert>
+
+using namespace keccak;
+
+SHA3_cpu_mixed_batch::SHA3_cpu_mixed_batch(unsigned threads)
+  : m_engine(threads)
+{}
+
+std::vector<SHA3_cpu_mixed_batch::Digest> SHA3_cpu_mixed_batch::calculate(const std::vector<MixedMessage> &messages)
+{
+  SHA3_TELEMETRY_KERNEL(CpuBatch);
+  std::vector<Digest> result;
+  result.reserve(messages.size());
+  for (auto &m : messages)
+  {
+    size_t outSize = m.outSize == 0 ? digestSize(m.algorithm) : m.outSize;
+    assert(outSize != 0 && "SHAKE needs an output size");
+    assert((digestSize(m.algorithm) == 0 || outSize == digestSize(m.algorithm)) && "SHA3 has a fixed digest size");
+    result.emplace_back(outSize);
+  }
+
+  m_engine.run(
+      messages.size(),
+      [&](size_t i) {
+        BatchMessage m;
+        m.rate = rate(messages[i].algorithm);
+        m.domain = domain(messages[i].algorithm);
+        m.data = {messages[i].data, messages[i].size};
+        return m;
+      },
+      [&](size_t i, const uint64_t *A) {
+        Digest &out = result[i];
+        size_t messageRate = rate(messages[i].algorithm);
+        if (out.size() <= messageRate)
+        {
+          copyLittleEndian64(A, out.data(), out.size());
+          return;
+        }
+        uint64_t state[stateWords];
+        std::copy(A, A + stateWords, state);
+        squeeze(state, messageRate, out.data(), out.size());
+      });
+  return result;
+}
+
+size_t SHA3_cpu_mixed_batch::rate(HashAlgorithm algorithm)
+{
+  switch (algorithm)
+  {
+  case HashAlgorithm::SHA3_224:
+    return keccak::rate(224);
+  case HashAlgorithm::SHA3_256:
+    return keccak::rate(256);
+  case HashAlgorithm::SHA3_384:
+    return keccak::rate(384);
+  case HashAlgorithm::SHA3_512:
+    return keccak::rate(512);
+  case HashAlgorithm::SHAKE128:
+    return keccak::rate(128);
+  case HashAlgorithm::SHAKE256:
+    return keccak::rate(256);
+  }
+  assert(false);
+  return 0;
+}
+
+uint8_t SHA3_cpu_mixed_batch::domain(HashAlgorithm algorithm)
+{
+  bool shake = algorithm == HashAlgorithm::SHAKE128 || algorithm == HashAlgorithm::SHAKE256;
+  return shake ? 0x1f : 0x06;
+}
+
+size_t SHA3_cpu_mixed_batch::digestSize(HashAlgorithm algorithm)
+{
+  switch (algorithm)
+  {
+  case HashAlgorithm::SHA3_224:
+    return 28;
+  case HashAlgorithm::SHA3_256:
+    return 32;
+  case HashAlgorithm::SHA3_384:
+    return 48;
+  case HashAlgorithm::SHA3_512:
+    return 64;
+  default:
+    return 0;
+  }
+}
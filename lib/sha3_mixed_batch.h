@@ -0,0 +1,50 @@
+#pragma once
+#include "batch_engine.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+enum class HashAlgorithm
+{
+  SHA3_224,
+  SHA3_256,
+  SHA3_384,
+  SHA3_512,
+  SHAKE128,
+  SHAKE256
+};
+
+struct MixedMessage
+{
+  HashAlgorithm algorithm;
+  const uint8_t *data;
+  size_t size;
+  size_t outSize = 0; // Output bytes, zero means the digest size of SHA3. Required for SHAKE.
+};
+
+// Batch where every message has its own algorithm and output length, e.g. requests of a service.
+// Keccak-f is the same for every rate, so messages of all algorithms share the kernel lanes and workers;
+// only the bytes absorbed per block and the padding differ per lane. Outputs longer than the rate are squeezed.
+class SHA3_cpu_mixed_batch {
+public:
+  using Digest = std::vector<uint8_t>;
+
+  // Zero threads means one thread per available processor.
+  explicit SHA3_cpu_mixed_batch(unsigned threads = 0);
+
+  std::vector<Digest> calculate(const std::vector<MixedMessage> &messages);
+
+  // Rate in bytes, domain separation bits and digest size of the algorithm, zero digest size for SHAKE.
+  static size_t rate(HashAlgorithm algorithm);
+  static uint8_t domain(HashAlgorithm algorithm);
+  static size_t digestSize(HashAlgorithm algorithm);
+
+  // Time in seconds each worker thread spent hashing during the last calculate call.
+  std::vector<double> busyTimes() const { return m_engine.busyTimes(); }
+
+  // Share of multi-lane kernel lanes that carried a message during the last calculate call, in [0, 1].
+  double laneOccupancy() const { return m_engine.laneOccupancy(); }
+
+private:
+  keccak::BatchEngine m_engine;
+};
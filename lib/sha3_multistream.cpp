@@ -0,0 +1,217 @@
+#include "sha3_multistream.h"
+#include "keccak.h"
+#include "telemetry.h"
+#include "tuning.h"
+#include <algorithm>
+#include <cassert>
+
+using namespace keccak;
+
+SHA3_cpu_multistream::SHA3_cpu_multistream(size_t block, size_t queueBlocks)
+  : m_digestSize(block / 8)
+  , m_bufferSize(200 - 2 * m_digestSize)
+  , m_queueBlocks(std::max(queueBlocks, size_t(1)))
+  , m_lanes(stateWords * lanes)
+{
+  assert(m_digestSize * 8 == block);
+  size_t width = tuning::hostProfile().width;
+  m_width = width == 0 ? kernelWidth() : std::min(width, lanes);
+}
+
+SHA3_cpu_multistream::StreamId SHA3_cpu_multistream::open()
+{
+  StreamId id;
+  if (!m_free.empty())
+  {
+    id = m_free.back();
+    m_free.pop_back();
+  }
+  else
+  {
+    id = m_streams.size();
+    m_streams.emplace_back();
+    m_streams.back().queue.resize(m_queueBlocks * m_bufferSize);
+  }
+
+  Stream &s = m_streams[id];
+  std::fill(std::begin(s.A), std::end(s.A), uint64_t(0));
+  s.absorbed = 0;
+  s.filled = 0;
+  s.open = true;
+  return id;
+}
+
+void SHA3_cpu_multistream::add(StreamId id, const uint8_t *data, size_t sz)
+{
+  assert(id < m_streams.size() && m_streams[id].open && "Stream should be opened");
+  SHA3_TELEMETRY_ADD(BytesAbsorbed, sz);
+  Stream &s = m_streams[id];
+  while (sz != 0)
+  {
+    if (s.filled == s.queue.size())
+    {
+      // Queue is full: absorb it together with other streams' blocks and keep the partial tail.
+      absorbQueued(id);
+      std::copy(s.queue.begin() + s.absorbed, s.queue.begin() + s.filled, s.queue.begin());
+      s.filled -= s.absorbed;
+      s.absorbed = 0;
+    }
+
+    size_t n = std::min(sz, s.queue.size() - s.filled);
+    std::copy(data, data + n, s.queue.begin() + s.filled);
+    s.filled += n;
+    data += n;
+    sz -= n;
+  }
+
+  if (pendingBlocks(s) != 0)
+  {
+    markReady(id);
+  }
+}
+
+SHA3_cpu_multistream::Digest SHA3_cpu_multistream::finish(StreamId id)
+{
+  assert(id < m_streams.size() && m_streams[id].open && "Stream should be opened");
+  Stream &s = m_streams[id];
+  absorbQueued(id);
+
+  uint8_t last[stateBytes];
+  size_t tail = s.filled - s.absorbed;
+  std::copy(s.queue.begin() + s.absorbed, s.queue.begin() + s.filled, last);
+  addPadding(last + tail, last + m_bufferSize);
+  processSingleBlock(s.A, last, m_bufferSize);
+  SHA3_TELEMETRY_ADD(Permutations, 1);
+
+  Digest result(m_digestSize);
+  copyLittleEndian64(s.A, result.data(), m_digestSize);
+
+  s.open = false;
+  if (s.ready)
+  {
+    s.ready = false;
+    m_ready.erase(std::find(m_ready.begin(), m_ready.end(), id));
+  }
+  m_free.push_back(id);
+  SHA3_TELEMETRY_KERNEL(CpuMultistream);
+  return result;
+}
+
+void SHA3_cpu_multistream::flush()
+{
+  while (!m_ready.empty())
+  {
+    StreamId id = m_ready.back();
+    m_streams[id].ready = false;
+    m_ready.pop_back();
+    absorbQueued(id);
+  }
+}
+
+void SHA3_cpu_multistream::markReady(StreamId id)
+{
+  if (!m_streams[id].ready)
+  {
+    m_streams[id].ready = true;
+    m_ready.push_back(id);
+  }
+}
+
+SHA3_cpu_multistream::Stream *SHA3_cpu_multistream::takeReady(StreamId id)
+{
+  while (!m_ready.empty())
+  {
+    Stream &s = m_streams[m_ready.back()];
+    bool other = m_ready.back() != id;
+    // Taken streams are absorbed until their queues are empty, so they leave the list.
+    s.ready = false;
+    m_ready.pop_back();
+    if (other && pendingBlocks(s) != 0)
+    {
+      return &s;
+    }
+  }
+  return nullptr;
+}
+
+void SHA3_cpu_multistream::absorbQueued(StreamId id)
+{
+  if (pendingBlocks(m_streams[id]) == 0)
+  {
+    return;
+  }
+
+  Stream *lane[lanes] = {&m_streams[id]};
+  size_t used = 1;
+  for (Stream *s; used < m_width && (s = takeReady(id)) != nullptr; ++used)
+  {
+    lane[used] = s;
+  }
+
+  if (used > 1)
+  {
+    for (size_t l = 0; l < used; ++l)
+    {
+      gatherLane(m_lanes.data(), l, lane[l]->A);
+    }
+  }
+
+  // Every lane absorbs its next queued block, states stay interleaved until their queues run out.
+  uint64_t permutations = 0;
+  while (used > 1)
+  {
+    for (size_t l = 0; l < used; ++l)
+    {
+      absorbLane(m_lanes.data(), l, lane[l]->queue.data() + lane[l]->absorbed, m_bufferSize);
+      lane[l]->absorbed += m_bufferSize;
+    }
+    if (used == lanes)
+    {
+      updateStates(m_lanes.data());
+    }
+    else
+    {
+      updateStatesScalar(m_lanes.data(), used);
+    }
+    permutations += used;
+
+    for (size_t l = 0; l < used;)
+    {
+      if (pendingBlocks(*lane[l]) != 0)
+      {
+        ++l;
+        continue;
+      }
+      scatterLane(m_lanes.data(), l, lane[l]->A);
+      if (Stream *s = takeReady(id))
+      {
+        lane[l] = s;
+        gatherLane(m_lanes.data(), l, s->A);
+        ++l;
+        continue;
+      }
+
+      // No stream to refill the lane with: the last lane takes its place, so lanes stay packed.
+      --used;
+      if (l != used)
+      {
+        lane[l] = lane[used];
+        scatterLane(m_lanes.data(), used, lane[l]->A);
+        gatherLane(m_lanes.data(), l, lane[l]->A);
+      }
+    }
+    if (used == 1)
+    {
+      scatterLane(m_lanes.data(), 0, lane[0]->A);
+    }
+  }
+
+  // A stream left alone is cheaper on the scalar kernel.
+  Stream &s = *lane[0];
+  for (; pendingBlocks(s) != 0; s.absorbed += m_bufferSize)
+  {
+    processSingleBlock(s.A, s.queue.data() + s.absorbed, m_bufferSize);
+    ++permutations;
+  }
+  SHA3_TELEMETRY_ADD(Permutations, permutations);
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Many incremental SHA3 calculations at once, e.g. interleaved chunks of concurrent uploads.
+// Full blocks of different streams are queued and permuted together by the multi-lane kernel,
+// instead of one cache-cold permutation per chunk and stream. Lanes stay interleaved while their streams
+// have queued blocks, a stream alone is absorbed on the scalar kernel.
+class SHA3_cpu_multistream {
+public:
+  using StreamId = size_t;
+  using Digest = std::vector<uint8_t>;
+
+  // queueBlocks is the number of full blocks a stream may hold before they are permuted.
+  SHA3_cpu_multistream(size_t block, size_t queueBlocks = 8);
+
+  // Start a new stream, ids of finished streams are reused.
+  StreamId open();
+  void add(StreamId id, const uint8_t *data, size_t sz);
+  // Digest of the stream, the stream is closed.
+  Digest finish(StreamId id);
+
+  // Absorb all queued full blocks of all streams.
+  void flush();
+
+  size_t openStreams() const { return m_streams.size() - m_free.size(); }
+
+private:
+  struct Stream
+  {
+    uint64_t A[25];
+    std::vector<uint8_t> queue;
+    size_t absorbed = 0; // Bytes of the queue already absorbed.
+    size_t filled = 0;   // Bytes in the queue.
+    bool ready = false;  // Listed in m_ready.
+    bool open = false;
+  };
+
+  size_t pendingBlocks(const Stream &s) const { return (s.filled - s.absorbed) / m_bufferSize; }
+
+  // Absorb all queued blocks of id. Lanes that run out of blocks are refilled with other ready streams
+  // until none is left.
+  void absorbQueued(StreamId id);
+  // Next stream of m_ready with queued blocks other than id, null if there is none.
+  Stream *takeReady(StreamId id);
+  void markReady(StreamId id);
+
+private:
+  size_t m_digestSize;
+  size_t m_bufferSize;
+  size_t m_queueBlocks;
+  size_t m_width; // Streams permuted at once.
+  std::vector<Stream> m_streams;
+  std::vector<StreamId> m_free;
+  std::vector<StreamId> m_ready; // Streams that may have full blocks queued.
+  std::vector<uint64_t> m_lanes; // Interleaved states for the multi-lane kernel.
+};
@@ -0,0 +1,211 @@
+#include "sha3d_client.h"
+#include "sha3d_protocol.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace sha3d;
+
+SharedBuffer::~SharedBuffer() { release(); }
+
+bool SharedBuffer::create(size_t size)
+{
+  release();
+  m_fd = memfd_create("sha3d", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (m_fd < 0 || ftruncate(m_fd, size) != 0 || fcntl(m_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) != 0)
+  {
+    release();
+    return false;
+  }
+  if (size != 0)
+  {
+    void *data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+    if (data == MAP_FAILED)
+    {
+      release();
+      return false;
+    }
+    m_data = static_cast<uint8_t *>(data);
+  }
+  m_size = size;
+  return true;
+}
+
+bool SharedBuffer::seal()
+{
+  if (m_fd < 0)
+  {
+    return false;
+  }
+  // The write seal can't be added while a writable shared mapping exists.
+  if (m_data != nullptr)
+  {
+    munmap(m_data, m_size);
+    m_data = nullptr;
+  }
+  if (fcntl(m_fd, F_ADD_SEALS, F_SEAL_WRITE) != 0)
+  {
+    release();
+    return false;
+  }
+  if (m_size != 0)
+  {
+    void *data = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, m_fd, 0);
+    if (data == MAP_FAILED)
+    {
+      release();
+      return false;
+    }
+    m_data = static_cast<uint8_t *>(data);
+  }
+  return true;
+}
+
+void SharedBuffer::release()
+{
+  if (m_data != nullptr)
+  {
+    munmap(m_data, m_size);
+  }
+  if (m_fd >= 0)
+  {
+    close(m_fd);
+  }
+  m_fd = -1;
+  m_data = nullptr;
+  m_size = 0;
+}
+
+Sha3dClient::~Sha3dClient()
+{
+  if (m_socket >= 0)
+  {
+    close(m_socket);
+  }
+}
+
+bool Sha3dClient::connect(const std::string &socketPath)
+{
+  sockaddr_un address;
+  std::memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (socketPath.empty() || socketPath.size() >= sizeof(address.sun_path))
+  {
+    m_error = "Invalid socket path " + socketPath;
+    return false;
+  }
+  std::copy(socketPath.begin(), socketPath.end(), address.sun_path);
+
+  if (m_socket >= 0)
+  {
+    close(m_socket);
+  }
+  m_socket = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (m_socket < 0 || ::connect(m_socket, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0)
+  {
+    m_error = "Can't connect to " + socketPath + ": " + std::strerror(errno);
+    if (m_socket >= 0)
+    {
+      close(m_socket);
+      m_socket = -1;
+    }
+    return false;
+  }
+  return true;
+}
+
+std::optional<Sha3dClient::Digest> Sha3dClient::hashFile(const std::string &path, size_t digestBits)
+{
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+  {
+    m_error = "Can't open " + path + ": " + std::strerror(errno);
+    return {};
+  }
+  auto result = call(fd, 0, toEnd, digestBits);
+  close(fd);
+  return result;
+}
+
+std::optional<Sha3dClient::Digest> Sha3dClient::hashFd(int fd, uint64_t offset, uint64_t size, size_t digestBits)
+{
+  return call(fd, offset, size, digestBits);
+}
+
+std::optional<Sha3dClient::Digest> Sha3dClient::hashBuffer(const SharedBuffer &buffer, size_t size,
+                                                           size_t digestBits)
+{
+  return hashFd(buffer.fd(), 0, std::min(size, buffer.size()), digestBits);
+}
+
+std::optional<Sha3dClient::Digest> Sha3dClient::call(int fd, uint64_t offset, uint64_t size, size_t digestBits)
+{
+  if (m_socket < 0)
+  {
+    m_error = "Not connected";
+    return {};
+  }
+
+  RequestHeader header;
+  header.source = uint16_t(Source::Fd);
+  header.digestBits = static_cast<uint32_t>(digestBits);
+  header.id = m_nextId++;
+  header.offset = offset;
+  header.size = size;
+
+  iovec iov{&header, sizeof(header)};
+  msghdr message{};
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+  cmsghdr *c = CMSG_FIRSTHDR(&message);
+  c->cmsg_level = SOL_SOCKET;
+  c->cmsg_type = SCM_RIGHTS;
+  c->cmsg_len = CMSG_LEN(sizeof(int));
+  std::memcpy(CMSG_DATA(c), &fd, sizeof(int));
+  if (sendmsg(m_socket, &message, MSG_NOSIGNAL) < 0)
+  {
+    m_error = std::string("Can't send request: ") + std::strerror(errno);
+    return {};
+  }
+
+  uint8_t response[maxResponse];
+  ResponseHeader result;
+  while (true)
+  {
+    ssize_t received = recv(m_socket, response, sizeof(response), 0);
+    if (received < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (received < ssize_t(sizeof(result)))
+    {
+      m_error = received < 0 ? std::string("Can't receive response: ") + std::strerror(errno) : "Daemon disconnected";
+      return {};
+    }
+    std::memcpy(&result, response, sizeof(result));
+    if (result.magic != responseMagic || result.digestSize > received - sizeof(result))
+    {
+      m_error = "Invalid response";
+      return {};
+    }
+    // Responses of abandoned requests are skipped.
+    if (result.id == header.id)
+    {
+      break;
+    }
+  }
+  if (result.status != 0)
+  {
+    m_error = std::strerror(result.status);
+    return {};
+  }
+  return Digest(response + sizeof(result), response + sizeof(result) + result.digestSize);
+}
@@ -0,0 +1,66 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+// Shared memory buffer backed by a memfd: filled by the caller in place and passed to the daemon by descriptor,
+// so the data is never copied through the socket. Its size is sealed at creation. Once sealed against writes
+// the daemon maps it, before that the daemon copies the hashed range.
+class SharedBuffer {
+public:
+  SharedBuffer() = default;
+  SharedBuffer(const SharedBuffer &) = delete;
+  SharedBuffer &operator=(const SharedBuffer &) = delete;
+  ~SharedBuffer();
+
+  // Returns false if the buffer can't be created.
+  bool create(size_t size);
+
+  // Makes the buffer read-only for everyone, data() mustn't be written afterwards.
+  // Returns false and releases the buffer if it can't be sealed.
+  bool seal();
+
+  uint8_t *data() { return m_data; }
+  size_t size() const { return m_size; }
+  int fd() const { return m_fd; }
+
+private:
+  void release();
+
+private:
+  int m_fd = -1;
+  uint8_t *m_data = nullptr;
+  size_t m_size = 0;
+};
+
+// Blocking client of the sha3d daemon, one request in flight per client.
+// Calls return no digest on failure, error describes it.
+class Sha3dClient {
+public:
+  using Digest = std::vector<uint8_t>;
+
+  Sha3dClient() = default;
+  Sha3dClient(const Sha3dClient &) = delete;
+  Sha3dClient &operator=(const Sha3dClient &) = delete;
+  ~Sha3dClient();
+
+  bool connect(const std::string &socketPath);
+
+  // Opens the file here and passes the descriptor, the daemon never opens paths.
+  std::optional<Digest> hashFile(const std::string &path, size_t digestBits);
+  // Hashes size bytes from offset of an open regular file or memfd, the rest of it if size is sha3d::toEnd.
+  std::optional<Digest> hashFd(int fd, uint64_t offset, uint64_t size, size_t digestBits);
+  std::optional<Digest> hashBuffer(const SharedBuffer &buffer, size_t size, size_t digestBits);
+
+  const std::string &error() const { return m_error; }
+
+private:
+  std::optional<Digest> call(int fd, uint64_t offset, uint64_t size, size_t digestBits);
+
+private:
+  int m_socket = -1;
+  uint64_t m_nextId = 0;
+  std::string m_error;
+};
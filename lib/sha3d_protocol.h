@@ -0,0 +1,51 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// Wire protocol of the sha3d daemon. Clients talk over a SOCK_SEQPACKET Unix domain socket, one request
+// or response per packet, in native byte order since both sides live on the same host.
+//   request:  RequestHeader, the descriptor of a regular file or memfd comes as SCM_RIGHTS ancillary data.
+//             The daemon never opens paths, clients open inputs with their own credentials.
+//   response: ResponseHeader, then digestSize bytes of the digest if status is zero.
+// Requests of one connection may be pipelined, responses are matched by id.
+namespace sha3d
+{
+
+constexpr uint32_t requestMagic = 0x51443353;  // "S3DQ"
+constexpr uint32_t responseMagic = 0x52443353; // "S3DR"
+constexpr uint16_t version = 2;
+
+// Hashes the whole rest of the input.
+constexpr uint64_t toEnd = ~uint64_t(0);
+
+enum class Source : uint16_t
+{
+  Fd = 2
+};
+
+struct RequestHeader
+{
+  uint32_t magic = requestMagic;
+  uint16_t version = sha3d::version;
+  uint16_t source = 0;
+  uint32_t digestBits = 0;
+  uint32_t reserved = 0;
+  uint64_t id = 0;
+  // Hashed range of the input.
+  uint64_t offset = 0;
+  uint64_t size = toEnd;
+};
+
+struct ResponseHeader
+{
+  uint32_t magic = responseMagic;
+  int32_t status = 0; // Zero or errno value.
+  uint64_t id = 0;
+  uint32_t digestSize = 0;
+  uint32_t reserved = 0;
+};
+
+constexpr size_t maxRequest = sizeof(RequestHeader);
+constexpr size_t maxResponse = sizeof(ResponseHeader) + 64;
+
+} // namespace sha3d
@@ -0,0 +1,417 @@
+#include "sha3d_server.h"
+#include "sha3d_protocol.h"
+#include "util.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace sha3d;
+
+namespace
+{
+
+bool validBits(size_t bits) { return bits == 224 || bits == 256 || bits == 384 || bits == 512; }
+
+HashAlgorithm algorithm(size_t bits)
+{
+  switch (bits)
+  {
+  case 224:
+    return HashAlgorithm::SHA3_224;
+  case 256:
+    return HashAlgorithm::SHA3_256;
+  case 384:
+    return HashAlgorithm::SHA3_384;
+  default:
+    return HashAlgorithm::SHA3_512;
+  }
+}
+
+bool makeAddress(const std::string &path, sockaddr_un &address)
+{
+  std::memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (path.empty() || path.size() >= sizeof(address.sun_path))
+  {
+    return false;
+  }
+  std::copy(path.begin(), path.end(), address.sun_path);
+  return true;
+}
+
+// Only a memfd that can neither shrink nor change is mapped: a mapped file truncated by the client
+// would kill the daemon with SIGBUS on the next read.
+bool sealed(int fd)
+{
+  const int required = F_SEAL_SHRINK | F_SEAL_WRITE;
+  int seals = fcntl(fd, F_GET_SEALS);
+  return seals >= 0 && (seals & required) == required;
+}
+
+// Reads size bytes from offset into daemon memory, size is reduced if the file ends earlier.
+// Returns null and sets errno on failure.
+std::shared_ptr<const void> readRange(int fd, uint64_t offset, size_t &size)
+{
+  if (size == 0)
+  {
+    return std::make_shared<char>();
+  }
+  const size_t capacity = size;
+  void *data = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (data == MAP_FAILED)
+  {
+    return {};
+  }
+  std::shared_ptr<const void> result(data, [capacity](void *ptr) { munmap(ptr, capacity); });
+  size_t done = 0;
+  while (done < size)
+  {
+    ssize_t n = pread(fd, static_cast<uint8_t *>(data) + done, size - done, offset + done);
+    if (n < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (n < 0)
+    {
+      return {};
+    }
+    if (n == 0)
+    {
+      break;
+    }
+    done += n;
+  }
+  size = done;
+  return result;
+}
+
+} // namespace
+
+Sha3dServer::Sha3dServer(const Options &options)
+  : m_options(options)
+  , m_sha(options.threads)
+{
+  m_options.maxBatch = std::max<size_t>(m_options.maxBatch, 1);
+  m_wake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+}
+
+Sha3dServer::~Sha3dServer()
+{
+  for (int client : m_clients)
+  {
+    close(client);
+  }
+  if (m_listen >= 0)
+  {
+    close(m_listen);
+    unlink(m_path.c_str());
+  }
+  if (m_wake >= 0)
+  {
+    close(m_wake);
+  }
+}
+
+bool Sha3dServer::listen(const std::string &path)
+{
+  sockaddr_un address;
+  if (!makeAddress(path, address))
+  {
+    m_error = "Invalid socket path " + path;
+    return false;
+  }
+
+  // A socket file nobody accepts on is left by a daemon that didn't exit cleanly.
+  struct stat st;
+  if (lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+  {
+    int probe = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    bool alive = probe >= 0 && connect(probe, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == 0;
+    if (probe >= 0)
+    {
+      close(probe);
+    }
+    if (alive)
+    {
+      m_error = "Another daemon is listening on " + path;
+      return false;
+    }
+    unlink(path.c_str());
+  }
+
+  m_listen = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (m_listen < 0 || bind(m_listen, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0)
+  {
+    m_error = "Can't bind " + path + ": " + std::strerror(errno);
+    if (m_listen >= 0)
+    {
+      close(m_listen);
+      m_listen = -1;
+    }
+    return false;
+  }
+  m_path = path;
+  // Nobody can connect before listen, so the mode is set without a window of default permissions.
+  if (chmod(path.c_str(), m_options.socketMode) != 0)
+  {
+    m_error = "Can't set mode of " + path + ": " + std::strerror(errno);
+    return false;
+  }
+  if (::listen(m_listen, SOMAXCONN) != 0)
+  {
+    m_error = "Can't listen on " + path + ": " + std::strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+void Sha3dServer::run()
+{
+  std::vector<pollfd> fds;
+  while (!m_stopped.load())
+  {
+    fds.clear();
+    fds.push_back({m_wake, POLLIN, 0});
+    fds.push_back({m_listen, POLLIN, 0});
+    for (int client : m_clients)
+    {
+      fds.push_back({client, POLLIN, 0});
+    }
+
+    timespec timeout{};
+    timespec *wait = nullptr;
+    if (!m_pending.empty())
+    {
+      auto left = m_batchStart + m_options.window - std::chrono::steady_clock::now();
+      auto ns = std::max<int64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(left).count(), 0);
+      timeout.tv_sec = ns / 1000000000;
+      timeout.tv_nsec = ns % 1000000000;
+      wait = &timeout;
+    }
+    if (ppoll(fds.data(), fds.size(), wait, nullptr) < 0 && errno != EINTR)
+    {
+      m_error = std::string("poll failed: ") + std::strerror(errno);
+      return;
+    }
+
+    if (fds[0].revents != 0)
+    {
+      uint64_t value;
+      ssize_t ignored = read(m_wake, &value, sizeof(value));
+      (void)ignored;
+    }
+    if (fds[1].revents != 0)
+    {
+      acceptClients();
+    }
+    // Reading starts at another client every time, so one flooding client can't fill every batch.
+    const size_t clients = fds.size() - 2;
+    for (size_t k = 0; k < clients; ++k)
+    {
+      const pollfd &fd = fds[2 + (m_firstClient + k) % clients];
+      if (fd.revents != 0 && !readRequests(fd.fd))
+      {
+        dropClient(fd.fd);
+      }
+    }
+    ++m_firstClient;
+
+    if (!m_pending.empty() && (m_pending.size() >= m_options.maxBatch || m_copied >= m_options.maxCopy ||
+                               std::chrono::steady_clock::now() >= m_batchStart + m_options.window))
+    {
+      processBatch();
+    }
+  }
+}
+
+void Sha3dServer::stop()
+{
+  m_stopped = true;
+  uint64_t one = 1;
+  ssize_t ignored = write(m_wake, &one, sizeof(one));
+  (void)ignored;
+}
+
+void Sha3dServer::acceptClients()
+{
+  while (true)
+  {
+    int client = accept4(m_listen, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (client < 0)
+    {
+      return;
+    }
+    m_clients.push_back(client);
+  }
+}
+
+bool Sha3dServer::readRequests(int client)
+{
+  uint8_t packet[maxRequest];
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+  // A full batch stops reading, the rest of the requests stay queued in the socket until the next poll.
+  while (m_pending.size() < m_options.maxBatch && m_copied < m_options.maxCopy)
+  {
+    iovec iov{packet, sizeof(packet)};
+    msghdr message{};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    ssize_t size = recvmsg(client, &message, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+    if (size < 0)
+    {
+      return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+    if (size == 0)
+    {
+      return false;
+    }
+
+    int fd = -1;
+    for (cmsghdr *c = CMSG_FIRSTHDR(&message); c != nullptr; c = CMSG_NXTHDR(&message, c))
+    {
+      if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS && c->cmsg_len == CMSG_LEN(sizeof(int)))
+      {
+        std::memcpy(&fd, CMSG_DATA(c), sizeof(int));
+      }
+    }
+    bool truncated = (message.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) != 0;
+    readRequest(client, packet, truncated ? 0 : size, fd);
+    if (fd >= 0)
+    {
+      close(fd);
+    }
+  }
+  return true;
+}
+
+void Sha3dServer::readRequest(int client, const uint8_t *packet, size_t size, int fd)
+{
+  RequestHeader header;
+  if (size < sizeof(header))
+  {
+    respond(client, 0, EINVAL);
+    return;
+  }
+  std::memcpy(&header, packet, sizeof(header));
+  if (header.magic != requestMagic || header.version != version || !validBits(header.digestBits))
+  {
+    respond(client, header.id, EINVAL);
+    return;
+  }
+
+  if (header.source != uint16_t(Source::Fd) || fd < 0 || size != sizeof(header))
+  {
+    respond(client, header.id, EINVAL);
+    return;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+  {
+    respond(client, header.id, EBADF);
+    return;
+  }
+  const uint64_t inputSize = st.st_size;
+  if (header.offset > inputSize)
+  {
+    respond(client, header.id, EINVAL);
+    return;
+  }
+  size_t hashed = static_cast<size_t>(std::min<uint64_t>(header.size, inputSize - header.offset));
+
+  std::shared_ptr<const void> input;
+  const uint8_t *data = nullptr;
+  size_t copied = 0;
+  if (sealed(fd))
+  {
+    size_t mapped = 0;
+    input = mapFd(fd, mapped);
+    if (!input)
+    {
+      respond(client, header.id, EBADF);
+      return;
+    }
+    data = static_cast<const uint8_t *>(input.get()) + header.offset;
+  }
+  else
+  {
+    if (hashed > m_options.maxCopy)
+    {
+      respond(client, header.id, EFBIG);
+      return;
+    }
+    errno = 0;
+    input = readRange(fd, header.offset, hashed);
+    if (!input)
+    {
+      respond(client, header.id, errno != 0 ? errno : EIO);
+      return;
+    }
+    data = static_cast<const uint8_t *>(input.get());
+    copied = hashed;
+  }
+
+  if (m_pending.empty())
+  {
+    m_batchStart = std::chrono::steady_clock::now();
+  }
+  m_copied += copied;
+  m_pending.push_back({client, header.id, header.digestBits, std::move(input), data, hashed, copied});
+}
+
+void Sha3dServer::processBatch()
+{
+  std::vector<MixedMessage> messages;
+  messages.reserve(m_pending.size());
+  for (auto &request : m_pending)
+  {
+    messages.push_back({algorithm(request.digestBits), request.data, request.size});
+  }
+  auto digests = m_sha.calculate(messages);
+  for (size_t i = 0; i < m_pending.size(); ++i)
+  {
+    respond(m_pending[i].client, m_pending[i].id, 0, digests[i].data(), digests[i].size());
+  }
+  m_requests += m_pending.size();
+  ++m_batches;
+  m_pending.clear();
+  m_copied = 0;
+}
+
+void Sha3dServer::respond(int client, uint64_t id, int status, const uint8_t *digest, size_t digestSize)
+{
+  uint8_t packet[maxResponse];
+  ResponseHeader header;
+  header.status = status;
+  header.id = id;
+  header.digestSize = static_cast<uint32_t>(digestSize);
+  std::memcpy(packet, &header, sizeof(header));
+  std::copy(digest, digest + digestSize, packet + sizeof(header));
+  // A client that stopped reading loses the response, it can't stall the others.
+  ssize_t ignored = send(client, packet, sizeof(header) + digestSize, MSG_DONTWAIT | MSG_NOSIGNAL);
+  (void)ignored;
+}
+
+void Sha3dServer::dropClient(int client)
+{
+  // Descriptor numbers are reused by later connections, so pending requests must go with the client.
+  m_pending.erase(std::remove_if(m_pending.begin(), m_pending.end(),
+                                 [client](const Request &request) { return request.client == client; }),
+                  m_pending.end());
+  m_copied = 0;
+  for (auto &request : m_pending)
+  {
+    m_copied += request.copied;
+  }
+  m_clients.erase(std::remove(m_clients.begin(), m_clients.end(), client), m_clients.end());
+  close(client);
+}
@@ -0,0 +1,82 @@
+#pragma once
+#include "sha3_mixed_batch.h"
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+// sha3d daemon core: a single event loop reads requests from all connected clients and hashes every request
+// pending at once in one mixed batch launch, so concurrent small requests of any digest size share the lanes.
+class Sha3dServer {
+public:
+  struct Options
+  {
+    unsigned threads = 0; // Zero means one thread per available processor.
+    size_t maxBatch = 256;
+    // Time to wait for more requests once the first one of a batch arrived, zero hashes whatever is ready.
+    std::chrono::microseconds window{0};
+    // Bytes of inputs copied into the daemon per batch. Descriptors other than sealed memfds are copied,
+    // a larger request is refused with EFBIG.
+    size_t maxCopy = size_t(1) << 30;
+    // Permissions of the socket file, only the daemon's user can connect by default.
+    mode_t socketMode = 0600;
+  };
+
+  explicit Sha3dServer(const Options &options);
+  Sha3dServer(const Sha3dServer &) = delete;
+  Sha3dServer &operator=(const Sha3dServer &) = delete;
+  ~Sha3dServer();
+
+  // Binds the socket, a stale socket file is replaced. Returns false and sets error on failure.
+  bool listen(const std::string &path);
+
+  // Serves clients until stop is called.
+  void run();
+
+  // Can be called from any thread or a signal handler.
+  void stop();
+
+  const std::string &error() const { return m_error; }
+
+  // Requests served and batches launched so far.
+  uint64_t requests() const { return m_requests; }
+  uint64_t batches() const { return m_batches; }
+
+private:
+  struct Request
+  {
+    int client;
+    uint64_t id;
+    size_t digestBits;
+    std::shared_ptr<const void> input; // Mapping of a sealed memfd or a copy.
+    const uint8_t *data;
+    size_t size;
+    size_t copied;
+  };
+
+  void acceptClients();
+  // Returns false if the client disconnected.
+  bool readRequests(int client);
+  void readRequest(int client, const uint8_t *packet, size_t size, int fd);
+  void processBatch();
+  void respond(int client, uint64_t id, int status, const uint8_t *digest = nullptr, size_t digestSize = 0);
+  void dropClient(int client);
+
+private:
+  Options m_options;
+  std::string m_path;
+  std::string m_error;
+  int m_listen = -1;
+  int m_wake = -1; // eventfd signalled by stop.
+  std::atomic<bool> m_stopped{false};
+  std::vector<int> m_clients;
+  size_t m_firstClient = 0;
+  std::vector<Request> m_pending;
+  size_t m_copied = 0; // Bytes copied by pending requests.
+  std::chrono::steady_clock::time_point m_batchStart;
+  SHA3_cpu_mixed_batch m_sha;
+  uint64_t m_requests = 0;
+  uint64_t m_batches = 0;
+};
@@ -0,0 +1,184 @@
+#include "stream_reader.h"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+
+bool isPipe(int fd)
+{
+  struct stat st;
+  return fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+} // namespace
+
+StreamReader::StreamReader(int fd, int teeFd, size_t chunkSize, size_t chunks)
+  : m_fd(fd)
+  , m_teeFd(teeFd)
+  , m_chunkSize(chunkSize)
+  , m_chunks(chunks)
+  , m_sizes(chunks)
+{
+  if (isPipe(fd))
+  {
+    // Fewer wakeups per chunk, the size is capped by /proc/sys/fs/pipe-max-size.
+    fcntl(fd, F_SETPIPE_SZ, static_cast<int>(chunkSize));
+    m_splice = teeFd >= 0 && isPipe(teeFd);
+  }
+  void *ring = mmap(nullptr, chunkSize * chunks, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ring == MAP_FAILED)
+  {
+    m_error = std::string("Can't allocate stream buffer: ") + std::strerror(errno);
+    m_done = true;
+    return;
+  }
+  m_ring = static_cast<uint8_t *>(ring);
+  m_thread = std::thread(&StreamReader::readLoop, this);
+}
+
+StreamReader::~StreamReader()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stopped = true;
+  }
+  m_cv.notify_all();
+  if (m_thread.joinable())
+  {
+    m_thread.join();
+  }
+  if (m_ring != nullptr)
+  {
+    munmap(m_ring, m_chunkSize * m_chunks);
+  }
+}
+
+StreamReader::Chunk StreamReader::next()
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+  if (m_holding)
+  {
+    ++m_released;
+    m_holding = false;
+    m_cv.notify_all();
+  }
+  m_cv.wait(lock, [this]() { return m_filled > m_released || m_done; });
+  if (m_filled == m_released)
+  {
+    return {nullptr, 0};
+  }
+  m_holding = true;
+  size_t slot = m_released % m_chunks;
+  return {m_ring + slot * m_chunkSize, m_sizes[slot]};
+}
+
+void StreamReader::readLoop()
+{
+  for (size_t i = 0;; ++i)
+  {
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_cv.wait(lock, [&]() { return i < m_released + m_chunks || m_stopped; });
+      if (m_stopped)
+      {
+        return;
+      }
+    }
+    size_t slot = i % m_chunks;
+    size_t size = fill(m_ring + slot * m_chunkSize);
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_sizes[slot] = size;
+      m_filled += size == 0 ? 0 : 1;
+      m_done = size < m_chunkSize;
+    }
+    m_cv.notify_all();
+    if (size < m_chunkSize)
+    {
+      return;
+    }
+  }
+}
+
+size_t StreamReader::fill(uint8_t *chunk)
+{
+  size_t used = 0;
+  size_t forwarded = 0; // Bytes of the chunk duplicated into the tee pipe.
+  while (used < m_chunkSize)
+  {
+    if (m_splice && forwarded == used)
+    {
+      // Duplicates the pipe content into the tee pipe, then exactly the duplicated bytes are read.
+      ssize_t duplicated = tee(m_fd, m_teeFd, m_chunkSize - used, 0);
+      if (duplicated < 0 && errno == EINTR)
+      {
+        continue;
+      }
+      if (duplicated < 0 && errno == EINVAL)
+      {
+        m_splice = false;
+        continue;
+      }
+      if (duplicated < 0)
+      {
+        fail("Can't forward the stream");
+        return 0;
+      }
+      if (duplicated == 0)
+      {
+        break;
+      }
+      forwarded += duplicated;
+    }
+
+    size_t want = m_splice ? forwarded - used : m_chunkSize - used;
+    ssize_t n = read(m_fd, chunk + used, want);
+    if (n < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (n < 0)
+    {
+      fail("Can't read the stream");
+      return 0;
+    }
+    if (n == 0)
+    {
+      break;
+    }
+    used += n;
+  }
+
+  if (used > forwarded && !forward(chunk + forwarded, used - forwarded))
+  {
+    fail("Can't forward the stream");
+    return 0;
+  }
+  return used;
+}
+
+bool StreamReader::forward(const uint8_t *data, size_t size)
+{
+  while (m_teeFd >= 0 && size != 0)
+  {
+    ssize_t n = write(m_teeFd, data, size);
+    if (n < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (n <= 0)
+    {
+      return false;
+    }
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+void StreamReader::fail(const std::string &what) { m_error = what + ": " + std::strerror(errno); }
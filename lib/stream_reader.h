@@ -0,0 +1,56 @@
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Reads a stream (pipe, socket or file) on a background thread into a ring of page-aligned chunks,
+// so reading overlaps hashing and the buffers are reused. Chunks are filled completely except the last one.
+// The stream can be forwarded unchanged to a tee descriptor: between two pipes by tee(2) without copying
+// the data through user space, otherwise by writing the chunks.
+class StreamReader {
+public:
+  using Chunk = std::pair<const uint8_t *, size_t>;
+
+  explicit StreamReader(int fd, int teeFd = -1, size_t chunkSize = size_t(1) << 20, size_t chunks = 4);
+  StreamReader(const StreamReader &) = delete;
+  StreamReader &operator=(const StreamReader &) = delete;
+  // Waits for the current read of the background thread to finish.
+  ~StreamReader();
+
+  // Returns the next chunk, valid until the next call. An empty chunk means the end of the stream or an error.
+  Chunk next();
+
+  // Not empty if reading or forwarding failed. Valid once next returned an empty chunk.
+  const std::string &error() const { return m_error; }
+
+private:
+  void readLoop();
+  // Fills the chunk and forwards it. Returns the bytes read, zero at the end of the stream or on error.
+  size_t fill(uint8_t *chunk);
+  bool forward(const uint8_t *data, size_t size);
+  void fail(const std::string &what);
+
+private:
+  int m_fd;
+  int m_teeFd;
+  bool m_splice = false; // Both descriptors are pipes and tee(2) works on them.
+  size_t m_chunkSize;
+  size_t m_chunks;
+  uint8_t *m_ring = nullptr;
+  std::vector<size_t> m_sizes;
+
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
+  size_t m_filled = 0;   // Chunks read so far.
+  size_t m_released = 0; // Chunks the consumer is done with.
+  bool m_holding = false;
+  bool m_done = false;
+  bool m_stopped = false;
+  std::string m_error;
+  std::thread m_thread;
+};
@@ -0,0 +1,138 @@
+#include "telemetry.h"
+#include <algorithm>
+
+namespace telemetry
+{
+
+#ifdef SHA3_TELEMETRY
+
+namespace detail
+{
+
+std::atomic<bool> g_enabled{true};
+
+namespace
+{
+
+// Lock-free list of all counters ever created. Nodes are never deleted, so readers can walk it at any time.
+std::atomic<ThreadCounters *> g_head{nullptr};
+
+template<size_t N>
+void accumulate(std::array<uint64_t, N> &to, const std::array<std::atomic<uint64_t>, N> &from)
+{
+  for (size_t i = 0; i < N; ++i)
+  {
+    to[i] += from[i].load(std::memory_order_relaxed);
+  }
+}
+
+} // namespace
+
+ThreadCounters &acquire()
+{
+  // Reuse counters of a finished thread.
+  for (ThreadCounters *it = g_head.load(std::memory_order_acquire); it != nullptr; it = it->next)
+  {
+    bool expected = false;
+    if (it->inUse.compare_exchange_strong(expected, true, std::memory_order_acquire))
+    {
+      return *it;
+    }
+  }
+
+  auto *counters = new ThreadCounters;
+  counters->next = g_head.load(std::memory_order_relaxed);
+  while (!g_head.compare_exchange_weak(counters->next, counters, std::memory_order_release))
+  {
+  }
+  return *counters;
+}
+
+Holder::~Holder()
+{
+  if (counters != nullptr)
+  {
+    counters->inUse.store(false, std::memory_order_release);
+  }
+}
+
+} // namespace detail
+
+void setEnabled(bool enabled) { detail::g_enabled.store(enabled, std::memory_order_relaxed); }
+
+bool enabled() { return detail::g_enabled.load(std::memory_order_relaxed); }
+
+Snapshot snapshot()
+{
+  Snapshot result;
+  for (auto *it = detail::g_head.load(std::memory_order_acquire); it != nullptr; it = it->next)
+  {
+    detail::accumulate(result.counters, it->counters);
+    detail::accumulate(result.kernelCalls, it->kernelCalls);
+    detail::accumulate(result.batchSizes, it->batchSizes);
+  }
+  return result;
+}
+
+void batchCall(size_t messages, const double *busy, size_t threads, double seconds)
+{
+  if (!enabled())
+  {
+    return;
+  }
+
+  double imbalance = 0;
+  if (threads != 0)
+  {
+    double sum = 0;
+    double max = 0;
+    for (size_t i = 0; i < threads; ++i)
+    {
+      sum += busy[i];
+      max = std::max(max, busy[i]);
+    }
+    imbalance = max - sum / threads;
+  }
+
+  size_t bucket = 0;
+  while (bucket + 1 < batchBuckets && (size_t(2) << bucket) <= messages)
+  {
+    ++bucket;
+  }
+
+  auto &local = detail::local();
+  detail::bump(local.counters[size_t(Counter::BatchCalls)], 1);
+  detail::bump(local.counters[size_t(Counter::BatchMessages)], messages);
+  detail::bump(local.counters[size_t(Counter::TailImbalanceNs)], static_cast<uint64_t>(imbalance * 1e9));
+  detail::bump(local.counters[size_t(Counter::CalculateNs)], static_cast<uint64_t>(seconds * 1e9));
+  detail::bump(local.batchSizes[bucket], 1);
+}
+
+#else
+
+void setEnabled(bool) {}
+
+bool enabled() { return false; }
+
+Snapshot snapshot() { return {}; }
+
+#endif // SHA3_TELEMETRY
+
+Snapshot &Snapshot::operator-=(const Snapshot &other)
+{
+  for (size_t i = 0; i < counters.size(); ++i)
+  {
+    counters[i] -= other.counters[i];
+  }
+  for (size_t i = 0; i < kernelCalls.size(); ++i)
+  {
+    kernelCalls[i] -= other.kernelCalls[i];
+  }
+  for (size_t i = 0; i < batchSizes.size(); ++i)
+  {
+    batchSizes[i] -= other.batchSizes[i];
+  }
+  return *this;
+}
+
+} // namespace telemetry
@@ -0,0 +1,142 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Opt-in library counters, built when SHA3_TELEMETRY is defined (cmake option SHA3_TELEMETRY).
+// Every thread increments its own counters without synchronization, snapshot aggregates all threads
+// without locks. Without SHA3_TELEMETRY the hooks expand to nothing and snapshots are zero.
+namespace telemetry
+{
+
+enum class Kernel
+{
+  Cpu,            // SHA3_cpu digests.
+  CpuBatch,       // SHA3_cpu_batch calculate calls.
+  CpuMultistream, // SHA3_cpu_multistream finished streams.
+  Gpu,            // SHA3_gpu kernel launches.
+  GpuBatch,       // SHA3_gpu_batch kernel launches.
+  Count
+};
+
+enum class Counter
+{
+  BytesAbsorbed,
+  Permutations,
+  BatchCalls,
+  BatchMessages,
+  TailImbalanceNs, // Sum over batch calls of the slowest worker's lag behind the mean worker.
+  CalculateNs,     // Wall time spent in batch calculate calls.
+  Count
+};
+
+// Batch sizes histogram: bucket i holds calls with [2^i, 2^(i+1)) messages, the last one is open.
+constexpr size_t batchBuckets = 16;
+
+struct Snapshot
+{
+  std::array<uint64_t, size_t(Counter::Count)> counters = {};
+  std::array<uint64_t, size_t(Kernel::Count)> kernelCalls = {};
+  std::array<uint64_t, batchBuckets> batchSizes = {};
+
+  uint64_t get(Counter c) const { return counters[size_t(c)]; }
+  uint64_t get(Kernel k) const { return kernelCalls[size_t(k)]; }
+
+  Snapshot &operator-=(const Snapshot &other);
+};
+
+inline Snapshot operator-(Snapshot lhs, const Snapshot &rhs) { return lhs -= rhs; }
+
+// True if the library is built with telemetry.
+constexpr bool compiledIn()
+{
+#ifdef SHA3_TELEMETRY
+  return true;
+#else
+  return false;
+#endif
+}
+
+// Runtime switch, counting is on by default when compiled in.
+void setEnabled(bool enabled);
+bool enabled();
+
+// Sum of counters of all threads, including finished ones. Values are monotonic.
+Snapshot snapshot();
+
+#ifdef SHA3_TELEMETRY
+
+namespace detail
+{
+
+struct ThreadCounters
+{
+  std::array<std::atomic<uint64_t>, size_t(Counter::Count)> counters = {};
+  std::array<std::atomic<uint64_t>, size_t(Kernel::Count)> kernelCalls = {};
+  std::array<std::atomic<uint64_t>, batchBuckets> batchSizes = {};
+  std::atomic<bool> inUse{true};
+  ThreadCounters *next = nullptr;
+};
+
+extern std::atomic<bool> g_enabled;
+
+ThreadCounters &acquire();
+
+// Returns counters to the free list when the thread exits, values are kept.
+struct Holder
+{
+  ThreadCounters *counters = nullptr;
+  ~Holder();
+};
+
+inline ThreadCounters &local()
+{
+  thread_local Holder holder;
+  if (holder.counters == nullptr)
+  {
+    holder.counters = &acquire();
+  }
+  return *holder.counters;
+}
+
+// The only writer of a value is its owner thread, so plain load and store are enough.
+inline void bump(std::atomic<uint64_t> &value, uint64_t n)
+{
+  value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+} // namespace detail
+
+inline void add(Counter c, uint64_t n)
+{
+  if (detail::g_enabled.load(std::memory_order_relaxed))
+  {
+    detail::bump(detail::local().counters[size_t(c)], n);
+  }
+}
+
+inline void kernelCall(Kernel k)
+{
+  if (detail::g_enabled.load(std::memory_order_relaxed))
+  {
+    detail::bump(detail::local().kernelCalls[size_t(k)], 1);
+  }
+}
+
+void batchCall(size_t messages, const double *busy, size_t threads, double seconds);
+
+#define SHA3_TELEMETRY_ADD(counter, value) ::telemetry::add(::telemetry::Counter::counter, (value))
+#define SHA3_TELEMETRY_KERNEL(kernel) ::telemetry::kernelCall(::telemetry::Kernel::kernel)
+#define SHA3_TELEMETRY_BATCH(messages, busy, threads, seconds)                                                         \
+  ::telemetry::batchCall((messages), (busy), (threads), (seconds))
+
+#else
+
+#define SHA3_TELEMETRY_ADD(counter, value) ((void)(value))
+#define SHA3_TELEMETRY_KERNEL(kernel) ((void)0)
+#define SHA3_TELEMETRY_BATCH(messages, busy, threads, seconds) ((void)0)
+
+#endif // SHA3_TELEMETRY
+
+} // namespace telemetry
@@ -0,0 +1,210 @@
+#include "trace.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+namespace trace
+{
+
+namespace detail
+{
+
+std::atomic<bool> g_enabled{false};
+
+namespace
+{
+
+struct Record
+{
+  const char *name;
+  const char *argName;
+  uint64_t arg;
+  uint64_t start;
+  uint64_t duration;
+  uint32_t tid;
+};
+
+// Locked by its thread for every span and by stop, so the lock is never contended while recording.
+struct ThreadBuffer
+{
+  std::mutex mutex;
+  std::vector<Record> ring;
+  uint64_t recorded = 0; // Spans recorded since start, the ring keeps the last ones.
+  bool inUse = true;
+};
+
+struct Registry
+{
+  std::mutex mutex;
+  std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+  std::string path;
+  bool exitHandler = false;
+};
+
+// Never destroyed, so buffers outlive the threads and the exit handler.
+Registry &registry()
+{
+  static Registry *result = new Registry;
+  return *result;
+}
+
+std::atomic<int64_t> g_epoch{0};
+std::atomic<size_t> g_capacity{0};
+
+int64_t clockNs()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// Buffers of finished threads are reused, spans keep the thread id they were recorded with.
+ThreadBuffer &acquire()
+{
+  auto &r = registry();
+  std::lock_guard<std::mutex> lock(r.mutex);
+  for (auto &buffer : r.buffers)
+  {
+    if (!buffer->inUse)
+    {
+      buffer->inUse = true;
+      return *buffer;
+    }
+  }
+  r.buffers.push_back(std::make_unique<ThreadBuffer>());
+  return *r.buffers.back();
+}
+
+struct Holder
+{
+  ThreadBuffer *buffer = nullptr;
+  uint32_t tid = static_cast<uint32_t>(syscall(SYS_gettid));
+  ~Holder()
+  {
+    if (buffer != nullptr)
+    {
+      std::lock_guard<std::mutex> lock(registry().mutex);
+      buffer->inUse = false;
+    }
+  }
+};
+
+void writeTrace(std::FILE *file, const std::vector<std::unique_ptr<ThreadBuffer>> &buffers)
+{
+  uint64_t dropped = 0;
+  bool first = true;
+  int pid = getpid();
+  std::fputs("{\"traceEvents\":[\n", file);
+  for (auto &buffer : buffers)
+  {
+    std::lock_guard<std::mutex> lock(buffer->mutex);
+    dropped += buffer->recorded - buffer->ring.size();
+    for (auto &r : buffer->ring)
+    {
+      std::fprintf(file, "%s{\"name\":\"%s\",\"cat\":\"sha3\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,",
+                   first ? "" : ",\n", r.name, r.start / 1e3, r.duration / 1e3);
+      std::fprintf(file, "\"pid\":%d,\"tid\":%u", pid, r.tid);
+      if (r.argName != nullptr)
+      {
+        std::fprintf(file, ",\"args\":{\"%s\":%llu}", r.argName, static_cast<unsigned long long>(r.arg));
+      }
+      std::fputc('}', file);
+      first = false;
+    }
+  }
+  std::fprintf(file, "\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"droppedSpans\":%llu}}\n",
+               static_cast<unsigned long long>(dropped));
+}
+
+void stopAtExit()
+{
+  if (enabled() && !stop())
+  {
+    std::cerr << "Can't write trace " << registry().path << std::endl;
+  }
+}
+
+} // namespace
+
+uint64_t now() { return static_cast<uint64_t>(clockNs() - g_epoch.load(std::memory_order_relaxed)); }
+
+void record(const char *name, uint64_t start, uint64_t end, const char *argName, uint64_t arg)
+{
+  thread_local Holder holder;
+  if (!enabled())
+  {
+    return;
+  }
+  if (holder.buffer == nullptr)
+  {
+    holder.buffer = &acquire();
+  }
+  ThreadBuffer &buffer = *holder.buffer;
+  size_t capacity = g_capacity.load(std::memory_order_relaxed);
+  Record r{name, argName, arg, start, end - start, holder.tid};
+  std::lock_guard<std::mutex> lock(buffer.mutex);
+  if (buffer.ring.size() < capacity)
+  {
+    buffer.ring.push_back(r);
+  }
+  else
+  {
+    buffer.ring[buffer.recorded % capacity] = r;
+  }
+  ++buffer.recorded;
+}
+
+} // namespace detail
+
+bool start(const std::string &path, size_t spansPerThread)
+{
+  using namespace detail;
+  auto &r = registry();
+  std::lock_guard<std::mutex> lock(r.mutex);
+  if (enabled())
+  {
+    return false;
+  }
+  for (auto &buffer : r.buffers)
+  {
+    std::lock_guard<std::mutex> bufferLock(buffer->mutex);
+    buffer->ring.clear();
+    buffer->recorded = 0;
+  }
+  r.path = path;
+  g_capacity = std::max<size_t>(spansPerThread, 1);
+  g_epoch = clockNs();
+  if (!r.exitHandler)
+  {
+    std::atexit(stopAtExit);
+    r.exitHandler = true;
+  }
+  g_enabled = true;
+  return true;
+}
+
+bool stop()
+{
+  using namespace detail;
+  auto &r = registry();
+  std::lock_guard<std::mutex> lock(r.mutex);
+  if (!g_enabled.exchange(false))
+  {
+    return false;
+  }
+  std::FILE *file = std::fopen(r.path.c_str(), "w");
+  if (file == nullptr)
+  {
+    return false;
+  }
+  writeTrace(file, r.buffers);
+  return std::fclose(file) == 0;
+}
+
+} // namespace trace
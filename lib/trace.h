@@ -0,0 +1,63 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Opt-in timeline tracing in Chrome trace-event JSON, viewable in chrome://tracing or Perfetto.
+// Every thread records finished spans into its own ring buffer, a full ring overwrites its oldest spans.
+// The trace is written when tracing stops, at the latest at exit. While tracing is off a span costs
+// one relaxed atomic load.
+namespace trace
+{
+
+// Starts recording, spans go to path on stop or at exit. Returns false if tracing is already on.
+bool start(const std::string &path, size_t spansPerThread = size_t(1) << 18);
+
+// Stops recording and writes the trace. Returns false if it isn't on or the file can't be written.
+bool stop();
+
+namespace detail
+{
+
+extern std::atomic<bool> g_enabled;
+
+// Nanoseconds since tracing started.
+uint64_t now();
+
+void record(const char *name, uint64_t start, uint64_t end, const char *argName, uint64_t arg);
+
+} // namespace detail
+
+inline bool enabled() { return detail::g_enabled.load(std::memory_order_relaxed); }
+
+// Records the time from construction to destruction on the current thread.
+// Names must be string literals, they are written out when tracing stops.
+class Span {
+public:
+  explicit Span(const char *name, const char *argName = nullptr, uint64_t arg = 0)
+    : m_name(enabled() ? name : nullptr)
+    , m_argName(argName)
+    , m_arg(arg)
+    , m_start(m_name != nullptr ? detail::now() : 0)
+  {}
+  ~Span()
+  {
+    if (m_name != nullptr)
+    {
+      detail::record(m_name, m_start, detail::now(), m_argName, m_arg);
+    }
+  }
+  Span(const Span &) = delete;
+  Span &operator=(const Span &) = delete;
+
+  void setArg(uint64_t arg) { m_arg = arg; }
+
+private:
+  const char *m_name;
+  const char *m_argName;
+  uint64_t m_arg;
+  uint64_t m_start;
+};
+
+} // namespace trace
@@ -0,0 +1,227 @@
+#include "tuning.h"
+#include "batch_engine.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <unistd.h>
+#include <vector>
+
+namespace
+{
+
+// Messages of the tuning workload, sizes spread log-uniformly from 64 bytes to 16 KB.
+const size_t g_messages = 2048;
+const size_t g_repeats = 5;
+// A configuration must be this much faster to replace a cheaper one: fewer threads, smaller batch.
+const double g_threadsMargin = 1.02;
+const double g_batchShare = 0.95;
+
+struct Workload
+{
+  std::vector<uint8_t> data;
+  std::vector<keccak::Segment> messages;
+  size_t bytes = 0;
+};
+
+Workload makeWorkload()
+{
+  Workload result;
+  std::vector<size_t> sizes;
+  uint64_t x = 1;
+  for (size_t i = 0; i < g_messages; ++i)
+  {
+    x = x * 6364136223846793005ull + 1442695040888963407ull;
+    size_t size = (size_t(64) << (x >> 60) % 9) + (x >> 32) % 64;
+    sizes.push_back(size);
+    result.bytes += size;
+  }
+  result.data.resize(result.bytes);
+  for (size_t i = 0; i < result.data.size(); ++i)
+  {
+    result.data[i] = static_cast<uint8_t>(i * 131 + 7);
+  }
+  size_t offset = 0;
+  for (size_t size : sizes)
+  {
+    result.messages.push_back({result.data.data() + offset, size});
+    offset += size;
+  }
+  return result;
+}
+
+// Best of several passes over the workload, in bytes per second.
+double throughput(const Workload &workload, unsigned threads, size_t width, size_t batch)
+{
+  keccak::BatchEngine engine(threads, width);
+  const size_t rate = keccak::rate(256);
+  double best = 0;
+  for (size_t r = 0; r < g_repeats; ++r)
+  {
+    auto start = std::chrono::steady_clock::now();
+    for (size_t first = 0; first < workload.messages.size(); first += batch)
+    {
+      size_t count = std::min(batch, workload.messages.size() - first);
+      engine.run(
+          count,
+          [&](size_t i) {
+            keccak::BatchMessage m;
+            m.rate = rate;
+            m.data = workload.messages[first + i];
+            return m;
+          },
+          [](size_t, const uint64_t *) {});
+    }
+    std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+    best = std::max(best, workload.bytes / seconds.count());
+  }
+  return best;
+}
+
+void report(std::ostream *log, const std::string &configuration, double bytesPerSecond)
+{
+  if (log != nullptr)
+  {
+    *log << configuration << ": " << bytesPerSecond / 1e6 << " MB/s" << std::endl;
+  }
+}
+
+} // namespace
+
+namespace tuning
+{
+
+std::string profilePath()
+{
+  if (const char *path = std::getenv("SHA3_TUNING_PROFILE"))
+  {
+    return path;
+  }
+  char host[256] = {};
+  if (gethostname(host, sizeof(host) - 1) != 0)
+  {
+    std::copy_n("localhost", 10, host);
+  }
+  const char *home = std::getenv("HOME");
+  return std::string(home == nullptr ? "." : home) + "/.config/sha3/tuning-" + host;
+}
+
+std::optional<TuningProfile> load(const std::string &path)
+{
+  std::ifstream f(path);
+  if (!f.is_open())
+  {
+    return {};
+  }
+  TuningProfile result;
+  std::string line;
+  while (std::getline(f, line))
+  {
+    line = line.substr(0, line.find('#'));
+    std::istringstream fields(line);
+    std::string key;
+    size_t value = 0;
+    if (!(fields >> key))
+    {
+      continue;
+    }
+    if (!(fields >> value))
+    {
+      return {};
+    }
+    if (key == "threads")
+    {
+      result.threads = static_cast<unsigned>(value);
+    }
+    else if (key == "width")
+    {
+      result.width = value;
+    }
+    else if (key == "batch")
+    {
+      result.batch = value;
+    }
+  }
+  return result;
+}
+
+bool save(const std::string &path, const TuningProfile &profile)
+{
+  std::error_code ec;
+  auto directory = std::filesystem::path(path).parent_path();
+  if (!directory.empty())
+  {
+    std::filesystem::create_directories(directory, ec);
+  }
+  std::ofstream f(path);
+  f << "# sha3 tuning profile, written by sha3_batch --tune\n"
+    << "threads " << profile.threads << "\n"
+    << "width " << profile.width << "\n"
+    << "batch " << profile.batch << "\n";
+  f.close();
+  return !f.fail();
+}
+
+const TuningProfile &hostProfile()
+{
+  static const TuningProfile profile = load(profilePath()).value_or(TuningProfile());
+  return profile;
+}
+
+TuningProfile tune(std::ostream *log)
+{
+  Workload workload = makeWorkload();
+  unsigned procs = std::max(omp_get_num_procs(), 1);
+  std::vector<unsigned> threadCounts;
+  for (unsigned t = 1; t < procs; t *= 2)
+  {
+    threadCounts.push_back(t);
+  }
+  threadCounts.push_back(procs);
+
+  // Width and threads with the whole workload in one batch.
+  TuningProfile result;
+  double best = 0;
+  for (size_t width = 1; width <= keccak::lanes; ++width)
+  {
+    for (unsigned threads : threadCounts)
+    {
+      double value = throughput(workload, threads, width, g_messages);
+      report(log, "width " + std::to_string(width) + ", threads " + std::to_string(threads), value);
+      if (value > best * g_threadsMargin)
+      {
+        best = value;
+        result.threads = threads;
+        result.width = width;
+      }
+    }
+  }
+
+  // The smallest batch keeping most of the throughput, in whole rounds of all workers.
+  const size_t granule = result.threads * result.width;
+  std::vector<std::pair<size_t, double>> batches;
+  for (size_t batch = granule; batch <= g_messages; batch *= 2)
+  {
+    batches.emplace_back(batch, throughput(workload, result.threads, result.width, batch));
+    report(log, "batch " + std::to_string(batch), batches.back().second);
+  }
+  double bestBatch = 0;
+  for (auto &[batch, value] : batches)
+  {
+    bestBatch = std::max(bestBatch, value);
+  }
+  result.batch = batches.empty() ? g_messages : batches.back().first;
+  for (auto &[batch, value] : batches)
+  {
+    if (value >= bestBatch * g_batchShare)
+    {
+      result.batch = batch;
+      break;
+    }
+  }
+  return result;
+}
+
+} // namespace tuning
@@ -0,0 +1,36 @@
+#pragma once
+#include <cstddef>
+#include <optional>
+#include <ostream>
+#include <string>
+
+// Batch parameters measured on a host. Zero values are unknown and left to defaults.
+struct TuningProfile
+{
+  unsigned threads = 0; // Worker threads.
+  size_t width = 0;     // Messages a worker hashes at once on the kernel.
+  size_t batch = 0;     // Messages per calculate call, smaller batches lose throughput.
+};
+
+// Per-host profile file: "key value" lines with keys threads, width and batch, '#' starts a comment.
+// Batch classes load it once at construction, so tools use measured parameters without options.
+namespace tuning
+{
+
+// $SHA3_TUNING_PROFILE if set, otherwise ~/.config/sha3/tuning-<hostname>.
+std::string profilePath();
+
+// Returns nothing if the file is missing or malformed.
+std::optional<TuningProfile> load(const std::string &path);
+
+// Creates missing directories. Returns false on IO error.
+bool save(const std::string &path, const TuningProfile &profile);
+
+// Profile loaded from profilePath() on the first call, empty if there is none.
+const TuningProfile &hostProfile();
+
+// Microbenchmarks kernel width, thread count and then batch granularity on this machine.
+// Every measured configuration is written to log if it isn't null.
+TuningProfile tune(std::ostream *log = nullptr);
+
+} // namespace tuning
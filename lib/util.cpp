@@ -1,16 +1,19 @@
 #include "util.h"
-#include <sstream>
-#include <iomanip>
 #include <algorithm>
+#include <iterator>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif // __SSE2__
 
 std::string toString(const std::vector<uint8_t> &res)
 {
-  std::ostringstream os;
-  for (uint8_t it : res)
-  {
-    os << std::hex << std::setw(2) << std::setfill('0') << +it;
-  }
-  return os.str();
+  std::string result(res.size() * 2, '\0');
+  toHex(res.data(), res.size(), result.data());
+  return result;
 }
 
 std::ostream &operator<<(std::ostream &os, const std::vector<uint8_t> &res)
@@ -19,6 +22,69 @@ std::ostream &operator<<(std::ostream &os, const std::vector<uint8_t> &res)
   return os;
 }
 
+char *toHex(const uint8_t *data, size_t size, char *out)
+{
+  size_t i = 0;
+#ifdef __SSE2__
+  // Split 16 bytes into nibbles, interleave them in output order and turn every nibble into a character:
+  // '0' + n for digits and 'a' + n - 10 for letters.
+  const __m128i mask = _mm_set1_epi8(0x0f);
+  const __m128i nine = _mm_set1_epi8(9);
+  const __m128i zero = _mm_set1_epi8('0');
+  const __m128i letterShift = _mm_set1_epi8('a' - '0' - 10);
+  auto toChars = [&](__m128i nibbles) {
+    __m128i letters = _mm_and_si128(_mm_cmpgt_epi8(nibbles, nine), letterShift);
+    return _mm_add_epi8(_mm_add_epi8(nibbles, zero), letters);
+  };
+  for (; i + 16 <= size; i += 16)
+  {
+    __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+    __m128i high = _mm_and_si128(_mm_srli_epi16(bytes, 4), mask);
+    __m128i low = _mm_and_si128(bytes, mask);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 2 * i), toChars(_mm_unpacklo_epi8(high, low)));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 2 * i + 16), toChars(_mm_unpackhi_epi8(high, low)));
+  }
+#endif // __SSE2__
+  static const char digits[] = "0123456789abcdef";
+  for (; i < size; ++i)
+  {
+    out[2 * i] = digits[data[i] >> 4];
+    out[2 * i + 1] = digits[data[i] & 0x0f];
+  }
+  return out + 2 * size;
+}
+
+bool fromHex(const char *hex, size_t size, uint8_t *out)
+{
+  auto value = [](char c) -> int {
+    if (c >= '0' && c <= '9')
+    {
+      return c - '0';
+    }
+    if (c >= 'a' && c <= 'f')
+    {
+      return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F')
+    {
+      return c - 'A' + 10;
+    }
+    return -1;
+  };
+
+  for (size_t i = 0; i < size; ++i)
+  {
+    int high = value(hex[2 * i]);
+    int low = value(hex[2 * i + 1]);
+    if (high < 0 || low < 0)
+    {
+      return false;
+    }
+    out[i] = static_cast<uint8_t>(high << 4 | low);
+  }
+  return true;
+}
+
 std::vector<std::vector<uint8_t>> prepareResult(size_t size, size_t digestSize)
 {
   std::vector<std::vector<uint8_t>> result;
@@ -51,3 +117,118 @@ std::vector<std::pair<const uint8_t *, size_t>> prepareArgs(const std::vector<st
                  });
   return result;
 }
+
+std::shared_ptr<const void> mapFile(const std::string &filename, size_t &size)
+{
+  int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+  {
+    return {};
+  }
+  auto result = mapFd(fd, size);
+  close(fd);
+  return result;
+}
+
+std::shared_ptr<const void> mapFd(int fd, size_t &size)
+{
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+  {
+    return {};
+  }
+  size = st.st_size;
+  if (size == 0)
+  {
+    return std::make_shared<char>();
+  }
+  void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED)
+  {
+    return {};
+  }
+  madvise(data, size, MADV_SEQUENTIAL);
+  return std::shared_ptr<const void>(data, [size](void *ptr) { munmap(ptr, size); });
+}
+
+void putLittleEndian(uint8_t *out, uint64_t value, size_t bytes)
+{
+  for (size_t i = 0; i < bytes; ++i)
+  {
+    out[i] = static_cast<uint8_t>(value >> (i * 8));
+  }
+}
+
+uint64_t getLittleEndian(const uint8_t *in, size_t bytes)
+{
+  uint64_t result = 0;
+  for (size_t i = 0; i < bytes; ++i)
+  {
+    result |= uint64_t(in[i]) << (i * 8);
+  }
+  return result;
+}
+
+bool readAt(int fd, uint8_t *data, size_t size, uint64_t offset)
+{
+  while (size != 0)
+  {
+    ssize_t n = pread(fd, data, size, offset);
+    if (n <= 0)
+    {
+      return false;
+    }
+    data += n;
+    size -= n;
+    offset += n;
+  }
+  return true;
+}
+
+BufferedWriter::BufferedWriter(std::FILE *file, size_t capacity)
+  : m_file(file)
+  , m_buffer(capacity)
+{}
+
+BufferedWriter::~BufferedWriter() { flush(); }
+
+void BufferedWriter::write(const char *data, size_t size)
+{
+  if (size > m_buffer.size())
+  {
+    flush();
+    m_failed |= std::fwrite(data, 1, size, m_file) != size;
+    return;
+  }
+  std::copy(data, data + size, reserve(size));
+  commit(size);
+}
+
+void BufferedWriter::put(char c)
+{
+  *reserve(1) = c;
+  commit(1);
+}
+
+char *BufferedWriter::reserve(size_t size)
+{
+  if (m_buffer.size() - m_size < size)
+  {
+    flush();
+    if (m_buffer.size() < size)
+    {
+      m_buffer.resize(size);
+    }
+  }
+  return m_buffer.data() + m_size;
+}
+
+void BufferedWriter::flush()
+{
+  if (m_size != 0)
+  {
+    m_failed |= std::fwrite(m_buffer.data(), 1, m_size, m_file) != m_size;
+    m_size = 0;
+  }
+  m_failed |= std::fflush(m_file) != 0;
+}
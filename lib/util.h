@@ -1,3 +1,7 @@
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <ostream>
 #include <string>
 #include <vector>
 
@@ -5,8 +9,56 @@ std::string toString(const std::vector<uint8_t> &res);
 
 std::ostream &operator<<(std::ostream &os, const std::vector<uint8_t> &res);
 
+// Writes 2 * size lowercase hex characters to out, returns the end of written characters.
+char *toHex(const uint8_t *data, size_t size, char *out);
+
+// Parses 2 * size hex characters into out. Returns false if a character isn't a hex digit.
+bool fromHex(const char *hex, size_t size, uint8_t *out);
+
 std::vector<std::vector<uint8_t>> prepareResult(size_t size, size_t digestSize);
 
 std::vector<std::pair<const uint8_t *, size_t>> prepareArgs(const std::vector<std::string> &data);
 
 std::vector<std::pair<const uint8_t *, size_t>> prepareArgs(const std::vector<std::vector<uint8_t>> &data);
+
+// Maps the whole file read-only for sequential access, the mapping lives as long as the returned pointer.
+// Returns null if the file can't be mapped.
+std::shared_ptr<const void> mapFile(const std::string &filename, size_t &size);
+
+// Same for an open file descriptor, which may be closed afterwards.
+std::shared_ptr<const void> mapFd(int fd, size_t &size);
+
+// Little-endian integers of file formats, bytes is at most 8.
+void putLittleEndian(uint8_t *out, uint64_t value, size_t bytes);
+uint64_t getLittleEndian(const uint8_t *in, size_t bytes);
+
+// Reads exactly size bytes at offset. Returns false on error or end of file.
+bool readAt(int fd, uint8_t *data, size_t size, uint64_t offset);
+
+// Accumulates output in a large buffer and writes it to the file in big chunks without per-line flushes.
+class BufferedWriter {
+public:
+  explicit BufferedWriter(std::FILE *file, size_t capacity = 1 << 20);
+  ~BufferedWriter();
+  BufferedWriter(const BufferedWriter &) = delete;
+  BufferedWriter &operator=(const BufferedWriter &) = delete;
+
+  void write(const char *data, size_t size);
+  void write(const std::string &str) { write(str.data(), str.size()); }
+  void put(char c);
+
+  // Returns space for at least size bytes, commit tells how many of them were filled.
+  char *reserve(size_t size);
+  void commit(size_t size) { m_size += size; }
+
+  void flush();
+
+  // True once a write or flush of the file failed, e.g. on a full disk or a closed pipe.
+  bool failed() const { return m_failed; }
+
+private:
+  std::FILE *m_file;
+  std::vector<char> m_buffer;
+  size_t m_size = 0;
+  bool m_failed = false;
+};
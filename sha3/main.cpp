@@ -3,10 +3,20 @@
 #include <vector>
 #include <cassert>
 #include <cstdint>
+#include <algorithm>
+#include <optional>
+#include <cstdio>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <CLI/CLI.hpp>
 #include "util.h"
 #include "sha3_cpu.h"
 #include "sha3_gpu.h"
+#include "sha3d_client.h"
+#include "sha3d_protocol.h"
+#include "stream_reader.h"
 
 template<typename T>
 std::vector<uint8_t> doCalculation(std::istream &is, size_t digestSize, size_t bufSize)
@@ -31,19 +41,432 @@ std::vector<uint8_t> doCalculation(std::istream &is, size_t digestSize, size_t b
   return s.digest();
 }
 
+// Writes digests of consecutive pieces of the file and the top digest, SHA3 of the piece digests.
+// Hex output is "index digest" lines and a "top digest" line, binary output is the piece digests
+// followed by the top digest.
+template<typename T>
+int doPieces(const std::string &filename, size_t digestSize, size_t pieceSize, bool binary)
+{
+  size_t size = 0;
+  auto mapping = mapFile(filename, size);
+  if (!mapping)
+  {
+    std::cerr << "Can't map file " << filename << std::endl;
+    return 1;
+  }
+  const uint8_t *data = static_cast<const uint8_t *>(mapping.get());
+  const size_t pageSize = sysconf(_SC_PAGESIZE);
+
+  T sha(digestSize);
+  SHA3_cpu top(digestSize);
+  BufferedWriter out(stdout);
+  const size_t pieces = (size + pieceSize - 1) / pieceSize;
+  // Every worker gets several pieces per call, the file is read by all of them at once.
+  const size_t window = sha.batchSize() * 4;
+  auto windowBytes = [&](size_t first) { return std::min(size, (first + window) * pieceSize) - first * pieceSize; };
+
+  for (size_t first = 0; first < pieces; first += window)
+  {
+    if (first + window < pieces)
+    {
+      madvise(const_cast<uint8_t *>(data) + (first + window) * pieceSize / pageSize * pageSize,
+              windowBytes(first + window), MADV_WILLNEED);
+    }
+
+    std::vector<std::pair<const uint8_t *, size_t>> args;
+    for (size_t i = first; i < std::min(pieces, first + window); ++i)
+    {
+      args.push_back({data + i * pieceSize, std::min(pieceSize, size - i * pieceSize)});
+    }
+    auto digests = sha.calculate(args);
+
+    for (size_t i = 0; i < digests.size(); ++i)
+    {
+      top.add(digests[i].data(), digests[i].size());
+      if (binary)
+      {
+        out.write(reinterpret_cast<const char *>(digests[i].data()), digests[i].size());
+        continue;
+      }
+      out.write(std::to_string(first + i));
+      out.put(' ');
+      out.write(toString(digests[i]));
+      out.put('\n');
+    }
+    // Hashed pages aren't needed anymore.
+    madvise(const_cast<uint8_t *>(data) + first * pieceSize / pageSize * pageSize, windowBytes(first),
+            MADV_DONTNEED);
+  }
+
+  auto digest = top.digest();
+  if (binary)
+  {
+    out.write(reinterpret_cast<const char *>(digest.data()), digest.size());
+  }
+  else
+  {
+    out.write("top ", 4);
+    out.write(toString(digest));
+    out.put('\n');
+  }
+  out.flush();
+  if (out.failed())
+  {
+    std::cerr << "Can't write output" << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+// Hashes standard input or a file given as descriptor. A regular file is mapped and hashed in place,
+// other streams are read into a reusable ring by a background thread. With tee the stream is copied to stdout
+// unchanged and the digest goes to stderr.
+template<typename T>
+int doStream(int fd, size_t digestSize, bool tee)
+{
+  T sha(digestSize);
+  size_t size = 0;
+  off_t position = lseek(fd, 0, SEEK_CUR);
+  auto mapping = tee ? nullptr : mapFd(fd, size);
+  if (mapping && position >= 0 && size_t(position) <= size)
+  {
+    sha.add(static_cast<const uint8_t *>(mapping.get()) + position, size - position);
+    std::cout << sha.digest() << std::endl;
+    return 0;
+  }
+
+  StreamReader reader(fd, tee ? STDOUT_FILENO : -1);
+  while (true)
+  {
+    auto [data, chunkSize] = reader.next();
+    if (chunkSize == 0)
+    {
+      break;
+    }
+    sha.add(data, chunkSize);
+  }
+  if (!reader.error().empty())
+  {
+    std::cerr << reader.error() << std::endl;
+    return 1;
+  }
+  (tee ? std::cerr : std::cout) << sha.digest() << std::endl;
+  return 0;
+}
+
+//
+// Resumable hashing of growing files.
+//
+
+// State file, little-endian: magic, uint32 version, uint32 digest bits, uint64 device, uint64 inode,
+// uint64 offset, int64 mtime and ctime in ns, SHA3-256 of the first and of the last bytes before offset,
+// uint32 hasher state size, SHA3_cpu state.
+const char g_stateMagic[8] = {'S', 'H', 'A', '3', 'R', 'S', 'U', 'M'};
+const uint32_t g_stateVersion = 2;
+const size_t g_stateHeader = 8 + 4 + 4 + 8 + 8 + 8 + 8 + 8 + 32 + 32 + 4;
+// Bytes at the start and before the offset that must be unchanged for the state to be reused.
+// Changes between them aren't detected.
+const size_t g_edgeCheck = 4096;
+
+struct SavedFile
+{
+  uint64_t offset = 0;
+  int64_t mtime = 0;
+  int64_t ctime = 0;
+  std::vector<uint8_t> head;
+  std::vector<uint8_t> tail;
+};
+
+int64_t nanoseconds(const struct timespec &t) { return int64_t(t.tv_sec) * 1000000000 + t.tv_nsec; }
+
+std::optional<std::vector<uint8_t>> rangeDigest(int fd, uint64_t begin, size_t size)
+{
+  std::vector<uint8_t> data(size);
+  if (!readAt(fd, data.data(), size, begin))
+  {
+    return {};
+  }
+  SHA3_cpu sha(256);
+  sha.add(data.data(), data.size());
+  return sha.digest();
+}
+
+// Digests of the first and the last bytes before offset, detect a file rewritten in place from the start
+// (e.g. a reused log segment) or truncated and grown again.
+bool edgeDigests(int fd, SavedFile &saved)
+{
+  size_t size = static_cast<size_t>(std::min<uint64_t>(saved.offset, g_edgeCheck));
+  auto head = rangeDigest(fd, 0, size);
+  auto tail = rangeDigest(fd, saved.offset - size, size);
+  if (!head || !tail)
+  {
+    return false;
+  }
+  saved.head = std::move(*head);
+  saved.tail = std::move(*tail);
+  return true;
+}
+
+// Restores sha and returns the offset to continue from if the state file describes a prefix of the file.
+uint64_t resumeState(const std::string &statePath, int fd, const struct stat &st, size_t digestSize, SHA3_cpu &sha)
+{
+  std::ifstream f(statePath, std::ifstream::binary);
+  if (!f.is_open())
+  {
+    return 0;
+  }
+  std::vector<uint8_t> data((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+  if (data.size() < g_stateHeader || !std::equal(std::begin(g_stateMagic), std::end(g_stateMagic), data.begin()) ||
+      getLittleEndian(&data[8], 4) != g_stateVersion || getLittleEndian(&data[12], 4) != digestSize)
+  {
+    std::cerr << "Ignoring state file " << statePath << " of another format or digest" << std::endl;
+    return 0;
+  }
+  uint64_t offset = getLittleEndian(&data[32], 8);
+  if (getLittleEndian(&data[16], 8) != uint64_t(st.st_dev) || getLittleEndian(&data[24], 8) != uint64_t(st.st_ino) ||
+      offset > uint64_t(st.st_size))
+  {
+    std::cerr << "State file " << statePath << " belongs to another or truncated file, hashing from the start"
+              << std::endl;
+    return 0;
+  }
+  // Appending always moves the times, a file of the saved length with other times was modified in place.
+  if (offset == uint64_t(st.st_size) && (getLittleEndian(&data[40], 8) != uint64_t(nanoseconds(st.st_mtim)) ||
+                                         getLittleEndian(&data[48], 8) != uint64_t(nanoseconds(st.st_ctim))))
+  {
+    std::cerr << "File modified without growing, hashing from the start" << std::endl;
+    return 0;
+  }
+  SavedFile current;
+  current.offset = offset;
+  if (!edgeDigests(fd, current) || !std::equal(current.head.begin(), current.head.end(), &data[56]) ||
+      !std::equal(current.tail.begin(), current.tail.end(), &data[88]))
+  {
+    std::cerr << "File changed before offset " << offset << ", hashing from the start" << std::endl;
+    return 0;
+  }
+  size_t stateSize = getLittleEndian(&data[120], 4);
+  if (data.size() != g_stateHeader + stateSize || !sha.restoreState(&data[g_stateHeader], stateSize))
+  {
+    std::cerr << "Malformed state file " << statePath << ", hashing from the start" << std::endl;
+    sha.init();
+    return 0;
+  }
+  return offset;
+}
+
+// Written to a temporary file and renamed, so an interrupted run leaves the previous state.
+bool saveState(const std::string &statePath, const struct stat &st, size_t digestSize, const SavedFile &saved,
+               const std::vector<uint8_t> &state)
+{
+  std::vector<uint8_t> data(g_stateHeader);
+  std::copy(std::begin(g_stateMagic), std::end(g_stateMagic), data.begin());
+  putLittleEndian(&data[8], g_stateVersion, 4);
+  putLittleEndian(&data[12], digestSize, 4);
+  putLittleEndian(&data[16], st.st_dev, 8);
+  putLittleEndian(&data[24], st.st_ino, 8);
+  putLittleEndian(&data[32], saved.offset, 8);
+  putLittleEndian(&data[40], saved.mtime, 8);
+  putLittleEndian(&data[48], saved.ctime, 8);
+  std::copy(saved.head.begin(), saved.head.end(), &data[56]);
+  std::copy(saved.tail.begin(), saved.tail.end(), &data[88]);
+  putLittleEndian(&data[120], state.size(), 4);
+  data.insert(data.end(), state.begin(), state.end());
+
+  std::string temporary = statePath + ".tmp";
+  {
+    std::ofstream f(temporary, std::ofstream::binary | std::ofstream::trunc);
+    f.write(reinterpret_cast<const char *>(data.data()), data.size());
+    if (!f)
+    {
+      return false;
+    }
+  }
+  return std::rename(temporary.c_str(), statePath.c_str()) == 0;
+}
+
+// Absorbs only the bytes appended since the state was saved, then saves the new state and prints the digest.
+int resume(int fd, const struct stat &st, const std::string &filename, size_t digestSize, const std::string &statePath)
+{
+  SHA3_cpu sha(digestSize);
+  uint64_t offset = resumeState(statePath, fd, st, digestSize, sha);
+  const uint64_t resumed = offset;
+
+  // Appends made while hashing are absorbed as well, the saved offset is where reading stopped.
+  std::vector<uint8_t> buffer(4 * 1024 * 1024);
+  while (true)
+  {
+    ssize_t n = pread(fd, buffer.data(), buffer.size(), offset);
+    if (n < 0)
+    {
+      std::cerr << "Can't read file " << filename << std::endl;
+      return 1;
+    }
+    if (n == 0)
+    {
+      break;
+    }
+    sha.add(buffer.data(), n);
+    offset += n;
+  }
+
+  // Times after reading: the next run compares them only if nothing was appended since.
+  struct stat after;
+  SavedFile saved;
+  saved.offset = offset;
+  if (fstat(fd, &after) == 0)
+  {
+    saved.mtime = nanoseconds(after.st_mtim);
+    saved.ctime = nanoseconds(after.st_ctim);
+  }
+  if (!edgeDigests(fd, saved) || !saveState(statePath, st, digestSize, saved, sha.saveState()))
+  {
+    std::cerr << "Can't write state file " << statePath << std::endl;
+    return 1;
+  }
+  std::cerr << "Resumed at " << resumed << ", hashed " << offset - resumed << " new bytes" << std::endl;
+  std::cout << sha.digest() << std::endl;
+  return 0;
+}
+
+int doResume(const std::string &filename, size_t digestSize, const std::string &statePath)
+{
+  int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0)
+  {
+    std::cerr << "Can't open file " << filename << std::endl;
+    return 1;
+  }
+  int result = resume(fd, st, filename, digestSize, statePath);
+  close(fd);
+  return result;
+}
+
+// Passes the open file to the daemon, so it needs no access to the path.
+std::optional<std::vector<uint8_t>> daemonDigest(const std::string &socketPath, const std::string &filename,
+                                                 size_t digestSize)
+{
+  Sha3dClient client;
+  if (!client.connect(socketPath))
+  {
+    std::cerr << client.error() << std::endl;
+    return {};
+  }
+  int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+  {
+    std::cerr << "Can't open file " << filename << std::endl;
+    return {};
+  }
+  auto digest = client.hashFd(fd, 0, sha3d::toEnd, digestSize);
+  close(fd);
+  if (!digest)
+  {
+    std::cerr << "Daemon failed: " << client.error() << std::endl;
+  }
+  return digest;
+}
+
 int main(int argc, const char *argv[])
 {
   size_t digestSize = 512;
   std::string inputFile;
   bool isGpu = false;
+  size_t pieceSize = 0;
+  std::string formatName = "hex";
+  std::string socketPath;
+  std::string statePath;
+  bool tee = false;
 
   CLI::App app("SHA3 hash calculation");
   app.add_set("-d,--digest", digestSize, {224, 256, 384, 512}, "Digest length", true);
-  app.add_option("input", inputFile, "File to calculate SHA3")->check(CLI::ExistingFile);
-  app.add_flag("-g,--gpu", isGpu, "Calculate SHA3 hash usign gpu");
+  app.add_option("input", inputFile, "File to calculate SHA3, standard input if missing or -")
+      ->check([](const std::string &name) {
+        struct stat st;
+        if (name == "-")
+        {
+          return std::string();
+        }
+        if (stat(name.c_str(), &st) != 0)
+        {
+          return "File does not exist: " + name;
+        }
+        return S_ISREG(st.st_mode) || S_ISFIFO(st.st_mode) || S_ISCHR(st.st_mode) ? std::string()
+                                                                                   : "Not a file: " + name;
+      });
+  auto gpu = app.add_flag("-g,--gpu", isGpu, "Calculate SHA3 hash usign gpu");
+  auto pieces = app.add_option("-p,--piece-size", pieceSize,
+                               "Hash pieces of the given size concurrently, then the top digest of piece digests")
+                    ->check(CLI::Range(size_t(1), std::numeric_limits<size_t>::max()));
+  app.add_set("-f,--format", formatName, {"hex", "binary"},
+              "Piece list format: \"index digest\" lines or raw piece digests, the top digest is the last", true)
+      ->needs(pieces);
+  auto daemon =
+      app.add_option("-s,--daemon", socketPath, "Calculate SHA3 by the sha3d daemon listening on the socket")
+      ->excludes(pieces)
+      ->excludes(gpu);
+  auto state = app.add_option("--state-file", statePath,
+                              "Resume from the state saved by the previous run on the same growing file and save "
+                              "the new state. Only the first and last 4 KB before the saved length are verified, "
+                              "plus the times if the file didn't grow")
+                   ->excludes(pieces)
+                   ->excludes(gpu)
+                   ->excludes(daemon);
+  app.add_flag("-t,--tee", tee, "Copy the input to stdout unchanged and write the digest to stderr")
+      ->excludes(pieces)
+      ->excludes(daemon)
+      ->excludes(state);
 
   CLI11_PARSE(app, argc, argv);
 
+  bool isStdin = inputFile.empty() || inputFile == "-";
+  if (isStdin && (pieceSize != 0 || !socketPath.empty() || !statePath.empty()))
+  {
+    std::cerr << "Pieces, daemon and state file need an input file" << std::endl;
+    return 1;
+  }
+  if (isStdin || tee)
+  {
+    int fd = isStdin ? STDIN_FILENO : open(inputFile.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+      std::cerr << "Can't open file " << inputFile << std::endl;
+      return 1;
+    }
+    int result = isGpu ? doStream<SHA3_gpu>(fd, digestSize, tee) : doStream<SHA3_cpu>(fd, digestSize, tee);
+    if (!isStdin)
+    {
+      close(fd);
+    }
+    return result;
+  }
+
+  if (!statePath.empty())
+  {
+    return doResume(inputFile, digestSize, statePath);
+  }
+
+  if (!socketPath.empty())
+  {
+    if (auto digest = daemonDigest(socketPath, inputFile, digestSize))
+    {
+      std::cout << *digest << std::endl;
+      return 0;
+    }
+    std::cerr << "Calculating locally" << std::endl;
+  }
+
+  if (pieceSize != 0)
+  {
+    bool binary = formatName == "binary";
+    if (isGpu)
+    {
+      return doPieces<SHA3_gpu_batch>(inputFile, digestSize, pieceSize, binary);
+    }
+    return doPieces<SHA3_cpu_batch>(inputFile, digestSize, pieceSize, binary);
+  }
+
   std::ifstream f(inputFile, std::ifstream::binary);
 
   if (!f.is_open())
@@ -3,17 +3,42 @@
 #include <vector>
 #include <cassert>
 #include <cstdint>
+#include <algorithm>
+#include <filesystem>
+#include <map>
+#include <optional>
+#include <set>
+#include <chrono>
 #include <CLI/CLI.hpp>
 #include "util.h"
 #include "sha3_cpu.h"
 #include "sha3_gpu.h"
+#include "chunker.h"
+#include "chunk_index.h"
+#include "duplicates.h"
+#include "tuning.h"
+#include "trace.h"
 
 namespace
 {
 
+enum class Format
+{
+  Hex,    // "name digest" lines.
+  Binary, // Records: uint32 little-endian name length, name, digest.
+  Ndjson  // {"file": name, "digest": digest} lines.
+};
+
+const std::map<std::string, Format> g_formats = {
+    {"hex", Format::Hex}, {"binary", Format::Binary}, {"ndjson", Format::Ndjson}};
+
 std::optional<std::string> readFile(const std::string &filename)
 {
-  std::ifstream f(filename, std::ios::binary);
+  std::ifstream f;
+  {
+    trace::Span span("open");
+    f.open(filename, std::ios::binary);
+  }
   if (!f.is_open())
   {
     return {};
@@ -21,20 +46,87 @@ std::optional<std::string> readFile(const std::string &filename)
   f.seekg(0, std::ios::end);
   auto length = f.tellg();
   f.seekg(0, std::ios::beg);
+  trace::Span span("read", "bytes", static_cast<uint64_t>(length));
   std::string s(length, '\0');
   f.read(s.data(), length);
   return s;
 }
 
+void writeJsonString(BufferedWriter &out, const std::string &str)
+{
+  out.put('"');
+  for (char c : str)
+  {
+    if (c == '"' || c == '\\')
+    {
+      out.put('\\');
+      out.put(c);
+    }
+    else if (static_cast<unsigned char>(c) < 0x20)
+    {
+      char escaped[8];
+      int n = std::snprintf(escaped, sizeof(escaped), "\\u%04x", static_cast<unsigned>(c));
+      out.write(escaped, n);
+    }
+    else
+    {
+      out.put(c);
+    }
+  }
+  out.put('"');
+}
+
+void writeRecord(BufferedWriter &out, Format format, const std::string &name, const std::vector<uint8_t> &digest)
+{
+  switch (format)
+  {
+  case Format::Hex:
+  {
+    out.write(name);
+    char *it = out.reserve(digest.size() * 2 + 2);
+    *it++ = ' ';
+    it = toHex(digest.data(), digest.size(), it);
+    *it++ = '\n';
+    out.commit(digest.size() * 2 + 2);
+    break;
+  }
+  case Format::Binary:
+  {
+    uint32_t size = static_cast<uint32_t>(name.size());
+    const uint8_t header[4] = {uint8_t(size), uint8_t(size >> 8), uint8_t(size >> 16), uint8_t(size >> 24)};
+    out.write(reinterpret_cast<const char *>(header), sizeof(header));
+    out.write(name);
+    out.write(reinterpret_cast<const char *>(digest.data()), digest.size());
+    break;
+  }
+  case Format::Ndjson:
+  {
+    out.write("{\"file\": ", 9);
+    writeJsonString(out, name);
+    out.write(", \"digest\": \"", 13);
+    toHex(digest.data(), digest.size(), out.reserve(digest.size() * 2));
+    out.commit(digest.size() * 2);
+    out.write("\"}\n", 3);
+    break;
+  }
+  }
+}
+
 template<typename T>
-void doCalculation(const std::vector<std::string> &files, const size_t digestSize, const size_t rawBatchSize)
+int doCalculation(const std::vector<std::string> &files, const size_t digestSize, const size_t rawBatchSize,
+                   Format format)
 {
   T sha(digestSize);
+  BufferedWriter out(stdout);
 
-  // Calculate optimal batch size.
-  size_t batchSize = rawBatchSize / sha.batchSize() * sha.batchSize();
+  // The tuned batch if none is given. A given batch is a maximum, rounded down to whole rounds of worker lanes
+  // unless it is smaller than one round.
+  const size_t granularity = sha.granularity();
+  size_t batchSize = rawBatchSize == 0           ? sha.batchSize()
+                     : rawBatchSize < granularity ? rawBatchSize
+                                                  : rawBatchSize / granularity * granularity;
 
-  for (size_t i = 0; i < files.size();)
+  for (size_t i = 0, batch = 0; i < files.size(); ++batch)
   {
 
     std::vector<std::string> datas;
@@ -43,29 +135,412 @@ void doCalculation(const std::vector<std::string> &files, const size_t digestSiz
     std::vector<std::string> names;
     names.reserve(batchSize);
 
-    for (; datas.size() < batchSize && i < files.size(); ++i)
     {
-      auto data = readFile(files[i]);
-      if (!data.has_value())
+      trace::Span span("read batch", "batch", batch);
+      for (; datas.size() < batchSize && i < files.size(); ++i)
       {
-        std::cerr << "Unable to open file " << files[i] << std::endl;
-        continue;
+        auto data = readFile(files[i]);
+        if (!data.has_value())
+        {
+          std::cerr << "Unable to open file " << files[i] << std::endl;
+          continue;
+        }
+        names.push_back(files[i]);
+        datas.push_back(std::move(data.value()));
       }
-      names.push_back(files[i]);
-      datas.push_back(std::move(data.value()));
     }
 
-
-    auto args = prepareArgs(datas);
+    std::vector<std::pair<const uint8_t *, size_t>> args;
+    {
+      trace::Span span("prepare", "batch", batch);
+      args = prepareArgs(datas);
+    }
     assert(args.size() == datas.size());
-    auto results = sha.calculate(args);
+    std::vector<std::vector<uint8_t>> results;
+    {
+      trace::Span span("calculate", "batch", batch);
+      results = sha.calculate(args);
+    }
     assert(results.size() == args.size());
 
+    trace::Span span("output", "batch", batch);
     for (size_t j = 0; j < results.size(); ++j)
     {
-      std::cout << names[j] << " " << toString(results[j]) << std::endl;
+      writeRecord(out, format, names[j], results[j]);
+    }
+  }
+
+  out.flush();
+  if (out.failed())
+  {
+    std::cerr << "Unable to write output" << std::endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+//
+// Manifest verification.
+//
+
+struct ManifestEntry
+{
+  std::string name;
+  std::vector<uint8_t> digest;
+};
+
+bool isDigestSize(size_t bytes) { return bytes == 28 || bytes == 32 || bytes == 48 || bytes == 64; }
+
+// Accepts "digest  name", "digest *name" and sha3_batch's own "name digest" lines.
+bool parseManifestLine(std::string line, ManifestEntry &entry)
+{
+  if (!line.empty() && line.back() == '\r')
+  {
+    line.pop_back();
+  }
+
+  auto parseDigest = [&entry](const std::string &hex) {
+    if (hex.size() % 2 != 0 || !isDigestSize(hex.size() / 2))
+    {
+      return false;
+    }
+    entry.digest.resize(hex.size() / 2);
+    return fromHex(hex.data(), entry.digest.size(), entry.digest.data());
+  };
+
+  size_t first = line.find(' ');
+  if (first != std::string::npos && parseDigest(line.substr(0, first)))
+  {
+    size_t nameStart = first + 1;
+    if (nameStart < line.size() && (line[nameStart] == ' ' || line[nameStart] == '*'))
+    {
+      ++nameStart;
     }
+    entry.name = line.substr(nameStart);
+    return !entry.name.empty();
   }
+
+  size_t last = line.rfind(' ');
+  if (last != std::string::npos && last != 0 && parseDigest(line.substr(last + 1)))
+  {
+    entry.name = line.substr(0, last);
+    return true;
+  }
+  return false;
+}
+
+struct CheckSummary
+{
+  size_t ok = 0;
+  size_t mismatched = 0;
+  size_t unreadable = 0;
+  size_t malformed = 0;
+
+  bool failed() const { return mismatched + unreadable + malformed != 0; }
+};
+
+template<typename T>
+class ManifestChecker {
+public:
+  ManifestChecker(bool failFast, bool quiet)
+    : m_failFast(failFast)
+    , m_quiet(quiet)
+  {}
+
+  void checkChunk(std::vector<ManifestEntry> &entries)
+  {
+    struct Pending
+    {
+      ManifestEntry *entry;
+      uintmax_t size;
+    };
+    std::vector<Pending> pending;
+    for (auto &entry : entries)
+    {
+      std::error_code ec;
+      uintmax_t size = std::filesystem::file_size(entry.name, ec);
+      if (ec)
+      {
+        reportUnreadable(entry);
+        continue;
+      }
+      pending.push_back({&entry, size});
+    }
+    if (stopped())
+    {
+      return;
+    }
+
+    // Largest files first: workers finish at nearly the same time.
+    std::stable_sort(pending.begin(), pending.end(),
+                     [](const Pending &l, const Pending &r) { return l.size > r.size; });
+
+    // Manifest may mix digest sizes, every size is verified by its own engine.
+    std::map<size_t, std::vector<ManifestEntry *>> byDigest;
+    for (auto &p : pending)
+    {
+      byDigest[p.entry->digest.size()].push_back(p.entry);
+    }
+
+    for (auto &group : byDigest)
+    {
+      std::vector<std::string> datas;
+      std::vector<ManifestEntry *> checked;
+      std::vector<uint8_t> expected;
+      for (ManifestEntry *entry : group.second)
+      {
+        auto data = readFile(entry->name);
+        if (!data.has_value())
+        {
+          reportUnreadable(*entry);
+          continue;
+        }
+        datas.push_back(std::move(data.value()));
+        checked.push_back(entry);
+        expected.insert(expected.end(), entry->digest.begin(), entry->digest.end());
+      }
+
+      auto mask = engine(group.first).verify(prepareArgs(datas), expected.data());
+      for (size_t i = 0; i < checked.size(); ++i)
+      {
+        bool passed = (mask[i / 64] >> (i % 64)) & 1;
+        if (passed)
+        {
+          ++m_summary.ok;
+        }
+        else
+        {
+          ++m_summary.mismatched;
+        }
+        if (!passed || !m_quiet)
+        {
+          m_out.write(checked[i]->name);
+          m_out.write(passed ? ": OK\n" : ": FAILED\n");
+        }
+      }
+      if (stopped())
+      {
+        return;
+      }
+    }
+  }
+
+  void reportMalformed(size_t lineNumber)
+  {
+    ++m_summary.malformed;
+    m_out.flush();
+    std::cerr << "Improperly formatted manifest line " << lineNumber << std::endl;
+  }
+
+  bool stopped() const { return m_failFast && m_summary.failed(); }
+
+  const CheckSummary &summary()
+  {
+    m_out.flush();
+    return m_summary;
+  }
+
+  bool outputFailed() const { return m_out.failed(); }
+
+private:
+  T &engine(size_t digestBytes)
+  {
+    auto &ptr = m_engines[digestBytes];
+    if (!ptr)
+    {
+      ptr = std::make_unique<T>(digestBytes * 8);
+    }
+    return *ptr;
+  }
+
+  void reportUnreadable(const ManifestEntry &entry)
+  {
+    ++m_summary.unreadable;
+    m_out.write(entry.name);
+    m_out.write(": FAILED open or read\n");
+  }
+
+private:
+  bool m_failFast;
+  bool m_quiet;
+  BufferedWriter m_out{stdout};
+  CheckSummary m_summary;
+  std::map<size_t, std::unique_ptr<T>> m_engines;
+};
+
+template<typename T>
+int doCheck(const std::string &manifest, size_t chunkSize, bool failFast, bool quiet)
+{
+  std::ifstream f(manifest);
+  if (!f.is_open())
+  {
+    std::cerr << "Unable to open file " << manifest << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  ManifestChecker<T> checker(failFast, quiet);
+  std::vector<ManifestEntry> chunk;
+  chunk.reserve(chunkSize);
+  std::string line;
+  size_t lineNumber = 0;
+  while (!checker.stopped() && std::getline(f, line))
+  {
+    ++lineNumber;
+    if (line.empty())
+    {
+      continue;
+    }
+    ManifestEntry entry;
+    if (!parseManifestLine(line, entry))
+    {
+      checker.reportMalformed(lineNumber);
+      continue;
+    }
+    chunk.push_back(std::move(entry));
+    if (chunk.size() == chunkSize)
+    {
+      checker.checkChunk(chunk);
+      chunk.clear();
+    }
+  }
+  if (!chunk.empty() && !checker.stopped())
+  {
+    checker.checkChunk(chunk);
+  }
+
+  const CheckSummary &summary = checker.summary();
+  std::cerr << summary.ok << " OK, " << summary.mismatched << " FAILED, " << summary.unreadable << " unreadable, "
+            << summary.malformed << " malformed" << (checker.stopped() ? " (stopped on first failure)" : "")
+            << std::endl;
+  if (checker.outputFailed())
+  {
+    std::cerr << "Unable to write output" << std::endl;
+    return EXIT_FAILURE;
+  }
+  return summary.failed() ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+//
+// Content-defined chunking.
+//
+
+int doChunk(const std::vector<std::string> &files, size_t digestSize, const ChunkerParams &params,
+            const std::string &indexPath)
+{
+  ChunkIndexWriter index(digestSize / 8);
+  ChunkPipeline pipeline(params, digestSize, [&index](const ChunkRecord &chunk) {
+    index.add(chunk.digest, {chunk.file, chunk.offset, chunk.size});
+  });
+
+  auto start = std::chrono::steady_clock::now();
+  for (auto &name : files)
+  {
+    size_t size = 0;
+    auto mapping = mapFile(name, size);
+    if (!mapping)
+    {
+      std::cerr << "Unable to open file " << name << std::endl;
+      continue;
+    }
+    uint32_t file = index.addFile(name);
+    pipeline.add(file, static_cast<const uint8_t *>(mapping.get()), size, mapping);
+  }
+  pipeline.finish();
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  if (!index.write(indexPath))
+  {
+    std::cerr << "Unable to write index " << indexPath << std::endl;
+    return EXIT_FAILURE;
+  }
+  auto &stats = index.stats();
+  std::cerr << stats.chunks << " chunks, " << stats.uniqueChunks << " unique, " << stats.bytes << " bytes, "
+            << stats.uniqueBytes << " unique bytes, dedup ratio " << stats.dedupRatio() << ", "
+            << (seconds == 0 ? 0 : stats.bytes / seconds / 1e9) << " GB/s" << std::endl;
+  return EXIT_SUCCESS;
+}
+
+//
+// Duplicate files.
+//
+
+int doDuplicates(const std::vector<std::string> &files, size_t digestSize, size_t batchSize, Format format)
+{
+  DuplicateFinder finder(digestSize, batchSize);
+  auto start = std::chrono::steady_clock::now();
+  auto groups = finder.find(files);
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  // Groups are separated by empty lines in hex, NDJSON has one object per group.
+  BufferedWriter out(stdout);
+  for (size_t g = 0; g < groups.size(); ++g)
+  {
+    auto &group = groups[g];
+    if (format != Format::Ndjson)
+    {
+      if (g != 0 && format == Format::Hex)
+      {
+        out.put('\n');
+      }
+      for (auto &name : group.files)
+      {
+        writeRecord(out, format, name, group.digest);
+      }
+      continue;
+    }
+    out.write("{\"digest\": \"", 12);
+    toHex(group.digest.data(), group.digest.size(), out.reserve(group.digest.size() * 2));
+    out.commit(group.digest.size() * 2);
+    std::string size = "\", \"size\": " + std::to_string(group.size) + ", \"files\": [";
+    out.write(size);
+    for (size_t i = 0; i < group.files.size(); ++i)
+    {
+      if (i != 0)
+      {
+        out.write(", ", 2);
+      }
+      writeJsonString(out, group.files[i]);
+    }
+    out.write("]}\n", 3);
+  }
+  out.flush();
+  if (out.failed())
+  {
+    std::cerr << "Unable to write output" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  for (auto &name : finder.unreadable())
+  {
+    std::cerr << "Unable to open file " << name << std::endl;
+  }
+  auto &stats = finder.stats();
+  size_t duplicates = 0;
+  for (auto &group : groups)
+  {
+    duplicates += group.files.size() - 1;
+  }
+  std::cerr << stats.files << " files, " << groups.size() << " duplicate groups, " << duplicates
+            << " redundant files, " << stats.sizeCandidates << " sampled, " << stats.fullyHashed
+            << " fully hashed, " << stats.bytesRead << " of " << stats.totalBytes << " bytes read ("
+            << (stats.totalBytes == 0 ? 0 : 100.0 * stats.bytesRead / stats.totalBytes) << "%), " << seconds
+            << " s" << std::endl;
+  return stats.unreadable == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int doTune()
+{
+  std::string path = tuning::profilePath();
+  TuningProfile profile = tuning::tune(&std::cerr);
+  std::cout << "threads " << profile.threads << ", width " << profile.width << ", batch " << profile.batch
+            << std::endl;
+  if (!tuning::save(path, profile))
+  {
+    std::cerr << "Unable to write tuning profile " << path << std::endl;
+    return EXIT_FAILURE;
+  }
+  std::cerr << "Tuning profile saved to " << path << std::endl;
+  return EXIT_SUCCESS;
 }
 
 } // namespace
@@ -77,17 +552,83 @@ int main(int argc, const char *argv[])
   std::vector<std::string> inputFiles;
   std::vector<std::string> excludeFiles;
   bool isCpu = false;
+  std::string formatName = "hex";
+  std::string manifest;
+  bool failFast = false;
+  bool quiet = false;
+  std::string chunkIndex;
+  ChunkerParams chunkParams;
+  bool tune = false;
+  bool duplicates = false;
+  std::string tracePath;
 
   CLI::App app("SHA3 hash calculation");
-  app.add_set("-d,--digest", digestSize, {224, 256, 384, 512}, "Digest length", true);
+  auto digest = app.add_set("-d,--digest", digestSize, {224, 256, 384, 512}, "Digest length", true);
   app.add_option("-e,--exclude", excludeFiles, "Exclude files");
-  app.add_option("inputs", inputFiles, "Files to calculate SHA3")->check(CLI::ExistingFile)->required();
+  auto inputs = app.add_option("inputs", inputFiles, "Files to calculate SHA3")->check(CLI::ExistingFile);
   app.add_flag("-c,--cpu", isCpu, "Calculate SHA3 hash usign cpu"); // currently unsupported
-  app.add_option("-b,--batch-size", batchSize, "Maximum size of batch", true)
+  auto batch = app.add_option("-b,--batch-size", batchSize,
+                              "Maximum size of batch, cpu batches follow the tuning profile if not given", true)
       ->check(CLI::Range(size_t(1), std::numeric_limits<size_t>::max()));
+  app.add_set("-f,--format", formatName, {"hex", "binary", "ndjson"},
+              "Output format: hex lines, binary records (uint32 LE name length, name, digest) or NDJSON", true);
+  auto check = app.add_option("--check", manifest, "Verify files listed in the manifest")
+                   ->check(CLI::ExistingFile)
+                   ->excludes(inputs);
+  app.add_flag("--fail-fast", failFast, "Stop checking on the first failure")->needs(check);
+  app.add_flag("-q,--quiet", quiet, "Don't print OK for verified files")->needs(check);
+  auto chunk = app.add_option("--chunk", chunkIndex,
+                              "Split inputs into content-defined chunks (SHA3-256 unless -d is given), "
+                              "write chunk index")
+                   ->excludes(check);
+  app.add_option("--chunk-min", chunkParams.minSize, "Minimal chunk size", true)->needs(chunk);
+  app.add_option("--chunk-avg", chunkParams.avgSize, "Average chunk size", true)->needs(chunk);
+  app.add_option("--chunk-max", chunkParams.maxSize, "Maximal chunk size", true)->needs(chunk);
+  app.add_flag("--duplicates", duplicates,
+               "Print groups of files with equal content (SHA3-256 unless -d is given), hashing in stages: "
+               "sizes, first and last 64 KB, whole files")
+      ->excludes(check)
+      ->excludes(chunk);
+  app.add_option("--trace", tracePath,
+                 "Write a timeline of file reads, batch preparation, kernels per worker and output as Chrome "
+                 "trace-event JSON");
+  app.add_flag("--tune", tune, "Measure batch parameters of this host and save them to the tuning profile")
+      ->excludes(inputs)
+      ->excludes(check)
+      ->excludes(chunk);
 
   CLI11_PARSE(app, argc, argv);
 
+  // Written at exit.
+  if (!tracePath.empty())
+  {
+    trace::start(tracePath);
+  }
+
+  if (tune)
+  {
+    return doTune();
+  }
+
+  // Measured cpu batch parameters replace the default batch size.
+  const size_t tunedBatch = tuning::hostProfile().batch;
+  const bool tuned = isCpu && batch->count() == 0 && tunedBatch != 0;
+
+  if (!manifest.empty())
+  {
+    if (isCpu)
+    {
+      return doCheck<SHA3_cpu_batch>(manifest, tuned ? tunedBatch : batchSize, failFast, quiet);
+    }
+    return doCheck<SHA3_gpu_batch>(manifest, batchSize, failFast, quiet);
+  }
+
+  if (inputFiles.empty())
+  {
+    std::cerr << "Input files are required" << std::endl;
+    return EXIT_FAILURE;
+  }
+
   // Remove exclude files
   std::set<std::string> includes(inputFiles.begin(), inputFiles.end());
   std::set<std::string> excludes(excludeFiles.begin(), excludeFiles.end());
@@ -95,12 +636,28 @@ int main(int argc, const char *argv[])
   std::set_difference(includes.begin(), includes.end(), excludes.begin(), excludes.end(),
                       std::back_inserter(inputFiles));
 
-  if (isCpu)
+  if (!chunkIndex.empty())
   {
-    doCalculation<SHA3_cpu_batch>(inputFiles, digestSize, batchSize);
+    if (chunkParams.minSize > chunkParams.avgSize || chunkParams.avgSize > chunkParams.maxSize ||
+        chunkParams.avgSize < 64 || chunkParams.maxSize > std::numeric_limits<uint32_t>::max())
+    {
+      std::cerr << "Chunk sizes should satisfy 64 <= avg, min <= avg <= max < 4 GB" << std::endl;
+      return EXIT_FAILURE;
+    }
+    // Chunking runs on cpu only.
+    return doChunk(inputFiles, digest->count() == 0 ? 256 : digestSize, chunkParams, chunkIndex);
   }
-  else
+
+  Format format = g_formats.at(formatName);
+  if (duplicates)
+  {
+    // Staged hashing runs on cpu only.
+    return doDuplicates(inputFiles, digest->count() == 0 ? 256 : digestSize,
+                        batch->count() == 0 ? 0 : batchSize, format);
+  }
+  if (isCpu)
   {
-    doCalculation<SHA3_gpu_batch>(inputFiles, digestSize, batchSize);
+    return doCalculation<SHA3_cpu_batch>(inputFiles, digestSize, tuned ? 0 : batchSize, format);
   }
+  return doCalculation<SHA3_gpu_batch>(inputFiles, digestSize, batchSize, format);
 }
@@ -0,0 +1,61 @@
+#include <iostream>
+#include <csignal>
+#include <CLI/CLI.hpp>
+#include "sha3d_server.h"
+
+namespace
+{
+
+Sha3dServer *g_server = nullptr;
+
+void onSignal(int) { g_server->stop(); }
+
+} // namespace
+
+int main(int argc, const char *argv[])
+{
+  std::string socketPath = "/tmp/sha3d.sock";
+  Sha3dServer::Options options;
+  size_t window = 0;
+  std::string mode = "600";
+
+  CLI::App app("SHA3 hashing daemon, requests of concurrent clients are hashed in batches");
+  app.add_option("-s,--socket", socketPath, "Unix domain socket to listen on", true);
+  app.add_option("-t,--threads", options.threads, "Hashing threads, 0 means one per processor", true);
+  app.add_option("-b,--max-batch", options.maxBatch, "Maximal number of requests hashed at once", true)
+      ->check(CLI::Range(size_t(1), size_t(1) << 20));
+  app.add_option("-w,--batch-window", window, "Microseconds to wait for more requests before hashing a batch",
+                 true);
+  app.add_option("--max-copy", options.maxCopy,
+                 "Bytes of inputs other than sealed memfds copied per batch, larger inputs are refused", true);
+  app.add_option("-m,--mode", mode, "Octal permissions of the socket file", true)
+      ->check([](const std::string &value) {
+        return !value.empty() && value.size() <= 4 && value.find_first_not_of("01234567") == std::string::npos
+                   ? std::string()
+                   : "Mode should be octal, e.g. 660";
+      });
+
+  CLI11_PARSE(app, argc, argv);
+
+  options.window = std::chrono::microseconds(window);
+  options.socketMode = static_cast<mode_t>(std::stoul(mode, nullptr, 8));
+  Sha3dServer server(options);
+  if (!server.listen(socketPath))
+  {
+    std::cerr << server.error() << std::endl;
+    return 1;
+  }
+  g_server = &server;
+  std::signal(SIGINT, onSignal);
+  std::signal(SIGTERM, onSignal);
+  std::signal(SIGPIPE, SIG_IGN);
+
+  server.run();
+  if (!server.error().empty())
+  {
+    std::cerr << server.error() << std::endl;
+    return 1;
+  }
+  std::cerr << server.requests() << " requests in " << server.batches() << " batches" << std::endl;
+  return 0;
+}
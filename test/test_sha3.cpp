@@ -1,9 +1,34 @@
 #include "gtest/gtest.h"
 #include "sha3_gpu.h"
 #include "sha3_cpu.h"
+#include "sha3_mixed_batch.h"
+#include "sha3_constexpr.h"
+#include "kmac.h"
+#include "chunker.h"
+#include "chunk_index.h"
+#include "duplicates.h"
+#include "nonce_search.h"
+#include "sha3d_client.h"
+#include "sha3d_protocol.h"
+#include "sha3d_server.h"
+#include "sha3_multistream.h"
+#include "stream_reader.h"
 #include "util.h"
+#include "telemetry.h"
+#include "trace.h"
+#include "tuning.h"
+#include "batch_engine.h"
+#include <fstream>
 #include <string>
+#include <thread>
 #include <vector>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 namespace
 {
@@ -118,6 +143,20 @@ void largeArrayBatchTest()
   cpu.doBatchTest(vec.begin(), vec.end());
 }
 
+// Batch engines read the tuning profile of the host, a profile saved by the developer would change
+// the thread counts and kernel widths the tests exercise.
+class NoTuningProfile : public ::testing::Environment {
+public:
+  void SetUp() override
+  {
+    std::string path = ::testing::TempDir() + "sha3_no_tuning_profile";
+    std::remove(path.c_str());
+    setenv("SHA3_TUNING_PROFILE", path.c_str(), 1);
+  }
+};
+
+::testing::Environment *const g_noTuningProfile = ::testing::AddGlobalTestEnvironment(new NoTuningProfile);
+
 } // namespace
 
 TEST(sha3_checks_gpu, partial)
@@ -263,3 +302,1053 @@ TEST(sha3, large_file)
   auto resultGpuBatch = gb.calculate(batchArg).front();
   ASSERT_EQ(resultCpu, resultGpuBatch);
 }
+
+TEST(telemetry, counters)
+{
+  std::vector<uint8_t> data(1000);
+  auto before = telemetry::snapshot();
+
+  SHA3_cpu c(256);
+  c.add(data.data(), data.size());
+  c.digest();
+
+  SHA3_cpu_batch cb(256);
+  cb.calculate({{data.data(), data.size()}, {data.data(), 10}});
+
+  auto diff = telemetry::snapshot() - before;
+  if (!telemetry::compiledIn())
+  {
+    EXPECT_EQ(0u, diff.get(telemetry::Counter::BytesAbsorbed));
+    return;
+  }
+
+  // Rate of SHA3-256 is 136 bytes: 1000 bytes take 8 permutations, 10 bytes take 1.
+  EXPECT_EQ(2010u, diff.get(telemetry::Counter::BytesAbsorbed));
+  EXPECT_EQ(17u, diff.get(telemetry::Counter::Permutations));
+  EXPECT_EQ(1u, diff.get(telemetry::Kernel::Cpu));
+  EXPECT_EQ(1u, diff.get(telemetry::Kernel::CpuBatch));
+  EXPECT_EQ(1u, diff.get(telemetry::Counter::BatchCalls));
+  EXPECT_EQ(2u, diff.get(telemetry::Counter::BatchMessages));
+  EXPECT_EQ(1u, diff.batchSizes[1]);
+}
+
+TEST(util, hex)
+{
+  std::vector<uint8_t> data(70);
+  for (size_t i = 0; i < data.size(); ++i)
+  {
+    data[i] = static_cast<uint8_t>(i * 37 + 11);
+  }
+
+  for (size_t size = 0; size <= data.size(); ++size)
+  {
+    std::string expected;
+    for (size_t i = 0; i < size; ++i)
+    {
+      expected += "0123456789abcdef"[data[i] >> 4];
+      expected += "0123456789abcdef"[data[i] & 0x0f];
+    }
+    std::string hex(size * 2, '\0');
+    EXPECT_EQ(&hex[0] + hex.size(), toHex(data.data(), size, &hex[0]));
+    EXPECT_EQ(expected, hex);
+
+    std::vector<uint8_t> parsed(size);
+    EXPECT_TRUE(fromHex(hex.data(), size, parsed.data()));
+    EXPECT_TRUE(std::equal(parsed.begin(), parsed.end(), data.begin()));
+  }
+
+  uint8_t byte;
+  EXPECT_FALSE(fromHex("0g", 1, &byte));
+}
+
+TEST(util, little_endian)
+{
+  uint8_t bytes[8] = {};
+  putLittleEndian(bytes, 0x0102030405060708ull, 8);
+  EXPECT_EQ(0x08, bytes[0]);
+  EXPECT_EQ(0x01, bytes[7]);
+  EXPECT_EQ(0x0102030405060708ull, getLittleEndian(bytes, 8));
+  EXPECT_EQ(0x05060708u, getLittleEndian(bytes, 4));
+}
+
+TEST(util, buffered_writer_failure)
+{
+  std::FILE *file = std::fopen("/dev/full", "w");
+  ASSERT_NE(nullptr, file);
+  {
+    BufferedWriter out(file, 16);
+    out.write("digest\n");
+    EXPECT_FALSE(out.failed());
+    out.flush();
+    EXPECT_TRUE(out.failed());
+  }
+  std::fclose(file);
+}
+
+TEST(sha3_batch_checks_cpu, verify)
+{
+  std::vector<std::pair<const uint8_t *, size_t>> data;
+  std::vector<uint8_t> expected;
+  for (size_t i = 0; i < 70; ++i)
+  {
+    auto &pr = g_256[i % g_256.size()];
+    data.push_back({reinterpret_cast<const uint8_t *>(pr.first.data()), pr.first.size()});
+    std::vector<uint8_t> digest(32);
+    ASSERT_TRUE(fromHex(pr.second.data(), digest.size(), digest.data()));
+    // Corrupt every 3rd digest.
+    digest[i % 32] ^= i % 3 == 0;
+    expected.insert(expected.end(), digest.begin(), digest.end());
+  }
+
+  SHA3_cpu_batch cb(256);
+  auto mask = cb.verify(data, expected.data());
+  ASSERT_EQ(2u, mask.size());
+  for (size_t i = 0; i < data.size(); ++i)
+  {
+    EXPECT_EQ(i % 3 != 0, (mask[i / 64] >> (i % 64)) & 1) << i;
+  }
+}
+
+TEST(sha3_batch_checks_cpu, mixed_sizes)
+{
+  // Short and long messages mixed, so lanes are refilled at different block offsets.
+  std::vector<uint8_t> data(3000);
+  for (size_t i = 0; i < data.size(); ++i)
+  {
+    data[i] = static_cast<uint8_t>(i * 13 + i / 256);
+  }
+  std::vector<std::pair<const uint8_t *, size_t>> args;
+  for (size_t i = 0; i < 37; ++i)
+  {
+    size_t size = i % 5 == 0 ? (i * 331) % data.size() : i * 7;
+    args.push_back({data.data() + i, std::min(size, data.size() - i)});
+  }
+
+  for (size_t digest : {224, 256, 384, 512})
+  {
+    for (unsigned threads : {1u, 3u})
+    {
+      SHA3_cpu_batch cb(digest, threads);
+      auto result = cb.calculate(args);
+      SHA3_cpu cpu(digest);
+      for (size_t i = 0; i < args.size(); ++i)
+      {
+        cpu.init();
+        cpu.add(args[i].first, args[i].second);
+        EXPECT_EQ(cpu.digest(), result[i]) << digest << ' ' << i;
+      }
+      EXPECT_GT(cb.laneOccupancy(), 0.0);
+      EXPECT_LE(cb.laneOccupancy(), 1.0);
+    }
+  }
+}
+
+TEST(sha3_batch_checks_cpu, shared_prefix)
+{
+  std::vector<uint8_t> data(2000);
+  for (size_t i = 0; i < data.size(); ++i)
+  {
+    data[i] = static_cast<uint8_t>(i * 11 + i / 256);
+  }
+  std::vector<std::pair<const uint8_t *, size_t>> suffixes;
+  for (size_t size : {0, 1, 7, 70, 71, 72, 140, 500})
+  {
+    suffixes.push_back({data.data() + 1000, size});
+  }
+
+  for (size_t digest : {224, 512})
+  {
+    // Prefixes shorter than a block, ending on a block boundary and with a tail.
+    for (size_t prefixSize : {0, 5, 72, 144, 150, 700})
+    {
+      SHA3_cpu_batch cb(digest, 2);
+      auto result = cb.calculate(data.data(), prefixSize, suffixes);
+      SHA3_cpu cpu(digest);
+      for (size_t i = 0; i < suffixes.size(); ++i)
+      {
+        cpu.init();
+        cpu.add(data.data(), prefixSize);
+        cpu.add(suffixes[i].first, suffixes[i].second);
+        EXPECT_EQ(cpu.digest(), result[i]) << digest << ' ' << prefixSize << ' ' << suffixes[i].second;
+      }
+    }
+  }
+}
+
+TEST(sha3_multistream, interleaved)
+{
+  // Streams get chunks of random sizes in random order, so lanes mix streams at different offsets.
+  const size_t nStreams = 9;
+  std::vector<uint8_t> data(5000);
+  for (size_t i = 0; i < data.size(); ++i)
+  {
+    data[i] = static_cast<uint8_t>(i * 7 + i / 256);
+  }
+
+  for (size_t digest : {224, 256, 384, 512})
+  {
+    SHA3_cpu_multistream ms(digest, 2);
+    std::vector<SHA3_cpu_multistream::StreamId> ids;
+    std::vector<size_t> offsets(nStreams);
+    std::vector<size_t> lengths;
+    for (size_t s = 0; s < nStreams; ++s)
+    {
+      ids.push_back(ms.open());
+      lengths.push_back(s * 517 % data.size());
+    }
+
+    unsigned seed = 1;
+    size_t finished = 0;
+    while (finished < nStreams)
+    {
+      seed = seed * 1103515245 + 12345;
+      size_t s = (seed >> 16) % nStreams;
+      if (offsets[s] > lengths[s])
+      {
+        continue;
+      }
+      size_t chunk = std::min(lengths[s] - offsets[s], size_t((seed >> 8) % 300));
+      ms.add(ids[s], data.data() + offsets[s], chunk);
+      offsets[s] += chunk;
+      if (offsets[s] == lengths[s])
+      {
+        SHA3_cpu c(digest);
+        c.add(data.data(), lengths[s]);
+        EXPECT_EQ(toString(c.digest()), toString(ms.finish(ids[s]))) << digest << " " << s;
+        offsets[s] = lengths[s] + 1;
+        ++finished;
+      }
+    }
+    EXPECT_EQ(0u, ms.openStreams());
+  }
+}
+
+// Evaluated by the compiler.
+static_assert(sha3::digest<256>("abc")[0] == 0x3a && sha3::digest<256>("abc")[31] == 0x32);
+static_assert(sha3::key<224>("") == 0xb7db673642034e6bULL);
+static_assert(sha3::shake128<32>("")[0] == 0x7f && sha3::shake128<32>("")[31] == 0x26);
+static_assert(sha3::key<256>("get") != sha3::key<256>("put"));
+
+TEST(sha3_constexpr, matches_runtime)
+{
+  // Sizes around the rates of all digests, including several blocks.
+  std::string data;
+  for (size_t i = 0; i < 600; ++i)
+  {
+    data.push_back(static_cast<char>(i * 31 + i / 256));
+  }
+
+  auto check = [&](auto digestFn, size_t bits) {
+    SHA3_cpu cpu(bits);
+    for (size_t size : {0, 1, 71, 72, 73, 103, 104, 135, 136, 137, 143, 144, 145, 300, 600})
+    {
+      cpu.init();
+      cpu.add(reinterpret_cast<const uint8_t *>(data.data()), size);
+      auto expected = cpu.digest();
+      auto actual = digestFn(std::string_view(data.data(), size));
+      EXPECT_TRUE(std::equal(expected.begin(), expected.end(), actual.begin(), actual.end())) << bits << ' ' << size;
+    }
+  };
+  check([](std::string_view v) { return sha3::digest<224>(v); }, 224);
+  check([](std::string_view v) { return sha3::digest<256>(v); }, 256);
+  check([](std::string_view v) { return sha3::digest<384>(v); }, 384);
+  check([](std::string_view v) { return sha3::digest<512>(v); }, 512);
+
+  // Output longer than the rate needs several squeezes.
+  constexpr auto shake = sha3::shake256<200>("abc");
+  EXPECT_EQ("483366601360a8771c6863080cc4114d8db44530f8f1e1ee4f94ea37e78b5739d5a15bef186a5386c75744c0527e1faa"
+            "9f8726e462a12a4feb06bd8801e751e4",
+            toString(std::vector<uint8_t>(shake.begin(), shake.begin() + 64)));
+}
+
+TEST(kmac, nist_samples)
+{
+  std::vector<uint8_t> key;
+  for (uint8_t i = 0x40; i < 0x60; ++i)
+  {
+    key.push_back(i);
+  }
+  const uint8_t data[] = {0, 1, 2, 3};
+
+  auto mac = [&](const KeyedState &state, size_t outSize) {
+    KMAC_cpu kmac(state, outSize);
+    kmac.add(data, sizeof(data));
+    return toString(kmac.digest());
+  };
+  EXPECT_EQ("e5780b0d3ea6f7d3a429c5706aa43a00fadbd7d49628839e3187243f456ee14e",
+            mac(KeyedState::kmac(128, key.data(), key.size()), 32));
+  EXPECT_EQ("3b1fba963cd8b0b59e8c1a6d71888b7143651af8ba0a7070c0979e2811324aa5",
+            mac(KeyedState::kmac(128, key.data(), key.size(), "My Tagged Application"), 32));
+  EXPECT_EQ("20c570c31346f703c9ac36c61c03cb64c3970d0cfc787e9b79599d273a68d2f7f69d4cc3de9d104a351689f27cf6f595"
+            "1f0103f33f4f24871024d9c27773a8dd",
+            mac(KeyedState::kmac(256, key.data(), key.size(), "My Tagged Application"), 64));
+  EXPECT_EQ("c1c36925b6409a04f1b504fcbca9d82b4017277cb5ed2b2065fc1d3814d5aaf5",
+            mac(KeyedState::cshake(128, "", "Email Signature"), 32));
+  // cSHAKE without name and customization is SHAKE.
+  auto shake = sha3::shake128<32>(std::string_view(reinterpret_cast<const char *>(data), sizeof(data)));
+  EXPECT_EQ(toString(std::vector<uint8_t>(shake.begin(), shake.end())), mac(KeyedState::cshake(128, "", ""), 32));
+}
+
+TEST(kmac, batch)
+{
+  std::vector<uint8_t> data(1000);
+  for (size_t i = 0; i < data.size(); ++i)
+  {
+    data[i] = static_cast<uint8_t>(i * 7);
+  }
+  std::vector<std::pair<const uint8_t *, size_t>> args;
+  for (size_t size : {0, 1, 159, 160, 161, 166, 167, 168, 169, 400, 1000})
+  {
+    args.push_back({data.data(), size});
+  }
+
+  const uint8_t key[] = {'k', 'e', 'y'};
+  for (size_t security : {128, 256})
+  {
+    // Output longer than the rate of KMAC256 needs several squeezes.
+    for (size_t outSize : {32, 300})
+    {
+      auto state = KeyedState::kmac(security, key, sizeof(key), "x");
+      KMAC_cpu_batch batch(state, outSize, 2);
+      auto result = batch.calculate(args);
+      KMAC_cpu kmac(state, outSize);
+      for (size_t i = 0; i < args.size(); ++i)
+      {
+        kmac.init();
+        kmac.add(args[i].first, args[i].second);
+        EXPECT_EQ(kmac.digest(), result[i]) << security << ' ' << outSize << ' ' << args[i].second;
+      }
+    }
+  }
+
+  // Value of an independent implementation, squeezed over 3 blocks.
+  KMAC_cpu kmac(KeyedState::kmac(256, key, sizeof(key), "x"), 300);
+  kmac.add(data.data(), 400);
+  auto digest = kmac.digest();
+  EXPECT_EQ("a8c60650636e8ad59c713345a697eb849cc57103a0231ddf26d993fe06b7a249",
+            toString(std::vector<uint8_t>(digest.begin(), digest.begin() + 32)));
+}
+
+TEST(chunker, content_defined)
+{
+  std::vector<uint8_t> data(1 << 20);
+  uint64_t x = 1;
+  for (auto &b : data)
+  {
+    x = x * 6364136223846793005ull + 1442695040888963407ull;
+    b = static_cast<uint8_t>(x >> 56);
+  }
+  ChunkerParams params{1024, 4096, 16384};
+  FastCdc cdc(params);
+  auto cuts = [&](const uint8_t *begin, size_t size) {
+    std::vector<size_t> result;
+    for (size_t offset = 0; offset < size;)
+    {
+      size_t n = cdc.cut(begin + offset, size - offset);
+      EXPECT_TRUE(n == size - offset || (n >= params.minSize && n <= params.maxSize));
+      offset += n;
+      result.push_back(offset);
+    }
+    return result;
+  };
+
+  auto original = cuts(data.data(), data.size());
+  double average = double(data.size()) / original.size();
+  EXPECT_GT(average, params.avgSize / 2);
+  EXPECT_LT(average, params.avgSize * 2);
+
+  // Boundaries after a removed prefix are found again at the same content.
+  const size_t shift = 100;
+  auto shifted = cuts(data.data() + shift, data.size() - shift);
+  size_t common = 0;
+  for (size_t cut : shifted)
+  {
+    common += std::binary_search(original.begin(), original.end(), cut + shift);
+  }
+  EXPECT_GT(common, shifted.size() * 9 / 10);
+}
+
+TEST(chunker, pipeline_and_index)
+{
+  std::vector<uint8_t> data(300000);
+  uint64_t x = 7;
+  for (auto &b : data)
+  {
+    x = x * 6364136223846793005ull + 1442695040888963407ull;
+    b = static_cast<uint8_t>(x >> 56);
+  }
+
+  ChunkIndexWriter writer(32);
+  std::vector<ChunkRecord> records;
+  std::vector<std::vector<uint8_t>> digests;
+  {
+    // Small batches: several of them are hashed while the chunker scans.
+    ChunkPipeline pipeline(ChunkerParams{512, 2048, 8192}, 256, [&](const ChunkRecord &r) {
+      records.push_back(r);
+      digests.emplace_back(r.digest, r.digest + 32);
+      writer.add(r.digest, {r.file, r.offset, r.size});
+    }, 2, 16);
+    // The second file repeats the first one.
+    pipeline.add(writer.addFile("a"), data.data(), data.size());
+    pipeline.add(writer.addFile("b"), data.data(), data.size());
+    pipeline.finish();
+  }
+
+  ASSERT_FALSE(records.empty());
+  ASSERT_EQ(0u, records.size() % 2);
+  SHA3_cpu cpu(256);
+  uint64_t expectedOffset = 0;
+  for (size_t i = 0; i < records.size(); ++i)
+  {
+    auto &r = records[i];
+    EXPECT_EQ(i < records.size() / 2 ? 0u : 1u, r.file);
+    expectedOffset = i == records.size() / 2 ? 0 : expectedOffset;
+    EXPECT_EQ(expectedOffset, r.offset);
+    expectedOffset += r.size;
+    cpu.init();
+    cpu.add(data.data() + r.offset, r.size);
+    EXPECT_EQ(cpu.digest(), digests[i]);
+  }
+
+  std::string path = ::testing::TempDir() + "sha3_chunk_index";
+  ASSERT_TRUE(writer.write(path));
+  EXPECT_EQ(records.size(), writer.stats().chunks);
+  EXPECT_NEAR(2.0, writer.stats().dedupRatio(), 0.01);
+
+  ChunkIndex index;
+  ASSERT_TRUE(index.open(path));
+  EXPECT_EQ(32u, index.digestSize());
+  EXPECT_EQ("b", index.fileName(1));
+  for (size_t i = 0; i < records.size(); ++i)
+  {
+    auto location = index.find(digests[i].data());
+    ASSERT_TRUE(location.has_value());
+    // Duplicates point to the first occurrence.
+    EXPECT_EQ(0u, location->file);
+    EXPECT_EQ(records[i].size, location->size);
+  }
+  std::vector<uint8_t> missing(32);
+  EXPECT_FALSE(index.find(missing.data()).has_value());
+  std::remove(path.c_str());
+}
+
+TEST(nonce_search, smallest_nonce)
+{
+  std::vector<uint8_t> challenge(300);
+  for (size_t i = 0; i < challenge.size(); ++i)
+  {
+    challenge[i] = static_cast<uint8_t>(i * 5 + 1);
+  }
+
+  // Challenge tails put the nonce inside a word, across words and across the last block boundary.
+  for (size_t size : {0, 13, 130, 135, 300})
+  {
+    for (size_t nonceSize : {3, 8})
+    {
+      const unsigned zeroBits = 9;
+      const uint64_t first = 1000;
+      SHA3_cpu cpu(256);
+      uint64_t expected = first;
+      for (;; ++expected)
+      {
+        uint8_t bytes[8];
+        for (size_t i = 0; i < nonceSize; ++i)
+        {
+          bytes[i] = static_cast<uint8_t>(expected >> (i * 8));
+        }
+        cpu.init();
+        cpu.add(challenge.data(), size);
+        cpu.add(bytes, nonceSize);
+        if (NonceSearch::leadingZeroBits(cpu.digest()) >= zeroBits)
+        {
+          break;
+        }
+      }
+
+      NonceSearch search(256, 3);
+      auto found = search.search(challenge.data(), size, zeroBits, nonceSize, first);
+      ASSERT_TRUE(found.has_value());
+      EXPECT_EQ(expected, *found) << size << ' ' << nonceSize;
+      EXPECT_GE(search.attempts(), expected - first + 1);
+
+      EXPECT_FALSE(search.search(challenge.data(), size, zeroBits, nonceSize, first, expected - first).has_value());
+    }
+  }
+
+  EXPECT_EQ(12u, NonceSearch::leadingZeroBits({0, 0x08, 0xff}));
+}
+
+TEST(sha3d, round_trip)
+{
+  std::vector<uint8_t> data(10000);
+  for (size_t i = 0; i < data.size(); ++i)
+  {
+    data[i] = static_cast<uint8_t>(i * 7 + 3);
+  }
+  std::string file = ::testing::TempDir() + "sha3d_input";
+  {
+    std::ofstream f(file, std::ofstream::binary);
+    f.write(reinterpret_cast<const char *>(data.data()), data.size());
+  }
+  auto expected = [&](size_t bits, size_t offset, size_t size) {
+    SHA3_cpu cpu(bits);
+    cpu.add(data.data() + offset, size);
+    return cpu.digest();
+  };
+
+  std::string socketPath = ::testing::TempDir() + "sha3d_test.sock";
+  Sha3dServer server(Sha3dServer::Options{2, 16, std::chrono::microseconds(200)});
+  ASSERT_TRUE(server.listen(socketPath)) << server.error();
+  struct stat st;
+  ASSERT_EQ(0, stat(socketPath.c_str(), &st));
+  EXPECT_EQ(0600u, st.st_mode & 0777);
+  std::thread serving([&] { server.run(); });
+
+  // Concurrent clients land in shared batches.
+  std::vector<std::thread> clients;
+  std::vector<int> results(4);
+  for (size_t c = 0; c < results.size(); ++c)
+  {
+    clients.emplace_back([&, c] {
+      Sha3dClient client;
+      bool ok = client.connect(socketPath);
+      for (size_t i = 0; ok && i < 20; ++i)
+      {
+        ok = client.hashFile(file, 256) == expected(256, 0, data.size());
+      }
+      results[c] = ok;
+    });
+  }
+  for (auto &client : clients)
+  {
+    client.join();
+  }
+  for (int ok : results)
+  {
+    EXPECT_TRUE(ok);
+  }
+
+  Sha3dClient client;
+  ASSERT_TRUE(client.connect(socketPath)) << client.error();
+  SharedBuffer buffer;
+  ASSERT_TRUE(buffer.create(data.size()));
+  std::copy(data.begin(), data.end(), buffer.data());
+  EXPECT_EQ(expected(512, 0, 1000), client.hashBuffer(buffer, 1000, 512));
+  EXPECT_EQ(expected(224, 100, 5000), client.hashFd(buffer.fd(), 100, 5000, 224));
+  EXPECT_EQ(expected(384, 9000, 1000), client.hashFd(buffer.fd(), 9000, sha3d::toEnd, 384));
+
+  EXPECT_FALSE(client.hashFile(file + "_missing", 256).has_value());
+  EXPECT_FALSE(client.hashFd(buffer.fd(), data.size() + 1, 1, 256).has_value());
+  EXPECT_FALSE(client.hashFile(file, 100).has_value());
+  // The connection survives failed requests.
+  EXPECT_EQ(expected(256, 0, data.size()), client.hashFile(file, 256));
+
+  server.stop();
+  serving.join();
+  EXPECT_TRUE(server.error().empty());
+  EXPECT_EQ(84u, server.requests());
+  EXPECT_LE(server.batches(), server.requests());
+  std::remove(file.c_str());
+}
+
+TEST(sha3d, shrunk_input)
+{
+  std::vector<uint8_t> data(1 << 20, 0x5a);
+  SHA3_cpu cpu(256);
+  cpu.add(data.data(), data.size());
+  const auto expected = cpu.digest();
+
+  std::string socketPath = ::testing::TempDir() + "sha3d_shrink.sock";
+  Sha3dServer server(Sha3dServer::Options{1, 16, std::chrono::milliseconds(200)});
+  ASSERT_TRUE(server.listen(socketPath)) << server.error();
+  std::thread serving([&] { server.run(); });
+
+  // An unsealed memfd is copied when the request arrives, shrinking it while the request waits
+  // for its batch can't crash the daemon.
+  int fd = memfd_create("sha3d_test", MFD_CLOEXEC);
+  ASSERT_GE(fd, 0);
+  ASSERT_EQ(ssize_t(data.size()), write(fd, data.data(), data.size()));
+  std::optional<Sha3dClient::Digest> digest;
+  std::thread request([&] {
+    Sha3dClient client;
+    if (client.connect(socketPath))
+    {
+      digest = client.hashFd(fd, 0, sha3d::toEnd, 256);
+    }
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  ASSERT_EQ(0, ftruncate(fd, 0));
+  request.join();
+  close(fd);
+  EXPECT_EQ(expected, digest);
+
+  // SharedBuffer can't shrink, once sealed against writes it is mapped.
+  Sha3dClient client;
+  ASSERT_TRUE(client.connect(socketPath)) << client.error();
+  SharedBuffer buffer;
+  ASSERT_TRUE(buffer.create(data.size()));
+  std::copy(data.begin(), data.end(), buffer.data());
+  EXPECT_NE(0, ftruncate(buffer.fd(), 0));
+  EXPECT_EQ(expected, client.hashBuffer(buffer, data.size(), 256));
+  ASSERT_TRUE(buffer.seal());
+  EXPECT_EQ(F_SEAL_WRITE, fcntl(buffer.fd(), F_GET_SEALS) & F_SEAL_WRITE);
+  EXPECT_EQ(expected, client.hashBuffer(buffer, data.size(), 256));
+
+  server.stop();
+  serving.join();
+  EXPECT_TRUE(server.error().empty());
+  EXPECT_EQ(3u, server.requests());
+}
+
+TEST(sha3d, batch_limit)
+{
+  std::string file = ::testing::TempDir() + "sha3d_batch_input";
+  {
+    std::ofstream f(file, std::ofstream::binary);
+    f << "batch limit";
+  }
+  std::string socketPath = ::testing::TempDir() + "sha3d_batch.sock";
+  Sha3dServer server(Sha3dServer::Options{1, 2, std::chrono::microseconds(0)});
+  ASSERT_TRUE(server.listen(socketPath)) << server.error();
+
+  // Requests queued before the daemon runs are still hashed at most maxBatch at once.
+  sockaddr_un address{};
+  address.sun_family = AF_UNIX;
+  std::copy(socketPath.begin(), socketPath.end(), address.sun_path);
+  int client = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  ASSERT_EQ(0, connect(client, reinterpret_cast<sockaddr *>(&address), sizeof(address)));
+  int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+  ASSERT_GE(fd, 0);
+  for (uint64_t id = 0; id < 10; ++id)
+  {
+    sha3d::RequestHeader header;
+    header.source = uint16_t(sha3d::Source::Fd);
+    header.digestBits = 256;
+    header.id = id;
+    iovec iov{&header, sizeof(header)};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+    msghdr message{};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    cmsghdr *c = CMSG_FIRSTHDR(&message);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int));
+    std::memcpy(CMSG_DATA(c), &fd, sizeof(int));
+    ASSERT_GT(sendmsg(client, &message, 0), 0);
+  }
+  close(fd);
+
+  std::thread serving([&] { server.run(); });
+  for (size_t i = 0; i < 10; ++i)
+  {
+    uint8_t response[sha3d::maxResponse];
+    sha3d::ResponseHeader header;
+    ASSERT_GE(recv(client, response, sizeof(response), 0), ssize_t(sizeof(header)));
+    std::memcpy(&header, response, sizeof(header));
+    EXPECT_EQ(0, header.status);
+  }
+  server.stop();
+  serving.join();
+  close(client);
+  EXPECT_EQ(10u, server.requests());
+  EXPECT_EQ(5u, server.batches());
+  std::remove(file.c_str());
+}
+
+TEST(tuning, profile_and_width)
+{
+  std::string path = ::testing::TempDir() + "sha3_tuning/profile";
+  ASSERT_TRUE(tuning::save(path, TuningProfile{3, 1, 48}));
+  auto profile = tuning::load(path);
+  ASSERT_TRUE(profile.has_value());
+  EXPECT_EQ(3u, profile->threads);
+  EXPECT_EQ(1u, profile->width);
+  EXPECT_EQ(48u, profile->batch);
+  EXPECT_FALSE(tuning::load(path + "_missing").has_value());
+  EXPECT_EQ(::testing::TempDir() + "sha3_no_tuning_profile", tuning::profilePath());
+  EXPECT_EQ(TuningProfile().batch, tuning::hostProfile().batch);
+  std::remove(path.c_str());
+
+  // Every kernel width gives the same digests.
+  std::vector<std::vector<uint8_t>> datas;
+  for (size_t size = 0; size < 700; size += 37)
+  {
+    datas.emplace_back(size, static_cast<uint8_t>(size));
+  }
+  for (size_t width = 1; width <= keccak::lanes; ++width)
+  {
+    keccak::BatchEngine engine(2, width);
+    EXPECT_EQ(width, engine.width());
+    std::vector<std::vector<uint8_t>> digests(datas.size());
+    engine.run(
+        datas.size(),
+        [&](size_t i) {
+          keccak::BatchMessage m;
+          m.rate = keccak::rate(256);
+          m.data = {datas[i].data(), datas[i].size()};
+          return m;
+        },
+        [&](size_t i, const uint64_t *A) {
+          digests[i].resize(32);
+          keccak::copyLittleEndian64(A, digests[i].data(), 32);
+        });
+    for (size_t i = 0; i < datas.size(); ++i)
+    {
+      SHA3_cpu cpu(256);
+      cpu.add(datas[i].data(), datas[i].size());
+      EXPECT_EQ(cpu.digest(), digests[i]) << width << ' ' << i;
+    }
+  }
+}
+
+TEST(duplicates, staged_groups)
+{
+  auto writeFile = [](const std::string &name, const std::vector<uint8_t> &data) {
+    std::ofstream f(name, std::ofstream::binary);
+    f.write(reinterpret_cast<const char *>(data.data()), data.size());
+  };
+  std::vector<uint8_t> large(300000);
+  for (size_t i = 0; i < large.size(); ++i)
+  {
+    large[i] = static_cast<uint8_t>(i * 13 + i / 1000);
+  }
+  // Same size, head and tail as large, differs in the middle only.
+  std::vector<uint8_t> middle = large;
+  middle[150000] ^= 1;
+  std::vector<uint8_t> small(1000, 'x');
+  std::vector<uint8_t> otherSmall(1000, 'y');
+
+  std::string dir = ::testing::TempDir();
+  std::vector<std::pair<std::string, std::vector<uint8_t>>> contents = {
+      {"dup_large1", large}, {"dup_small1", small},  {"dup_middle", middle},  {"dup_large2", large},
+      {"dup_other", otherSmall}, {"dup_small2", small}, {"dup_unique", {1, 2, 3}}};
+  std::vector<std::string> files;
+  for (auto &[name, data] : contents)
+  {
+    files.push_back(dir + name);
+    writeFile(files.back(), data);
+  }
+  files.push_back(dir + "dup_missing");
+
+  DuplicateFinder finder(256, 2, 2);
+  auto groups = finder.find(files);
+  ASSERT_EQ(2u, groups.size());
+  EXPECT_EQ(large.size(), groups[0].size);
+  EXPECT_EQ((std::vector<std::string>{dir + "dup_large1", dir + "dup_large2"}), groups[0].files);
+  EXPECT_EQ((std::vector<std::string>{dir + "dup_small1", dir + "dup_small2"}), groups[1].files);
+  SHA3_cpu cpu(256);
+  cpu.add(large.data(), large.size());
+  EXPECT_EQ(cpu.digest(), groups[0].digest);
+  cpu.init();
+  cpu.add(small.data(), small.size());
+  EXPECT_EQ(cpu.digest(), groups[1].digest);
+
+  auto &stats = finder.stats();
+  EXPECT_EQ(8u, stats.files);
+  EXPECT_EQ(1u, stats.unreadable);
+  EXPECT_EQ(6u, stats.sizeCandidates);
+  EXPECT_EQ(3u, stats.fullyHashed);
+  EXPECT_EQ(3 * 2 * DuplicateFinder::sampleSize + 3000 + 3 * large.size(), stats.bytesRead);
+  for (auto &name : files)
+  {
+    std::remove(name.c_str());
+  }
+}
+
+TEST(sha3_batch_checks_cpu, fragments)
+{
+  std::vector<uint8_t> data(6000);
+  for (size_t i = 0; i < data.size(); ++i)
+  {
+    data[i] = static_cast<uint8_t>(i * 3 + 1);
+  }
+
+  // Fragment lists of every message: empty fragments, fragments inside a block and across blocks.
+  std::vector<std::vector<iovec>> lists;
+  std::vector<std::vector<uint8_t>> expected;
+  uint64_t x = 5;
+  for (size_t m = 0; m < 23; ++m)
+  {
+    std::vector<iovec> list;
+    size_t offset = 0;
+    size_t count = m % 7 == 0 ? m / 7 : m % 5 + 1;
+    for (size_t f = 0; f < count; ++f)
+    {
+      x = x * 6364136223846793005ull + 1442695040888963407ull;
+      size_t size = f % 3 == 2 ? 0 : (x >> 40) % (m < 10 ? 150 : 1200);
+      list.push_back({data.data() + offset, size});
+      offset += size;
+    }
+    SHA3_cpu cpu(256);
+    cpu.add(data.data(), offset);
+    expected.push_back(cpu.digest());
+
+    SHA3_cpu streaming(256);
+    streaming.add(list.data(), list.size());
+    EXPECT_EQ(expected.back(), streaming.digest()) << m;
+    lists.push_back(std::move(list));
+  }
+
+  std::vector<std::pair<const iovec *, size_t>> messages;
+  for (auto &list : lists)
+  {
+    messages.emplace_back(list.data(), list.size());
+  }
+  SHA3_cpu_batch batch(256, 2);
+  EXPECT_EQ(expected, batch.calculate(messages));
+}
+
+TEST(sha3_batch_checks_cpu, streaming_sink)
+{
+  // More messages than the reorder window, every tenth one long so that digests complete out of order.
+  std::vector<std::vector<uint8_t>> datas;
+  for (size_t i = 0; i < 70000; ++i)
+  {
+    datas.emplace_back(i % 10 == 0 ? 3000 : i % 50, static_cast<uint8_t>(i));
+  }
+  auto args = prepareArgs(datas);
+  SHA3_cpu_batch batch(256, 3);
+  auto expected = batch.calculate(args);
+
+  std::vector<size_t> order;
+  bool matched = true;
+  batch.calculate(
+      args,
+      [&](size_t i, const uint8_t *digest, size_t size) {
+        order.push_back(i);
+        matched = matched && std::equal(digest, digest + size, expected[i].begin(), expected[i].end());
+      },
+      true);
+  EXPECT_TRUE(matched);
+  ASSERT_EQ(datas.size(), order.size());
+  for (size_t i = 0; i < order.size(); ++i)
+  {
+    ASSERT_EQ(i, order[i]);
+  }
+
+  std::vector<std::atomic<int>> seen(datas.size());
+  std::atomic<bool> unorderedMatched{true};
+  batch.calculate(
+      args,
+      [&](size_t i, const uint8_t *digest, size_t size) {
+        seen[i].fetch_add(1);
+        if (!std::equal(digest, digest + size, expected[i].begin(), expected[i].end()))
+        {
+          unorderedMatched = false;
+        }
+      },
+      false);
+  EXPECT_TRUE(unorderedMatched);
+  EXPECT_TRUE(std::all_of(seen.begin(), seen.end(), [](const std::atomic<int> &n) { return n == 1; }));
+}
+
+TEST(sha3_checks_cpu, save_restore_state)
+{
+  std::vector<uint8_t> data(1000);
+  for (size_t i = 0; i < data.size(); ++i)
+  {
+    data[i] = static_cast<uint8_t>(i * 11);
+  }
+  for (size_t split : {0, 1, 135, 136, 500})
+  {
+    SHA3_cpu first(256);
+    first.add(data.data(), split);
+    auto state = first.saveState();
+
+    SHA3_cpu second(256);
+    ASSERT_TRUE(second.restoreState(state.data(), state.size()));
+    second.add(data.data() + split, data.size() - split);
+    first.add(data.data() + split, data.size() - split);
+    EXPECT_EQ(first.digest(), second.digest()) << split;
+
+    SHA3_cpu other(512);
+    EXPECT_FALSE(other.restoreState(state.data(), state.size()));
+    EXPECT_FALSE(second.restoreState(state.data(), state.size() - 1));
+  }
+}
+
+TEST(sha3_mixed_batch, matches_single)
+{
+  const HashAlgorithm algorithms[] = {HashAlgorithm::SHA3_224, HashAlgorithm::SHA3_256, HashAlgorithm::SHA3_384,
+                                      HashAlgorithm::SHA3_512, HashAlgorithm::SHAKE128, HashAlgorithm::SHAKE256};
+  std::vector<std::vector<uint8_t>> datas;
+  std::vector<MixedMessage> messages;
+  for (size_t i = 0; i < 100; ++i)
+  {
+    datas.emplace_back(i * 37 % 700, static_cast<uint8_t>(i));
+  }
+  for (size_t i = 0; i < datas.size(); ++i)
+  {
+    HashAlgorithm algorithm = algorithms[i % 6];
+    // SHAKE outputs both shorter and longer than the rate.
+    size_t outSize = SHA3_cpu_mixed_batch::digestSize(algorithm) == 0 ? 1 + i * 7 % 400 : 0;
+    messages.push_back({algorithm, datas[i].data(), datas[i].size(), outSize});
+  }
+
+  SHA3_cpu_mixed_batch batch(3);
+  auto digests = batch.calculate(messages);
+  ASSERT_EQ(messages.size(), digests.size());
+  const uint64_t zero[25] = {};
+  for (size_t i = 0; i < messages.size(); ++i)
+  {
+    auto &m = messages[i];
+    size_t digestSize = SHA3_cpu_mixed_batch::digestSize(m.algorithm);
+    SHA3_cpu single = digestSize != 0 ? SHA3_cpu(digestSize * 8)
+                                      : SHA3_cpu(zero, SHA3_cpu_mixed_batch::rate(m.algorithm), 0x1f, m.outSize);
+    single.add(m.data, m.size);
+    EXPECT_EQ(toString(single.digest()), toString(digests[i])) << i;
+  }
+}
+
+TEST(keccak, scalar_lanes)
+{
+  uint64_t lanesA[keccak::stateWords * keccak::lanes];
+  for (size_t i = 0; i < keccak::stateWords * keccak::lanes; ++i)
+  {
+    lanesA[i] = i * 0x9e3779b97f4a7c15ull;
+  }
+  for (size_t count = 1; count <= keccak::scalarLanes; ++count)
+  {
+    uint64_t expected[keccak::lanes][keccak::stateWords];
+    for (size_t l = 0; l < keccak::lanes; ++l)
+    {
+      keccak::scatterLane(lanesA, l, expected[l]);
+      if (l < count)
+      {
+        keccak::permute(expected[l]);
+      }
+    }
+    // Lanes past count are left as they are.
+    keccak::updateStatesScalar(lanesA, count);
+    for (size_t l = 0; l < keccak::lanes; ++l)
+    {
+      uint64_t A[keccak::stateWords];
+      keccak::scatterLane(lanesA, l, A);
+      EXPECT_TRUE(std::equal(A, A + keccak::stateWords, expected[l])) << count << ' ' << l;
+    }
+  }
+}
+
+TEST(stream_reader, pipe_and_tee)
+{
+  std::vector<uint8_t> data(3 * 100000 + 17);
+  for (size_t i = 0; i < data.size(); ++i)
+  {
+    data[i] = static_cast<uint8_t>(i * 131 >> 3);
+  }
+  SHA3_cpu expected(256);
+  expected.add(data.data(), data.size());
+
+  // Without a tee descriptor, with tee(2) between pipes and with writes to a socket.
+  for (int mode = 0; mode < 3; ++mode)
+  {
+    int in[2];
+    int out[2] = {-1, -1};
+    ASSERT_EQ(0, pipe(in));
+    if (mode == 1)
+    {
+      ASSERT_EQ(0, pipe(out));
+    }
+    else if (mode == 2)
+    {
+      ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, out));
+    }
+    std::thread writer([&]() {
+      for (size_t written = 0; written < data.size();)
+      {
+        ssize_t n = write(in[1], data.data() + written, std::min<size_t>(data.size() - written, 7000));
+        ASSERT_GT(n, 0);
+        written += n;
+      }
+      close(in[1]);
+    });
+    std::vector<uint8_t> forwarded;
+    std::thread drain([&]() {
+      uint8_t buffer[4096];
+      ssize_t n;
+      while (out[0] >= 0 && (n = read(out[0], buffer, sizeof(buffer))) > 0)
+      {
+        forwarded.insert(forwarded.end(), buffer, buffer + n);
+      }
+    });
+
+    SHA3_cpu sha(256);
+    {
+      StreamReader reader(in[0], mode == 0 ? -1 : out[1], 65536, 3);
+      for (auto chunk = reader.next(); chunk.second != 0; chunk = reader.next())
+      {
+        sha.add(chunk.first, chunk.second);
+      }
+      EXPECT_EQ("", reader.error());
+    }
+    writer.join();
+    close(in[0]);
+    if (mode != 0)
+    {
+      close(out[1]);
+    }
+    drain.join();
+    if (mode != 0)
+    {
+      close(out[0]);
+      EXPECT_TRUE(forwarded == data) << mode;
+    }
+    EXPECT_EQ(expected.digest(), sha.digest()) << mode;
+  }
+}
+
+TEST(trace, spans_json)
+{
+  auto readAll = [](const std::string &path) {
+    std::ifstream f(path);
+    return std::string(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+  };
+  std::string path = ::testing::TempDir() + "sha3_trace.json";
+
+  {
+    trace::Span off("not traced");
+  }
+  ASSERT_TRUE(trace::start(path));
+  EXPECT_FALSE(trace::start(path));
+  {
+    trace::Span span("test span", "value", 42);
+  }
+  std::vector<std::vector<uint8_t>> datas(9, std::vector<uint8_t>(300, 1));
+  keccak::BatchEngine engine(2, 1);
+  engine.run(
+      datas.size(),
+      [&](size_t i) {
+        keccak::BatchMessage m;
+        m.rate = keccak::rate(256);
+        m.data = {datas[i].data(), datas[i].size()};
+        return m;
+      },
+      [](size_t, const uint64_t *) {});
+  ASSERT_TRUE(trace::stop());
+  EXPECT_FALSE(trace::stop());
+
+  std::string json = readAll(path);
+  EXPECT_EQ(0u, json.find("{\"traceEvents\":["));
+  EXPECT_NE(std::string::npos, json.find("\"name\":\"test span\""));
+  EXPECT_NE(std::string::npos, json.find("\"args\":{\"value\":42}"));
+  EXPECT_NE(std::string::npos, json.find("\"name\":\"hash\""));
+  EXPECT_EQ(std::string::npos, json.find("not traced"));
+  EXPECT_NE(std::string::npos, json.find("\"droppedSpans\":0}"));
+
+  // A full ring keeps the latest spans.
+  ASSERT_TRUE(trace::start(path, 4));
+  for (size_t i = 0; i < 10; ++i)
+  {
+    trace::Span span("ring", "i", i);
+  }
+  ASSERT_TRUE(trace::stop());
+  json = readAll(path);
+  EXPECT_EQ(std::string::npos, json.find("\"i\":5}"));
+  EXPECT_NE(std::string::npos, json.find("\"i\":6}"));
+  EXPECT_NE(std::string::npos, json.find("\"i\":9}"));
+  EXPECT_NE(std::string::npos, json.find("\"droppedSpans\":6}"));
+  std::remove(path.c_str());
+}